@@ -21,12 +21,416 @@ if (-not $config) {
 # Path to simpleArcParse program
 $simpleArcParse = $config.simple_arc_parse_path
 
+# Always test the parser itself, rather than previously cached results
+$env:SIMPLEARCPARSE_CACHE = 'off'
+
 
 describe 'simpleArcParse version' {
     $version = (& $simpleArcParse version)
 
-    it 'version should be v2.4.1' {
-        $version | Should BeExactly 'v2.4.1'
+    it 'version should be v2.5.0' {
+        $version | Should BeExactly 'v2.5.0'
+    }
+}
+
+describe 'simpleArcParse vector kernels' {
+    $checked = (& $simpleArcParse check_kernels)
+    $code = $LASTEXITCODE
+
+    it 'should match the scalar kernels' {
+        $code | Should Be 0
+        [int]$checked | Should Not BeLessThan 0
+    }
+}
+
+describe 'simpleArcParse batch' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $missing = Join-Path $test_data_dir 'missing-test-log.evtc'
+    $records = @(& $simpleArcParse batch $siax $missing | ForEach-Object { $_ | ConvertFrom-Json })
+
+    it 'should output one record per log' {
+        $records.Length | Should Be 2
+    }
+    it 'should include the path of each log' {
+        $records[0].path | Should BeExactly $siax
+        $records[1].path | Should BeExactly $missing
+    }
+    it 'should output the same data as json' {
+        $records[0].boss.name | Should BeExactly 'Siax'
+        $records[0].local_time.start | Should BeExactly 933570140
+    }
+    it 'should report errors inline' {
+        $records[1].error.code | Should Be -2
+    }
+}
+
+describe 'simpleArcParse serve' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $requests = @(
+        @{ id = 1; type = 'players'; path = $siax }
+        @{ id = 2; type = 'json'; path = $siax }
+        @{ id = 3; type = 'json'; path = (Join-Path $test_data_dir 'missing-test-log.evtc') }
+        @{ id = 4; type = 'header'; path = '-' }
+        @{ id = 5; type = 'players'; path = $siax }
+    ) | ForEach-Object { $_ | ConvertTo-Json -Compress }
+
+    $responses = @{}
+    $requests | & $simpleArcParse serve | ForEach-Object {
+        $response = $_ | ConvertFrom-Json
+        $responses[[int]$response.id] = $response
+    }
+
+    it 'should answer every request' {
+        $responses.Count | Should Be 5
+    }
+    it 'should output the same lines as the command line' {
+        ($responses[1].result -join ',') | Should BeExactly ((& $simpleArcParse players $siax) -join ',')
+    }
+    it 'should output the same data as json' {
+        $responses[2].result.boss.name | Should BeExactly 'Siax'
+    }
+    it 'should report errors inline' {
+        $responses[3].error.code | Should Be -2
+    }
+    it 'should not read logs from standard input' {
+        $responses[4].error.code | Should Be -29
+        ($responses[5].result -join ',') | Should BeExactly ($responses[1].result -join ',')
+    }
+}
+
+describe 'simpleArcParse cache' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $cache = Join-Path $TestDrive 'cache'
+
+    $env:SIMPLEARCPARSE_CACHE = $cache
+    $parsed = (& $simpleArcParse json $siax) -join "`n"
+    $cached = (& $simpleArcParse json $siax) -join "`n"
+    $env:SIMPLEARCPARSE_CACHE = 'off'
+
+    it 'should store one entry per log' {
+        @(Get-ChildItem $cache).Length | Should Be 1
+    }
+    it 'should output the same json from the cache' {
+        $cached | Should BeExactly $parsed
+    }
+}
+
+describe 'simpleArcParse log start' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $restarted = Join-Path $TestDrive 'restarted.evtc'
+
+    # Copy the log start event, which is the first combat event, over an
+    # event in the middle of the log and move its server time one second on
+    $bytes = [System.IO.File]::ReadAllBytes((Resolve-Path $siax))
+    $agents = [System.BitConverter]::ToUInt32($bytes, 16)
+    $skills = [System.BitConverter]::ToUInt32($bytes, 20 + 96 * $agents)
+    $first = 24 + 96 * $agents + 68 * $skills
+    $middle = $first + 64 * [math]::Floor(($bytes.Length - $first) / 128)
+    [System.Array]::Copy($bytes, $first + 8, $bytes, $middle + 8, 56)
+    $value = [System.BitConverter]::ToInt32($bytes, $middle + 24) + 1000
+    [System.Array]::Copy([System.BitConverter]::GetBytes([int32]$value), 0, $bytes, $middle + 24, 4)
+    [System.IO.File]::WriteAllBytes($restarted, $bytes)
+
+    $json = (& $simpleArcParse json $restarted) -join "`n" | ConvertFrom-Json
+
+    it 'should use the first log start event' {
+        (& $simpleArcParse start_time $restarted) | Should BeExactly '1527740549'
+        $json.server_time.start | Should Be 1527740549
+        $json.local_time.start | Should Be 933570140
+    }
+}
+
+describe 'simpleArcParse compressed logs' {
+    $zevtc = Join-Path $test_data_dir 'siax-cm100-test-log-1.zevtc'
+    $damaged = Join-Path $TestDrive 'damaged.zevtc'
+
+    # Flip a bit of the CRC-32 recorded in the local header
+    $bytes = [System.IO.File]::ReadAllBytes((Resolve-Path $zevtc))
+    $bytes[14] = $bytes[14] -bxor 1
+    [System.IO.File]::WriteAllBytes($damaged, $bytes)
+
+    $records = @(& $simpleArcParse batch $zevtc $damaged | ForEach-Object { $_ | ConvertFrom-Json })
+
+    it 'should parse an intact archive' {
+        $records[0].boss.name | Should BeExactly 'Siax'
+    }
+    it 'should reject an entry not matching its CRC-32' {
+        $records[1].error.code | Should Be -22
+    }
+}
+
+# Decode one CBOR data item, as written by simpleArcParse cbor
+function Read-CborItem ([byte[]]$bytes, [ref]$pos) {
+    $initial = $bytes[$pos.Value++]
+    $major = $initial -shr 5
+    $info = $initial -band 0x1f
+
+    if ($major -eq 7) {
+        switch ($info) {
+            20 { return $false }
+            21 { return $true }
+            22 { return $null }
+        }
+        throw "Unexpected CBOR simple value $info"
+    }
+
+    $indefinite = ($info -eq 31)
+    [uint64]$arg = $info
+    if ($info -ge 24 -and $info -le 27) {
+        $arg = 0
+        for ($i = 0; $i -lt (1 -shl ($info - 24)); $i++) {
+            $arg = $arg * 256 + $bytes[$pos.Value++]
+        }
+    }
+
+    switch ($major) {
+        0 { return $arg }
+        1 { return -1 - [decimal]$arg }
+        3 {
+            $text = [System.Text.Encoding]::UTF8.GetString($bytes, $pos.Value, $arg)
+            $pos.Value += $arg
+            return $text
+        }
+        4 {
+            $items = @()
+            while ($(if ($indefinite) { $bytes[$pos.Value] -ne 0xff } else { $items.Length -lt $arg })) {
+                $items += ,(Read-CborItem $bytes $pos)
+            }
+            if ($indefinite) { $pos.Value++ }
+            return ,$items
+        }
+        5 {
+            $map = [ordered]@{}
+            while ($(if ($indefinite) { $bytes[$pos.Value] -ne 0xff } else { $map.Count -lt $arg })) {
+                $key = Read-CborItem $bytes $pos
+                $map[$key] = Read-CborItem $bytes $pos
+            }
+            if ($indefinite) { $pos.Value++ }
+            return [PSCustomObject]$map
+        }
+    }
+    throw "Unexpected CBOR major type $major"
+}
+
+describe 'simpleArcParse cbor' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $output = Join-Path $TestDrive 'siax.cbor'
+
+    Start-Process -FilePath $simpleArcParse -ArgumentList @('cbor', $siax) -NoNewWindow -Wait -RedirectStandardOutput $output
+    $bytes = [System.IO.File]::ReadAllBytes($output)
+    $pos = 0
+    $decoded = Read-CborItem $bytes ([ref]$pos)
+
+    it 'should output a single data item' {
+        $pos | Should Be $bytes.Length
+    }
+    it 'should round trip to the same data as json' {
+        $json = (& $simpleArcParse json $siax) -join "`n" | ConvertFrom-Json
+        ($decoded | ConvertTo-Json -Depth 10 -Compress) | Should BeExactly ($json | ConvertTo-Json -Depth 10 -Compress)
+    }
+}
+
+describe 'simpleArcParse encounter overlay' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $overlay = Join-Path $TestDrive 'encounters.json'
+
+    Set-Content -Path $overlay -Value '[{"id": 17028, "name": "Siax the Corrupted", "cm": "NO"}]'
+
+    $env:SIMPLEARCPARSE_ENCOUNTERS = $overlay
+    $data = (& $simpleArcParse json $siax) -join "`n" | ConvertFrom-Json
+    Remove-Item Env:\SIMPLEARCPARSE_ENCOUNTERS
+
+    it 'should override the encounter name' {
+        $data.boss.name | Should BeExactly 'Siax the Corrupted'
+    }
+    it 'should override the CM status' {
+        $data.boss.is_cm | Should BeExactly 'NO'
+    }
+    it 'should keep fields not in the overlay' {
+        $data.boss.location | Should BeExactly '99cm'
+    }
+
+    $invalid = Join-Path $TestDrive 'invalid.json'
+    $header = Join-Path $TestDrive 'header.txt'
+    $errors = Join-Path $TestDrive 'errors.txt'
+
+    Set-Content -Path $invalid -Value '[{"id": 17028, "name": "Siax the Corrupted", "cm": "yes"}]'
+
+    $env:SIMPLEARCPARSE_ENCOUNTERS = $invalid
+    Start-Process -FilePath $simpleArcParse -ArgumentList @('header', $siax) -NoNewWindow -Wait -RedirectStandardOutput $header -RedirectStandardError $errors
+    Remove-Item Env:\SIMPLEARCPARSE_ENCOUNTERS
+
+    it 'should ignore an invalid overlay entirely' {
+        (Get-Content $header)[1] | Should BeExactly 'Siax'
+    }
+    it 'should report why an overlay was ignored' {
+        (Get-Content $errors) -join "`n" | Should Match 'encounter 1: unknown cm "yes"'
+    }
+}
+
+describe 'simpleArcParse dps' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $rows = @(& $simpleArcParse dps $siax | ForEach-Object { ,($_ -split "`t") })
+
+    it 'should output one line per player' {
+        $rows.Length | Should Be 5
+    }
+    it 'should sum direct and condition damage to the boss' {
+        $rows[0][0] | Should BeExactly 'reapex.8546'
+        $rows[0][3] | Should BeExactly '1537556'
+        $rows[0][4] | Should BeExactly '55757'
+    }
+    it 'should sum damage to every target' {
+        $rows[1][0] | Should BeExactly 'grimfare.4319'
+        $rows[1][5] | Should BeExactly '415544'
+        $rows[1][6] | Should BeExactly '1718273'
+    }
+    it 'should divide damage by the encounter duration' {
+        $rows[0][1] | Should BeExactly '8087'
+        $rows[0][2] | Should BeExactly '10264'
+    }
+}
+
+describe 'simpleArcParse boons' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $rows = @(& $simpleArcParse boons $siax | ForEach-Object { ,($_ -split "`t") })
+
+    it 'should output one line per player and boon' {
+        $rows.Length | Should Be 60
+    }
+    it 'should measure the uptime and average stacks of might' {
+        $might = $rows | Where-Object { $_[0] -eq 'reapex.8546' -and $_[1] -eq 'might' }
+        $might[2] | Should BeExactly '97.58'
+        $might[3] | Should BeExactly '15.75'
+    }
+    it 'should count boons stacking in duration only once' {
+        $quickness = $rows | Where-Object { $_[0] -eq 'grimfare.4319' -and $_[1] -eq 'quickness' }
+        $quickness[2] | Should BeExactly '56.30'
+        $quickness[3] | Should BeExactly '0.56'
+    }
+}
+
+describe 'simpleArcParse health' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+
+    it 'should keep the last change of health in each second' {
+        $rows = @(& $simpleArcParse health $siax)
+        $rows.Length | Should Be 88
+        $rows[0] | Should BeExactly "2005`t99.43"
+        $rows[-1] | Should BeExactly "196409`t0.45"
+    }
+    it 'should output every change with a resolution of zero' {
+        $rows = @(& $simpleArcParse health $siax 0)
+        $rows.Length | Should Be 97
+    }
+    it 'should reject negative and oversized resolutions' {
+        & $simpleArcParse health $siax -1 | Out-Null
+        $LASTEXITCODE | Should Be -22
+        & $simpleArcParse health $siax 4294967296 | Out-Null
+        $LASTEXITCODE | Should Be -22
+    }
+    it 'should reject invalid resolutions in serve requests' {
+        $responses = @(
+            @{ id = 1; type = 'health'; path = $siax; resolution = -1 }
+            @{ id = 2; type = 'health'; path = $siax; resolution = 4294967296 }
+        ) | ForEach-Object { $_ | ConvertTo-Json -Compress } | & $simpleArcParse serve | ForEach-Object { $_ | ConvertFrom-Json }
+        $responses.Length | Should Be 2
+        $responses | ForEach-Object { $_.error.code | Should Be -22 }
+    }
+    it 'should split phases when the boss becomes invulnerable' {
+        $rows = @(& $simpleArcParse phases $siax)
+        $rows.Length | Should Be 3
+        $rows[0] | Should BeExactly "1`t0`t36731`t100.00`t66.34"
+        $rows[1] | Should BeExactly "2`t52726`t132549`t66.34`t33.96"
+        $rows[2] | Should BeExactly "3`t150876`t197016`t32.90`t0.45"
+    }
+}
+
+# Decode one zigzag varint, as written in simpleArcParse movement tracks
+function Read-ZigZag ([byte[]]$bytes, [ref]$pos) {
+    [int64]$value = 0
+    $shift = 0
+    do {
+        $byte = $bytes[$pos.Value++]
+        $value = $value -bor ([int64]($byte -band 0x7f) -shl $shift)
+        $shift += 7
+    } while ($byte -ge 0x80)
+    return ($value -shr 1) -bxor (-($value -band 1))
+}
+
+describe 'simpleArcParse movement' {
+    $siax = Join-Path $test_data_dir 'siax-cm100-test-log-1.evtc'
+    $output = Join-Path $TestDrive 'siax.movement'
+
+    Start-Process -FilePath $simpleArcParse -ArgumentList @('movement', $siax) -NoNewWindow -Wait -RedirectStandardOutput $output
+    $bytes = [System.IO.File]::ReadAllBytes($output)
+
+    it 'should start with the track header' {
+        [System.Text.Encoding]::ASCII.GetString($bytes, 0, 4) | Should BeExactly 'SAPM'
+        [System.BitConverter]::ToUInt16($bytes, 4) | Should Be 1
+        [System.BitConverter]::ToUInt16($bytes, 6) | Should Be 64
+    }
+    it 'should have no tracks for a log without movement events' {
+        [System.BitConverter]::ToUInt32($bytes, 8) | Should Be 0
+        $bytes.Length | Should Be 16
+    }
+
+    # The synthetic log moves player agent 0x1000 every 100ms from 1000ms,
+    # to x = 100 + 1.5i, y = -200 - 0.5i and z = 10 + i % 3 for i up to 99.
+    # Its velocity changes twice, and it faces (0.5, -0.25) then (0.5, 0.75).
+    $log = Join-Path $test_data_dir 'movement-test-log.evtc'
+    $output = Join-Path $TestDrive 'log.movement'
+
+    Start-Process -FilePath $simpleArcParse -ArgumentList @('movement', $log) -NoNewWindow -Wait -RedirectStandardOutput $output
+    $bytes = [System.IO.File]::ReadAllBytes($output)
+
+    $samples = [System.BitConverter]::ToUInt32($bytes, 16 + 16)
+    $index = [int][System.BitConverter]::ToUInt64($bytes, 16 + 24)
+    $data = [int][System.BitConverter]::ToUInt64($bytes, 16 + 32)
+
+    it 'should list a track for each kind of movement' {
+        [System.BitConverter]::ToUInt32($bytes, 8) | Should Be 3
+        [System.BitConverter]::ToUInt64($bytes, 16) | Should Be 0x1000
+        $bytes[16 + 8] | Should Be 0
+        $bytes[16 + 9] | Should Be 3
+        [System.BitConverter]::ToSingle($bytes, 16 + 12) | Should Be 10
+        $samples | Should Be 100
+    }
+    it 'should decode every position from its keyframe and deltas' {
+        $pos = $data
+        $coords = @(0, 0, 0)
+        $decoded = for ($i = 0; $i -lt $samples; $i++) {
+            if ($i % 64 -eq 0) {
+                $time = [System.BitConverter]::ToUInt64($bytes, $index + 12 * [math]::Floor($i / 64))
+                for ($c = 0; $c -lt 3; $c++) { $coords[$c] = Read-ZigZag $bytes ([ref]$pos) }
+            } else {
+                $time += Read-ZigZag $bytes ([ref]$pos)
+                for ($c = 0; $c -lt 3; $c++) { $coords[$c] += Read-ZigZag $bytes ([ref]$pos) }
+            }
+            "$time $($coords -join ' ')"
+        }
+        $expected = for ($i = 0; $i -lt 100; $i++) {
+            "$(1000 + 100 * $i) $(1000 + 15 * $i) $(-2000 - 5 * $i) $(100 + 10 * ($i % 3))"
+        }
+        ($decoded -join ',') | Should BeExactly ($expected -join ',')
+    }
+    it 'should seek to a keyframe through the index' {
+        $pos = $data + [System.BitConverter]::ToUInt32($bytes, $index + 12 + 8)
+        [System.BitConverter]::ToUInt64($bytes, $index + 12) | Should Be 7400
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 1960
+        Read-ZigZag $bytes ([ref]$pos) | Should Be -2320
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 110
+    }
+    it 'should quantize facings to thousandths' {
+        $pos = [int][System.BitConverter]::ToUInt64($bytes, 96 + 32)
+        $bytes[96 + 8] | Should Be 2
+        $bytes[96 + 9] | Should Be 2
+        [System.BitConverter]::ToSingle($bytes, 96 + 12) | Should Be 1000
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 500
+        Read-ZigZag $bytes ([ref]$pos) | Should Be -250
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 6000
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 0
+        Read-ZigZag $bytes ([ref]$pos) | Should Be 1000
     }
 }
 
@@ -71,6 +475,25 @@ $testEncounters = @(
         local_last_event=933782346
         duration=197016
     }
+    @{
+        name='siax-cm100-test-log-1.zevtc'
+        version='EVTC20180526'
+        boss_name='Siax'
+        boss_id=17028
+        boss_maxhealth=6138797
+        is_cm="YES"
+        players=@('reapex.8546','Serena Sedai.3064','Hexus.8207',
+                  'Draykrah.1980','grimfare.4319')
+        success=$true
+        start_time=1527740549
+        end_time=1527740762
+        local_start_time=933570140
+        local_end_time=933767156
+        local_reward_time=933767156
+        local_log_end=933782346
+        local_last_event=933782346
+        duration=197016
+    }
     @{
         name='matthias-test-log-1.evtc'
         version='EVTC20180526'
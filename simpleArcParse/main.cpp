@@ -1,7 +1,7 @@
 /* SPDX-License-Identifier: BSD-3-Clause
  * Copyright 2018 Jacob Keller. All rights reserved.
  *
- * Some structure definitions and names taken from https://www.deltaconnected.com/arcdps/evtc
+ * simpleArcParse: command line interface to libsimplearcparse
  *
  * nlohmann/json.hpp is licensed under the MIT license.
  */
@@ -11,1107 +11,2740 @@
 #include <sstream>
 #include <cstring>
 #include <cerrno>
-#include <cctype>
 #include <iomanip>
-#include <map>
+#include <algorithm>
+#include <charconv>
 #include <type_traits>
 #include "json.hpp"
+#include "simplearcparse.h"
+
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <climits>
+#include <csignal>
+#include <list>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using json = nlohmann::json;
 
-static const string version = "v2.4.1";
+static const string version = sap_version();
 
-/*
- * The following enumeration definitions were taken from the
- * evtc README.txt file available at:
- *
- * https://www.deltaconnected.com/arcdps/evtc/README.txt
- *
- * They were last updated on March 30th, 2019.
+#ifdef SIMPLEARCPARSE_COUNT_ALLOCATIONS
+/* Heap allocations made by each thread. Debug builds replace the global
+ * allocation functions to count them, and add the number made while
+ * parsing each log to its batch record. Once the parse arenas and output
+ * buffers have grown to size, this should stay at zero for every log which
+ * is not compressed.
  */
+static thread_local uint64_t heap_allocations;
 
-/* iff */
-enum iff {
-    IFF_FRIEND,
-    IFF_FOE,
-    IFF_UNKNOWN // or uncertain
-};
+void *
+operator new(size_t size)
+{
+    void *ptr;
 
-/* combat result (physical) */
-enum cbtresult {
-    CBTR_NORMAL,      // good physical hit
-    CBTR_CRIT,        // physical hit was crit
-    CBTR_GLANCE,      // physical hit was glance
-    CBTR_BLOCK,       // physical hit was blocked eg. mesmer shield 4
-    CBTR_EVADE,       // physical hit was evaded, eg. dodge or mesmer sword 2
-    CBTR_INTERRUPT,   // physical hit interrupted something
-    CBTR_ABSORB,      // physical hit was "invlun" or absorbed eg. guardian elite
-    CBTR_BLIND,       // physical hit missed
-    CBTR_KILLINGBLOW, // hit was killing hit
-    CBTR_DOWNED,      // hit was downing hit
-};
+    heap_allocations++;
 
-/* combat activation */
-enum cbtactivation {
-    ACTV_NONE,          // not used - not this kind of event
-    ACTV_NORMAL,        // started skill activation without quickness
-    ACTV_QUICKNESS,     // started skill activation with quickness
-    ACTV_CANCEL_FIRE,   // stopped skill activation with reaching tooltip time
-    ACTV_CANCEL_CANCEL, // stopped skill activation without reaching tooltip time
-    ACTV_RESET          // animation completed fully
-};
+    ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw bad_alloc();
+    }
 
-/* combat state change */
-enum cbtstatechange {
-    CBTS_NONE,            // not used - not this kind of event
-    CBTS_ENTERCOMBAT,     // src_agent entered combat, dst_agent is subgroup
-    CBTS_EXITCOMBAT,      // src_agent left combat
-    CBTS_CHANGEUP,        // src_agent is now alive
-    CBTS_CHANGEDEAD,      // src_agent is now dead
-    CBTS_CHANGEDOWN,      // src_agent is now downed
-    CBTS_SPAWN,           // src_agent is now in game tracking range (not in realtime api)
-    CBTS_DESPAWN,         // src_agent is no longer being tracked (not in realtime api)
-    CBTS_HEALTHUPDATE,    // src_agent has reached a health marker. dst_agent = percent * 10000 (eg. 99.5% will be 9950) (not in realtime api)
-    CBTS_LOGSTART,        // log start. value = server unix timestamp **uint32**. buff_dmg = local unix timestamp. src_agent = 0x637261 (arcdps id)
-    CBTS_LOGEND,          // log end. value = server unix timestamp **uint32**. buff_dmg = local unix timestamp. src_agent = 0x637261 (arcdps id)
-    CBTS_WEAPSWAP,        // src_agent swapped weapon set. dst_agent = current set id (0/1 water, 4/5 land)
-    CBTS_MAXHEALTHUPDATE, // src_agent has had it's maximum health changed. dst_agent = new max health (not in realtime api)
-    CBTS_POINTOFVIEW,     // src_agent is agent of "recording" player
-    CBTS_LANGUAGE,        // src_agent is text language
-    CBTS_GWBUILD,         // src_agent is game build
-    CBTS_SHARDID,         // src_agent is sever shard id
-    CBTS_REWARD,          // src_agent is self, dst_agent is reward id, value is reward type. these are the wiggly boxes that you get
-    CBTS_BUFFINITIAL,     // combat event that will appear once per buff per agent on logging start (statechange==18, buff==18, normal cbtevent otherwise)
-    CBTS_POSITION,        // src_agent changed, cast float* p = (float*)&dst_agent, access as x/y/z (float[3]) (not in realtime api)
-    CBTS_VELOCITY,        // src_agent changed, cast float* v = (float*)&dst_agent, access as x/y/z (float[3]) (not in realtime api)
-    CBTS_FACING,          // src_agent changed, cast float* f = (float*)&dst_agent, access as x/y (float[2]) (not in realtime api)
-    CBTS_TEAMCHANGE,      // src_agent change, dst_agent new team id
-    CBTS_ATTACKTARGET,    // src_agent is an attacktarget, dst_agent is the parent agent (gadget type), value is the current targetable state (not in realtime api)
-    CBTS_TARGETABLE,      // dst_agent is new target-able state (0 = no, 1 = yes. default yes) (not in realtime api)
-    CBTS_MAPID,           // src_agent is map id
-    CBTS_REPLINFO,        // internal use, won't see anywhere
-    CBTS_STACKACTIVE,     // src_agent is agent with buff, dst_agent is the stackid marked active
-    CBTS_STACKRESET,      // src_agent is agent with buff, value is the duration to reset to (also marks inactive), pad61- is the stackid
-    CBTS_GUILD            // src_agent is agent, dst_agent through buff_dmg is 16 byte guid (client form, needs minor rearrange for api form)
-};
+    return ptr;
+}
 
-/* combat buff remove type */
-enum cbtbuffremove {
-    CBTB_NONE,   // not used - not this kind of event
-    CBTB_ALL,    // last/all stacks removed (sent by server)
-    CBTB_SINGLE, // single stack removed (sent by server). will happen for each stack on cleanse
-    CBTB_MANUAL, // single stack removed (auto by arc on ooc or all stack, ignore for strip/cleanse calc, use for in/out volume)
-};
+/* Memory from the replaced operator new comes from malloc, although GCC
+ * cannot see that once it inlines the two
+ */
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void
+operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
 
-/* custom skill ids */
-enum cbtcustomskill {
-    CSK_RESURRECT = 1066, // not custom but important and unnamed
-    CSK_BANDAGE = 1175,   // personal healing only
-    CSK_DODGE = 65001     // will occur in is_activation==normal event
-};
+void
+operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+#endif
 
-/* language */
-enum gwlanguage {
-    GWL_ENG = 0,
-    GWL_FRE = 2,
-    GWL_GEM = 3,
-    GWL_SPA = 4,
+struct output_type {
+    string name;
+    uint32_t query;
 };
 
-/* define agent. stats range from 0-10 */
-struct evtc_agent {
-    uint64_t addr;
-    uint32_t prof;
-    uint32_t is_elite;
-    uint16_t toughness;
-    uint16_t concentration;
-    uint16_t healing;
-    uint16_t hitbox_width;
-    uint16_t condition;
-    uint16_t hitbox_height;
-    char name[64];
+static const output_type valid_types[] = {
+    {"version", 0},
+    {"check_kernels", 0},
+    {"json", SAP_QUERY_ALL},
+    {"cbor", SAP_QUERY_ALL},
+    {"header", SAP_QUERY_HEADER},
+    {"revision", SAP_QUERY_HEADER},
+    {"players", SAP_QUERY_PLAYERS},
+    {"success", SAP_QUERY_REWARD},
+    {"start_time", SAP_QUERY_LOGSTART},
+    {"end_time", SAP_QUERY_LOGEND},
+    {"local_start_time", SAP_QUERY_LOGSTART},
+    {"local_end_time", SAP_QUERY_END},
+    {"boss_maxhealth", SAP_QUERY_MAXHEALTH},
+    {"is_cm", SAP_QUERY_CM},
+    {"duration", SAP_QUERY_LOGSTART | SAP_QUERY_END},
+    {"location", SAP_QUERY_HEADER},
+    {"dps", SAP_QUERY_DAMAGE | SAP_QUERY_LOGSTART | SAP_QUERY_END},
+    {"boons", SAP_QUERY_BUFFS},
+    {"health", SAP_QUERY_HEALTH},
+    {"phases", SAP_QUERY_HEALTH},
+    {"movement", SAP_QUERY_MOVEMENT},
+    {"batch", 0},
+    {"serve", 0},
 };
 
-/* define skill */
-struct evtc_skill {
-    int32_t id;
-    char name[64];
-};
+static const int valid_types_size = extent<decltype(valid_types)>::value;
+
+/**
+ * output_writer - streaming serializer for structured output
+ *
+ * Writes a document straight into a caller provided buffer, which can be
+ * reused from one document to the next, so that nothing is allocated once
+ * the buffer is large enough. Keys are written in the order given, so
+ * callers write them sorted, matching the output of nlohmann::json. Values
+ * which are already held as compact JSON text, such as cached details, are
+ * written with raw_value and merge_object. Invalid UTF-8 in strings is
+ * replaced by U+FFFD.
+ */
+class output_writer
+{
+protected:
+    string& out;
+
+    virtual void write_string(const char *str, size_t len) = 0;
+public:
+    explicit output_writer(string& out)
+        : out(out)
+    {
+    }
+
+    virtual ~output_writer() {}
+
+    virtual void begin_object() = 0;
+    virtual void end_object() = 0;
+    virtual void begin_array() = 0;
+    virtual void end_array() = 0;
+    virtual void key(const char *name) = 0;
+    virtual void number_value(uint64_t number) = 0;
+    virtual void signed_value(int64_t number) = 0;
+    virtual void bool_value(bool value) = 0;
+    virtual void raw_value(const string& text) = 0;
+    virtual void merge_object(const string& text) = 0;
+
+    void string_value(const char *str)
+    {
+        write_string(str, strlen(str));
+    }
 
-/* combat event (old, when header[12] == 0) */
-struct evtc_cbtevent_v0 {
-    uint64_t time;                 /* timegettime() at time of event */
-    uint64_t src_agent;            /* unique identifier */
-    uint64_t dst_agent;            /* unique identifier */
-    int32_t value;                 /* event-specific */
-    int32_t buff_dmg;              /* estimated buff damage. zero on application event */
-    uint16_t overstack_value;      /* estimated overwritten stack duration for buff application */
-    uint16_t skillid;              /* skill id */
-    uint16_t src_instid;           /* agent map instance id */
-    uint16_t dst_instid;           /* agent map instance id */
-    uint16_t src_master_instid;    /* master source agent map instance id if source is a minion/pet */
-    uint8_t iss_offset;            /* internal tracking. garbage */
-    uint8_t iss_offset_target;     /* internal tracking. garbage */
-    uint8_t iss_bd_offset;         /* internal tracking. garbage */
-    uint8_t iss_bd_offset_target;  /* internal tracking. garbage */
-    uint8_t iss_alt_offset;        /* internal tracking. garbage */
-    uint8_t iss_alt_offset_target; /* internal tracking. garbage */
-    uint8_t skar;                  /* internal tracking. garbage */
-    uint8_t skar_alt;              /* internal tracking. garbage */
-    uint8_t skar_use_alt;          /* internal tracking. garbage */
-    uint8_t iff;                   /* from iff enum */
-    uint8_t buff;                  /* buff application, removal, or damage event */
-    uint8_t result;                /* from cbtresult enum */
-    uint8_t is_activation;         /* from cbtactivation enum */
-    uint8_t is_buffremove;         /* buff removed. src=relevant, dst=caused it (for strips/cleanses). from cbtr enum */
-    uint8_t is_ninety;             /* source agent health was over 90% */
-    uint8_t is_fifty;              /* target agent health was under 50% */
-    uint8_t is_moving;             /* source agent was moving */
-    uint8_t is_statechange;        /* from cbtstatechange enum */
-    uint8_t is_flanking;           /* target agent was not facing source */
-    uint8_t is_shields;            /* all or part damage was vs barrier/shield */
-    uint8_t is_offcycle;           /* zero if buff dmg happened during tick, non-zero otherwise */
-    uint8_t pad64;                 /* internal tracking. garbage */
+    void string_value(const string& str)
+    {
+        write_string(str.data(), str.size());
+    }
 };
 
-/* Guild UIDs are 16byte values which are stored over the dst_agent, value,
- * and buff_dmg members of the evtc_cbtevent values.
+/**
+ * utf8_sequence - Check the UTF-8 sequence at the start of a string
+ * @str: the string to check
+ * @len: the length of @str, at least one
+ * @valid: on return, whether the sequence is valid
+ *
+ * Returns the length of the sequence if it is valid. Otherwise, returns the
+ * number of bytes to replace by a single U+FFFD, which is the longest
+ * prefix of a valid sequence, or the one invalid byte.
  */
-struct evtc_guid {
-    struct {
-        uint32_t p1; /* Little Endian */
-        uint16_t p2; /* Little Endian */
-        uint16_t p3; /* Little Endian */
-        uint16_t p4; /* Big Endian */
-        uint16_t p5; /* Big Endian*/
-        uint32_t p6; /* Big Endian */
-    } data;
-    uint8_t valid;
-};
+static size_t
+utf8_sequence(const unsigned char *str, size_t len, bool& valid)
+{
+    unsigned char lead = str[0], lo = 0x80, hi = 0xBF;
+    size_t need, i;
+
+    valid = true;
+    if (lead < 0x80) {
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 3;
+        if (lead == 0xE0) {
+            lo = 0xA0;
+        } else if (lead == 0xED) {
+            hi = 0x9F;
+        }
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 4;
+        if (lead == 0xF0) {
+            lo = 0x90;
+        } else if (lead == 0xF4) {
+            hi = 0x8F;
+        }
+    } else {
+        valid = false;
+        return 1;
+    }
 
-/* combat event logging (revision 1, when header[12] == 1) */
-struct evtc_cbtevent_v1 {
-    uint64_t time;
-    uint64_t src_agent;
-    uint64_t dst_agent;
-    int32_t value;
-    int32_t buff_dmg;
-    uint32_t overstack_value;
-    uint32_t skillid;
-    uint16_t src_instid;
-    uint16_t dst_instid;
-    uint16_t src_master_instid;
-    uint16_t dst_master_instid;
-    uint8_t iff;
-    uint8_t buff;
-    uint8_t result;
-    uint8_t is_activation;
-    uint8_t is_buffremove;
-    uint8_t is_ninety;
-    uint8_t is_fifty;
-    uint8_t is_moving;
-    uint8_t is_statechange;
-    uint8_t is_flanking;
-    uint8_t is_shields;
-    uint8_t is_offcycle;
-    uint8_t pad61;
-    uint8_t pad62;
-    uint8_t pad63;
-    uint8_t pad64;
-};
+    for (i = 1; i < need; i++) {
+        if (i == len || str[i] < lo || str[i] > hi) {
+            valid = false;
+            return i;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
 
-static const uint8_t cbtevent_revision_v0 = 0;
-static const uint8_t cbtevent_revision_v1 = 1;
+    return need;
+}
 
-static const size_t cbtevent_sizes[] = {
-    sizeof(evtc_cbtevent_v0),
-    sizeof(evtc_cbtevent_v1),
-};
+/* UTF-8 encoding of U+FFFD, which replaces invalid UTF-8 */
+static const char utf8_replacement[] = "\xEF\xBF\xBD";
 
-static const uint8_t max_cbtevent_revision = 1;
-static_assert(max_cbtevent_revision < extent<decltype(cbtevent_sizes)>::value,
-              "Invalid maximum cbtevent revision");
-static const uint32_t EVTC_CBTEVENT_SIZE(uint8_t revision);
-
-/* The evtc_cbtevent structure is used to abstract away the layout differences
- * of the different versions of the cbtevent data in evtc_cbtevent_v0 and
- * evtc_cbtevent_v1 data structures. Because of this, we need to write accessor
- * functions in the class. However, much of this code is boiler plate. Almost
- * every field has the same name. A few fields have different sizes, but can be
- * easily type-casted up to the larger size.
+/**
+ * json_writer - streaming JSON serializer
  *
- * This macro is provided as a convenient way to define accessors for the most
- * common fields that do not need any special handling between versions.
- * Otherwise we would end up duplicating this boiler plate revision version
- * check many times.
+ * With an indent, the text is formatted just like
+ * nlohmann::json::dump(indent), otherwise it is compact.
  */
-#define CBTEVENT_ACCESSOR(type, field)                                         \
-  type field()                                                                 \
-  {                                                                            \
-    if (revision == cbtevent_revision_v0)                                      \
-      return (type)(raw.v0.field);                                             \
-    else if (revision == cbtevent_revision_v1)                                 \
-      return (type)(raw.v1.field);                                             \
-    else                                                                       \
-      throw "Invalid cbtevent revision";                                       \
-  }
-
-/* Abstraction of the various evtc_cbtevent versions */
-class evtc_cbtevent
+class json_writer : public output_writer
 {
 private:
-    union {
-        evtc_cbtevent_v0 v0;
-        evtc_cbtevent_v1 v1;
-    } raw;
-    uint8_t revision;
-public:
-    evtc_cbtevent(ifstream& file, uint8_t revision,
-                  streampos cbt_event_start,
-                  uint32_t cbtevent);
+    int indent;
+    int depth;
+
+    /* Nothing has been written yet in the current object or array */
+    bool first;
 
-    CBTEVENT_ACCESSOR(uint8_t, is_statechange)
-    CBTEVENT_ACCESSOR(uint64_t, src_agent)
-    CBTEVENT_ACCESSOR(uint64_t, dst_agent)
-    CBTEVENT_ACCESSOR(uint32_t, value)
-    CBTEVENT_ACCESSOR(uint64_t, time)
+    /* A key has been written, and its value comes next */
+    bool after_key;
 
-    struct evtc_guid guid()
+    void separate();
+    void newline();
+    void write_compact(const char *text, size_t len);
+protected:
+    void write_string(const char *str, size_t len) override;
+public:
+    explicit json_writer(string& out, int indent = -1)
+        : output_writer(out), indent(indent), depth(0), first(true), after_key(false)
     {
-        struct evtc_guid guid = {};
-
-        if (revision == cbtevent_revision_v0) {
-            /* v0 never supported CBTS_GUILD events... */
-            memcpy(&guid.data, &raw.v0.dst_agent, sizeof(guid.data));
-            guid.valid = true;
-        } else if (revision == cbtevent_revision_v1) {
-            memcpy(&guid.data, &raw.v1.dst_agent, sizeof(guid.data));
-            guid.valid = true;
-        } else {
-            throw "Invalid cbtevent revision";
+    }
+
+    void begin_object() override;
+    void end_object() override;
+    void begin_array() override;
+    void end_array() override;
+    void key(const char *name) override;
+    void number_value(uint64_t number) override;
+    void signed_value(int64_t number) override;
+    void bool_value(bool value) override;
+    void raw_value(const string& text) override;
+    void merge_object(const string& text) override;
+};
+
+/**
+ * newline - start a new line at the current depth, when indenting
+ */
+void
+json_writer::newline()
+{
+    if (indent >= 0) {
+        out += '\n';
+        out.append((size_t)depth * indent, ' ');
+    }
+}
+
+/**
+ * separate - prepare to write the next key or value
+ *
+ * Values following a key go on the same line, while every other key and
+ * value is separated from the previous one by a comma.
+ */
+void
+json_writer::separate()
+{
+    if (after_key) {
+        after_key = false;
+        return;
+    }
+
+    if (!first) {
+        out += ',';
+    }
+    if (depth) {
+        newline();
+    }
+    first = false;
+}
+
+void
+json_writer::begin_object()
+{
+    separate();
+    out += '{';
+    depth++;
+    first = true;
+}
+
+void
+json_writer::end_object()
+{
+    depth--;
+    if (!first) {
+        newline();
+    }
+    out += '}';
+    first = false;
+}
+
+void
+json_writer::begin_array()
+{
+    separate();
+    out += '[';
+    depth++;
+    first = true;
+}
+
+void
+json_writer::end_array()
+{
+    depth--;
+    if (!first) {
+        newline();
+    }
+    out += ']';
+    first = false;
+}
+
+void
+json_writer::key(const char *name)
+{
+    string_value(name);
+    out += indent >= 0 ? ": " : ":";
+    after_key = true;
+}
+
+/**
+ * write_string - write a quoted and escaped string
+ * @str: the UTF-8 string to write
+ * @len: the length of @str
+ */
+void
+json_writer::write_string(const char *str, size_t len)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const unsigned char *bytes = (const unsigned char *)str;
+    size_t i = 0;
+
+    separate();
+
+    out += '"';
+    while (i < len) {
+        unsigned char c = bytes[i];
+        size_t seq;
+        bool valid;
+
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\b':
+            out += "\\b";
+            break;
+        case '\f':
+            out += "\\f";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += hex_digits[c >> 4];
+                out += hex_digits[c & 0xf];
+                break;
+            }
+
+            seq = utf8_sequence(bytes + i, len - i, valid);
+            if (valid) {
+                out.append(str + i, seq);
+            } else {
+                out += utf8_replacement;
+            }
+            i += seq;
+            continue;
         }
+        i++;
+    }
+    out += '"';
+}
 
-#define BSWAP16(val) val = __builtin_bswap16(val)
-#define BSWAP32(val) val = __builtin_bswap32(val)
+void
+json_writer::number_value(uint64_t number)
+{
+    char buf[24];
+    auto res = to_chars(buf, buf + sizeof(buf), number);
 
-        /* Some of the bytes in the GUID are stored in Big Endian format,
-         * so we need to swap them back into the right order for use with
-         * the GW2 API.
-         *
-         * Since we're assuming the host is "Little Endian" format, we only
-         * need to swap the values which are "Big Endian".
-         */
-        BSWAP16(guid.data.p4);
-        BSWAP16(guid.data.p5);
-        BSWAP32(guid.data.p6);
+    separate();
+    out.append(buf, res.ptr - buf);
+}
 
-        return guid;
-    };
-};
+void
+json_writer::signed_value(int64_t number)
+{
+    char buf[24];
+    auto res = to_chars(buf, buf + sizeof(buf), number);
+
+    separate();
+    out.append(buf, res.ptr - buf);
+}
+
+void
+json_writer::bool_value(bool value)
+{
+    separate();
+    out += value ? "true" : "false";
+}
+
+/**
+ * write_compact - write compact JSON text
+ * @text: compact JSON text, as written by a json_writer without indent
+ * @len: the length of @text
+ *
+ * The text is re-formatted token by token, so it is indented to match the
+ * rest of the output.
+ */
+void
+json_writer::write_compact(const char *text, size_t len)
+{
+    size_t i = 0, start;
+
+    while (i < len) {
+        switch (text[i]) {
+        case '{':
+            begin_object();
+            i++;
+            break;
+        case '}':
+            end_object();
+            i++;
+            break;
+        case '[':
+            begin_array();
+            i++;
+            break;
+        case ']':
+            end_array();
+            i++;
+            break;
+        case ',':
+            i++;
+            break;
+        case ':':
+            out += indent >= 0 ? ": " : ":";
+            after_key = true;
+            i++;
+            break;
+        case '"':
+            /* Strings are already escaped, so copy them as they are */
+            separate();
+            for (start = i++; i < len && text[i] != '"'; i++) {
+                if (text[i] == '\\') {
+                    i++;
+                }
+            }
+            i = min(i + 1, len);
+            out.append(text + start, i - start);
+            break;
+        default:
+            /* Numbers, true, false and null */
+            separate();
+            for (start = i; i < len && !strchr(",:]}", text[i]); i++) {
+            }
+            out.append(text + start, i - start);
+            break;
+        }
+    }
+}
+
+/**
+ * raw_value - write a value which is already compact JSON text
+ * @text: the compact JSON text
+ */
+void
+json_writer::raw_value(const string& text)
+{
+    if (indent < 0) {
+        separate();
+        out += text;
+    } else {
+        write_compact(text.data(), text.size());
+    }
+}
 
 /**
- * evtc_cbtevent - Construct an EVTC combat event from the file
- * @file: the file to read
- * @revision: the combat event revision
- * @cbt_event_start: where in the file combat events start
- * @cbtevent: which combat event number to read
+ * merge_object - write the members of a compact JSON object
+ * @text: the compact JSON text of the object
  *
- * Construct an evtc_cbtevent item by reading from the given file.
+ * The members are added to the object currently being written.
  */
-evtc_cbtevent::evtc_cbtevent(ifstream& file,
-                             uint8_t revision,
-                             streampos cbt_event_start,
-                             uint32_t cbtevent)
-{
-    streampos event_index = cbt_event_start;
-    event_index += cbtevent * EVTC_CBTEVENT_SIZE(revision);
-    file.seekg(event_index);
-    file.read((char *)&this->raw, EVTC_CBTEVENT_SIZE(revision));
-    this->revision = revision;
-}
-
-static const string valid_types[] = {
-    "version",
-    "json",
-    "header",
-    "revision",
-    "players",
-    "success",
-    "start_time",
-    "end_time",
-    "local_start_time",
-    "local_end_time",
-    "boss_maxhealth",
-    "is_cm",
-    "duration",
-    "location",
+void
+json_writer::merge_object(const string& text)
+{
+    if (text.size() > 2) {
+        write_compact(text.data() + 1, text.size() - 2);
+    }
+}
+
+/**
+ * cbor_writer - streaming CBOR serializer
+ *
+ * Writes the same data model as json_writer in the binary CBOR encoding
+ * (RFC 8949), for consumers which would rather not parse text. Objects and
+ * arrays use the indefinite length encoding, so they can be written without
+ * knowing how many members they will have. Compact JSON text is transcoded
+ * as it is written.
+ */
+class cbor_writer : public output_writer
+{
+private:
+    /* Unescaped strings from JSON text, reused between strings */
+    string scratch;
+
+    void write_head(uint8_t major, uint64_t value);
+    void write_double(double value);
+    void write_json(const char *text, size_t len);
+    size_t unescape_json_string(const char *text, size_t len);
+    size_t write_json_scalar(const char *text, size_t len);
+protected:
+    void write_string(const char *str, size_t len) override;
+public:
+    explicit cbor_writer(string& out)
+        : output_writer(out)
+    {
+    }
+
+    void begin_object() override;
+    void end_object() override;
+    void begin_array() override;
+    void end_array() override;
+    void key(const char *name) override;
+    void number_value(uint64_t number) override;
+    void signed_value(int64_t number) override;
+    void bool_value(bool value) override;
+    void raw_value(const string& text) override;
+    void merge_object(const string& text) override;
 };
 
-static const int valid_types_size = extent<decltype(valid_types)>::value;
+/* CBOR major types, and the simple values of major type 7 */
+static const uint8_t CBOR_UNSIGNED = 0;
+static const uint8_t CBOR_NEGATIVE = 1;
+static const uint8_t CBOR_TEXT = 3;
+static const uint8_t CBOR_ARRAY = 4;
+static const uint8_t CBOR_MAP = 5;
+static const uint8_t CBOR_FALSE = 0xf4;
+static const uint8_t CBOR_TRUE = 0xf5;
+static const uint8_t CBOR_NULL = 0xf6;
+static const uint8_t CBOR_FLOAT64 = 0xfb;
+static const uint8_t CBOR_INDEFINITE = 0x1f;
+static const uint8_t CBOR_BREAK = 0xff;
 
-/* Positions for various useful data in the evtc file format
+/**
+ * write_head - write the initial bytes of a CBOR data item
+ * @major: the major type
+ * @value: the argument, such as an integer value or a length
  *
- * The first few are static, but later parts of the file are
- * dependent on how many agents, skills, and combat events
- * are recorded.
+ * The argument is written in the shortest form which holds it.
  */
-static const streampos SEEKG_EVTC_HEADER = 0;
-static const streampos EVTC_HEADER_SIZE = 16; /* 16 bytes */
+void
+cbor_writer::write_head(uint8_t major, uint64_t value)
+{
+    int bytes, i;
 
-static const streampos SEEKG_EVTC_AGENT_COUNT = SEEKG_EVTC_HEADER + EVTC_HEADER_SIZE;
-static const streampos EVTC_AGENT_COUNT_SIZE = sizeof(uint32_t); /* 4 bytes */
+    major <<= 5;
+    if (value < 24) {
+        out += (char)(major | value);
+        return;
+    } else if (value <= UINT8_MAX) {
+        out += (char)(major | 24);
+        bytes = 1;
+    } else if (value <= UINT16_MAX) {
+        out += (char)(major | 25);
+        bytes = 2;
+    } else if (value <= UINT32_MAX) {
+        out += (char)(major | 26);
+        bytes = 4;
+    } else {
+        out += (char)(major | 27);
+        bytes = 8;
+    }
 
-static const streampos SEEKG_EVTC_FIRST_AGENT = SEEKG_EVTC_AGENT_COUNT + EVTC_AGENT_COUNT_SIZE;
+    /* Arguments are big endian */
+    for (i = bytes - 1; i >= 0; i--) {
+        out += (char)(value >> (i * 8));
+    }
+}
 
-static const streampos SEEKG_EVTC_SKILL_COUNT(uint32_t agent_count)
+void
+cbor_writer::write_double(double value)
 {
-    return (SEEKG_EVTC_FIRST_AGENT + streampos(sizeof(evtc_agent) * agent_count));
+    uint64_t bits;
+    int i;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    out += (char)CBOR_FLOAT64;
+    for (i = 7; i >= 0; i--) {
+        out += (char)(bits >> (i * 8));
+    }
 }
-static const streampos EVTC_SKILL_COUNT_SIZE = sizeof(uint32_t); /* 4 bytes */
 
-static const streampos SEEKG_EVTC_FIRST_SKILL(uint32_t agent_count)
+void
+cbor_writer::begin_object()
 {
-    return SEEKG_EVTC_SKILL_COUNT(agent_count) + EVTC_SKILL_COUNT_SIZE;
+    out += (char)((CBOR_MAP << 5) | CBOR_INDEFINITE);
 }
 
-static const streampos SEEKG_EVTC_FIRST_CBTEVENT(uint32_t agent_count, uint32_t skill_count)
+void
+cbor_writer::end_object()
 {
-    return (SEEKG_EVTC_FIRST_SKILL(agent_count) + streampos(sizeof(evtc_skill) * skill_count));
+    out += (char)CBOR_BREAK;
 }
 
-static const uint32_t EVTC_CBTEVENT_SIZE(uint8_t revision)
+void
+cbor_writer::begin_array()
 {
-    if (revision > max_cbtevent_revision)
-        throw "Invalid EVTC cbtevent revision";
+    out += (char)((CBOR_ARRAY << 5) | CBOR_INDEFINITE);
+}
 
-    return cbtevent_sizes[revision];
+void
+cbor_writer::end_array()
+{
+    out += (char)CBOR_BREAK;
 }
 
-enum cm_type {
-    CM_UNKNOWN,
-    CM_HEALTH_BASED,
-    CM_NO,
-    CM_YES,
-};
+void
+cbor_writer::key(const char *name)
+{
+    string_value(name);
+}
 
-/*
- * @struct encounter_info
- * @brief Encounter data determined based on encounter ID
- *
- * Structure which represents encounter data based on the EVTC encounter ID.
- * This includes the human readable name and location (wing) that the encounter
- * belongs in.
+/**
+ * write_string - write a text string
+ * @str: the UTF-8 string to write
+ * @len: the length of @str
  *
- * @note By convention, raid wings will have their location set as a number
- * based on the release order of the raid wing. Fractals and other encounters
- * will set their location based on the name of the area in game.
+ * The length comes before the text, so strings with invalid UTF-8 are
+ * measured once with the replacement characters before being written.
  */
-struct encounter_info {
-    const char *name;
-    const char *location;
-    enum cm_type cm;
-    uint64_t health_threshold;
-};
+void
+cbor_writer::write_string(const char *str, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)str;
+    size_t i, seq, length = 0;
+    bool valid, all_valid = true;
+
+    for (i = 0; i < len; i += seq) {
+        seq = utf8_sequence(bytes + i, len - i, valid);
+        length += valid ? seq : sizeof(utf8_replacement) - 1;
+        all_valid &= valid;
+    }
 
-static const std::map<uint16_t, struct encounter_info> all_encounter_info = {
-    /* Raid Wing 1 */
-    {0x3C4E, {"Vale Guardian", "1", CM_NO, 0}},
-    {0x3C45, {"Gorseval", "1", CM_NO, 0}},
-    {0x3C0F, {"Sabetha", "1", CM_NO, 0}},
-    /* Raid Wing 2 */
-    {0x3EFB, {"Slothasor", "2", CM_NO, 0}},
-    {0x3ED8, {"Bandit Trio", "2", CM_NO, 0}},
-    {0x3F09, {"Bandit Trio", "2", CM_NO, 0}},
-    {0x3EFD, {"Bandit Trio", "2", CM_NO, 0}},
-    {0x3EF3, {"Matthias", "2", CM_NO, 0}},
-    /* Raid Wing 3 */
-    {0x3F6B, {"Keep Construct", "3", CM_NO, 0}},
-    {0x3F77, {"Twisted Castle", "3", CM_NO, 0}},
-    {0x3F76, {"Xera", "3", CM_NO, 0}},
-    {0x3F9E, {"Xera", "3", CM_NO, 0}},
-    /* Raid Wing 4 */
-    {0x432A, {"Cairn", "4", CM_UNKNOWN, 0}},
-    {0x4314, {"Mursaat Overseer", "4", CM_HEALTH_BASED, 25000000}},
-    {0x4324, {"Samarog", "4", CM_HEALTH_BASED, 35000000}},
-    {0x4302, {"Deimos", "4", CM_HEALTH_BASED, 40000000}},
-    /* Raid Wing 5 */
-    {0x4d37, {"Soulless Horror", "5", CM_UNKNOWN, 0}},
-    {0x4d74, {"Rainbow Road", "5", CM_NO, 0}},
-    {0x4ceb, {"Broken King", "5", CM_NO, 0}},
-    {0x4c50, {"Soul Eater", "5", CM_NO, 0}},
-    {0x4cc3, {"Eye of Judgement", "5", CM_NO, 0}},
-    {0x4d84, {"Eye of Fate", "5", CM_NO, 0}},
-    {0x4bfa, {"Dhuum", "5", CM_HEALTH_BASED, 35000000}},
-    /* Raid Wing 6 */
-    {0xabc6, {"Conured Amalgamate", "6", CM_UNKNOWN, 0}},
-    {0x5271, {"Largos Twins", "6", CM_HEALTH_BASED, 18000000}},
-    {0x5261, {"Largos Twins", "6", CM_HEALTH_BASED, 18000000}},
-    {0x51c6, {"Qadim", "6", CM_HEALTH_BASED, 21000000}},
-    /* Raid Wing 7 */
-    {0x55f6, {"Cardinal Adina", "7", CM_UNKNOWN, 0}},
-    {0x55cc, {"Cardinal Sabir", "7", CM_UNKNOWN, 0}},
-    {0x55f0, {"Qadim the Peerless", "7", CM_UNKNOWN, 0}},
-    /* Winter Strike Mission */
-    {0x5355, {"Freezie", "Wintersday", CM_NO, 0}},
-    /* Fractal 99 CM */
-    {0x427d, {"MAMA", "99cm", CM_YES, 0}},
-    {0x4284, {"Siax", "99cm", CM_YES, 0}},
-    {0x4234, {"Ensolyss", "99cm", CM_YES, 0}},
-    /* Fractal 100 CM */
-    {0x44e0, {"Skorvald the Shattered", "100cm", CM_YES, 0}},
-    {0x461d, {"Artsariiv", "100cm", CM_YES, 0}},
-    {0x455f, {"Arkk", "100cm", CM_YES, 0}},
-    /* Aquatic Ruins Fractal */
-    {0x2C8A, {"Jellyfish Beast", "Aquatic Ruins", CM_NO, 0}},
-    /* Captain Mai Trin Boss */
-    {0x4263, {"Champion Inquest Technician", "Mai Trin Boss", CM_NO, 0}},
-    {0x2fea, {"Mai Trin", "Mai Trin Boss", CM_NO, 0}},
-    /* Chaos Isles Fractal */
-    {0x40E9, {"Brazen Gladiator", "Chaos Isles", CM_NO, 0}},
-    /* Cliffside Fractal */
-    {0x2C20, {"Archdiviner", "Cliffside", CM_NO, 0}},
-    /* Molten Boss */
-    {0x325E, {"Molten Effigy", "Molten Boss", CM_NO, 0}},
-    /* Nightmare */
-    {0x4268, {"MAMA", "Nightmare", CM_NO, 0}},
-    {0x4215, {"Siax the Unclean", "Nightmare", CM_NO, 0}},
-    {0x429B, {"Ensolyss", "Nightmare", CM_NO, 0}},
-    /* Shattered Observatory */
-    {0x44E0, {"Skorvald the Shattered", "Shattered Observatory", CM_NO, 0}},
-    /* Snowblind */
-    {0x2C45, {"Svanir Shaman", "Snowblind", CM_NO, 0}},
-    /* Solid Ocean */
-    {0x2BF6, {"The Jade Maw", "Solid Ocean", CM_NO, 0}},
-    /* Swampland */
-    {0x2C00, {"Mossman", "Swampland", CM_NO, 0}},
-    {0x2C01, {"Bloomhunger", "Swampland", CM_NO, 0}},
-    /* Thaumanova Reactor */
-    {0x3268, {"Subject 6", "Thaumanova", CM_NO, 0}},
-    {0x326A, {"Thaumanova Anomaly", "Thaumanova", CM_NO, 0}},
-    /* Underground Facility */
-    {0x2BE9, {"Rabsovich", "Underground Facility", CM_NO, 0}},
-    {0x2BE8, {"Rampaging Ice Elemental", "Underground Facility", CM_NO, 0}},
-    {0x2BE7, {"Dredge Powersuit", "Underground Facility", CM_NO, 0}},
-    /* Urban Battleground */
-    {0x2C9D, {"Siegemaster Dulfy", "Urban Battleground", CM_NO, 0}},
-    {0x2C90, {"Captain Ashym", "Urban Battleground", CM_NO, 0}},
-    /* Volcanic */
-    {0x2CDC, {"Grawl Shaman", "Volcanic", CM_NO, 0}},
-    {0x2CDD, {"Imbued Shaman", "Volcanic", CM_NO, 0}},
-    /* Uncategorized */
-    {0x2C41, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
-    {0x2C44, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
-    {0x2C43, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
-    {0x2C3A, {"Old Tom", "Uncategorized", CM_NO, 0}},
-    {0x2C3D, {"Raving Asura", "Uncategorized", CM_NO, 0}},
-    {0x2C3C, {"Raving Asura", "Uncategorized", CM_NO, 0}},
-    {0x2C3E, {"Raving Asura", "Uncategorized", CM_NO, 0}},
-    {0x2C3F, {"Raving Asura", "Uncategorized", CM_NO, 0}},
-    /* Training Golems */
-    {0x3f46, {"Vital Kitty Golem (10m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f31, {"Average Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f47, {"Standard Kitty Golem (1m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f29, {"Massive Kitty Golem (10m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f4a, {"Massive Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f32, {"Massive Kitty Golem (1m HP)", "Training Golem", CM_NO, 0}},
-    {0x3f2e, {"Tough Kitty Golem", "Training Golem", CM_NO, 0}},
-    {0x3f30, {"Resistant Kitty Golem", "Training Golem", CM_NO, 0}},
-    {0x4cdc, {"Large Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
-    {0x4cbd, {"Medium Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
-};
+    write_head(CBOR_TEXT, length);
+
+    if (all_valid) {
+        out.append(str, len);
+        return;
+    }
+
+    for (i = 0; i < len; i += seq) {
+        seq = utf8_sequence(bytes + i, len - i, valid);
+        if (valid) {
+            out.append(str + i, seq);
+        } else {
+            out += utf8_replacement;
+        }
+    }
+}
+
+void
+cbor_writer::number_value(uint64_t number)
+{
+    write_head(CBOR_UNSIGNED, number);
+}
+
+void
+cbor_writer::signed_value(int64_t number)
+{
+    if (number >= 0) {
+        write_head(CBOR_UNSIGNED, number);
+    } else {
+        /* Negative integers hold -1 - number */
+        write_head(CBOR_NEGATIVE, ~(uint64_t)number);
+    }
+}
+
+void
+cbor_writer::bool_value(bool value)
+{
+    out += (char)(value ? CBOR_TRUE : CBOR_FALSE);
+}
 
-static const uint64_t arcdps_src_agent = 0x637261;
+/**
+ * unescape_json_string - decode a JSON string into the scratch buffer
+ * @text: the JSON text, starting at the opening quote
+ * @len: the length of @text
+ *
+ * Returns the length of the quoted string within @text.
+ */
+size_t
+cbor_writer::unescape_json_string(const char *text, size_t len)
+{
+    size_t i = 1;
 
-/* is_elite value indicating a non-player object */
-static const uint32_t EVTC_AGENT_NON_PLAYER_AGENT = 0xffffffff;
+    scratch.clear();
+    while (i < len && text[i] != '"') {
+        uint32_t codepoint = 0;
 
-/* upper bits of profession indicating whether this agent is a gadget */
-static const uint32_t EVTC_AGENT_GADGET_AGENT = 0xffff0000;
+        if (text[i] != '\\') {
+            scratch += text[i++];
+            continue;
+        }
 
-/* lower bits of profession indicating species id of this agent */
-static const uint32_t EVTC_AGENT_SPECIES_ID_MASK = 0x0000ffff;
+        if (++i == len) {
+            break;
+        }
 
-struct player_details {
-    string character;
-    string account;
-    string subgroup;
+        switch (text[i++]) {
+        case 'b':
+            scratch += '\b';
+            continue;
+        case 'f':
+            scratch += '\f';
+            continue;
+        case 'n':
+            scratch += '\n';
+            continue;
+        case 'r':
+            scratch += '\r';
+            continue;
+        case 't':
+            scratch += '\t';
+            continue;
+        case 'u':
+            break;
+        default:
+            /* \", \\ and \/ stand for the character itself */
+            scratch += text[i - 1];
+            continue;
+        }
 
-    /* EVTC agent identifier */
-    uint64_t addr;
+        if (len - i < 4 || from_chars(text + i, text + i + 4, codepoint, 16).ptr != text + i + 4) {
+            scratch += utf8_replacement;
+            continue;
+        }
+        i += 4;
+
+        /* Characters outside the BMP are escaped as surrogate pairs */
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF && len - i >= 6 &&
+            text[i] == '\\' && text[i + 1] == 'u') {
+            uint32_t low = 0;
+
+            if (from_chars(text + i + 2, text + i + 6, low, 16).ptr == text + i + 6 &&
+                low >= 0xDC00 && low <= 0xDFFF) {
+                codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                i += 6;
+            }
+        }
 
-    /* 16-byte Guild UID */
-    struct evtc_guid guid;
-};
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+            scratch += utf8_replacement;
+        } else if (codepoint < 0x80) {
+            scratch += (char)codepoint;
+        } else if (codepoint < 0x800) {
+            scratch += (char)(0xC0 | (codepoint >> 6));
+            scratch += (char)(0x80 | (codepoint & 0x3F));
+        } else if (codepoint < 0x10000) {
+            scratch += (char)(0xE0 | (codepoint >> 12));
+            scratch += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+            scratch += (char)(0x80 | (codepoint & 0x3F));
+        } else {
+            scratch += (char)(0xF0 | (codepoint >> 18));
+            scratch += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+            scratch += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+            scratch += (char)(0x80 | (codepoint & 0x3F));
+        }
+    }
 
-struct parsed_details {
-    /* Metadata */
-    uint32_t agent_count;
-    uint32_t skill_count;
-    uint32_t cbt_event_count;
-    streampos cbt_event_start;
-
-    /* Extracted data */
-    char arc_header[13];
-    uint8_t revision;
-    uint16_t boss_id;
-    struct encounter_info boss_info;
-    uint64_t boss_src_agent;
-    uint64_t boss_maxhealth;
-    uint32_t server_start;
-    uint32_t server_end;
-    uint64_t precise_last_event;
-    uint64_t precise_logend_time;
-    uint64_t precise_reward_time;
-    uint64_t precise_start;
-    uint64_t precise_end;
-    bool encounter_success;
-    map<uint64_t, player_details> players;
-};
+    return min(i + 1, len);
+}
 
 /**
- * parse_header: extract details from the EVTC header line
- * @details: data structure to hold extracted data
- * @file: the ifstream to read from
+ * write_json_scalar - transcode a JSON number, true, false or null
+ * @text: the JSON text, starting at the value
+ * @len: the length of @text
  *
- * Parse the @file for an EVTC header, and validate that it is, then
- * extract the file version, encounter id, and boss name into the
- * @details structure. Otherwise, return a negative error code.
+ * Integers are kept as integers where they fit, and every other number is
+ * written as a double. Returns the length of the value within @text.
  */
-static int
-parse_header(parsed_details& details, ifstream& file)
+size_t
+cbor_writer::write_json_scalar(const char *text, size_t len)
+{
+    const char *end = text;
+    uint64_t unsigned_number;
+    int64_t signed_number;
+    double number;
+    size_t length;
+
+    while (end < text + len && !strchr(",:]}", *end)) {
+        end++;
+    }
+    length = end - text;
+
+    auto is_integer = [end](from_chars_result res) {
+        return res.ec == errc() && res.ptr == end;
+    };
+
+    if (length == 4 && !memcmp(text, "true", 4)) {
+        bool_value(true);
+    } else if (length == 5 && !memcmp(text, "false", 5)) {
+        bool_value(false);
+    } else if (length == 4 && !memcmp(text, "null", 4)) {
+        out += (char)CBOR_NULL;
+    } else if (is_integer(from_chars(text, end, unsigned_number))) {
+        number_value(unsigned_number);
+    } else if (is_integer(from_chars(text, end, signed_number))) {
+        signed_value(signed_number);
+    } else {
+        /* strtod needs a terminated string */
+        scratch.assign(text, end - text);
+        number = strtod(scratch.c_str(), nullptr);
+        write_double(number);
+    }
+
+    return length;
+}
+
+/**
+ * write_json - transcode compact JSON text
+ * @text: compact JSON text, as written by a json_writer without indent
+ * @len: the length of @text
+ */
+void
+cbor_writer::write_json(const char *text, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        switch (text[i]) {
+        case '{':
+            begin_object();
+            i++;
+            break;
+        case '[':
+            begin_array();
+            i++;
+            break;
+        case '}':
+        case ']':
+            out += (char)CBOR_BREAK;
+            i++;
+            break;
+        case ',':
+        case ':':
+            i++;
+            break;
+        case '"':
+            /* Keys and string values are both text strings */
+            i += unescape_json_string(text + i, len - i);
+            write_string(scratch.data(), scratch.size());
+            break;
+        default:
+            i += write_json_scalar(text + i, len - i);
+            break;
+        }
+    }
+}
+
+void
+cbor_writer::raw_value(const string& text)
+{
+    write_json(text.data(), text.size());
+}
+
+void
+cbor_writer::merge_object(const string& text)
 {
-    char raw_header[16];
+    if (text.size() > 2) {
+        write_json(text.data() + 1, text.size() - 2);
+    }
+}
+
+/* Encodings for structured output */
+enum output_format {
+    FORMAT_JSON,
+    FORMAT_CBOR,
+};
+
+/**
+ * parse_output_format - Parse the value of a --format option
+ * @value: the option value, "json" or "cbor"
+ * @format: on return, the output format
+ *
+ * Returns false if @value is not a known format.
+ */
+static bool
+parse_output_format(const string& value, output_format& format)
+{
+    if (value == "json") {
+        format = FORMAT_JSON;
+    } else if (value == "cbor") {
+        format = FORMAT_CBOR;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * set_binary_stdout - Stop standard output from translating line endings
+ *
+ * Needed before writing CBOR, which is binary, on Windows.
+ */
+static void
+set_binary_stdout()
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+/**
+ * write_details_json - Serialize a parsed log as an object
+ * @writer: the writer to serialize with
+ * @log: the parsed log to serialize
+ *
+ * The keys are written in sorted order, so the JSON output is the same as
+ * it was when simpleArcParse serialized through nlohmann::json.
+ */
+static void
+write_details_json(output_writer& writer, const sap_log *log)
+{
+    uint64_t start = sap_get_number(log, SAP_FIELD_LOCAL_START);
+    uint64_t end = sap_get_number(log, SAP_FIELD_LOCAL_END);
+    uint64_t reward = sap_get_number(log, SAP_FIELD_LOCAL_REWARD);
+    uint64_t log_end = sap_get_number(log, SAP_FIELD_LOCAL_LOG_END);
+    uint32_t i;
+
+    writer.begin_object();
+
+    /* Boss information */
+    writer.key("boss");
+    writer.begin_object();
+    writer.key("duration");
+    writer.number_value(end - start);
+    writer.key("id");
+    writer.number_value(sap_get_number(log, SAP_FIELD_BOSS_ID));
+    writer.key("is_cm");
+    switch (sap_get_number(log, SAP_FIELD_BOSS_CM)) {
+    case SAP_CM_NO:
+        writer.string_value("NO");
+        break;
+    case SAP_CM_YES:
+        writer.string_value("YES");
+        break;
+    case SAP_CM_UNKNOWN:
+        writer.string_value("UNKNOWN");
+        break;
+    case SAP_CM_HEALTH_BASED:
+    default:
+        writer.string_value("INVALID");
+        break;
+    }
+    writer.key("location");
+    writer.string_value(sap_get_string(log, SAP_FIELD_BOSS_LOCATION));
+    writer.key("maxhealth");
+    writer.number_value(sap_get_number(log, SAP_FIELD_BOSS_MAXHEALTH));
+    writer.key("name");
+    writer.string_value(sap_get_string(log, SAP_FIELD_BOSS_NAME));
+    writer.key("success");
+    writer.bool_value(sap_get_number(log, SAP_FIELD_SUCCESS));
+    writer.end_object();
+
+    /* ArcDPS data */
+    writer.key("header");
+    writer.begin_object();
+    writer.key("arcdps_version");
+    writer.string_value(sap_get_string(log, SAP_FIELD_ARCDPS_VERSION));
+    writer.key("revision");
+    writer.number_value(sap_get_number(log, SAP_FIELD_REVISION));
+    writer.end_object();
+
+    /* Local timestamps */
+    writer.key("local_time");
+    writer.begin_object();
+    writer.key("end");
+    writer.number_value(end);
+    writer.key("last_event");
+    writer.number_value(sap_get_number(log, SAP_FIELD_LOCAL_LAST_EVENT));
+    if (log_end) {
+        writer.key("log_end");
+        writer.number_value(log_end);
+    }
+    if (reward) {
+        writer.key("reward");
+        writer.number_value(reward);
+    }
+    writer.key("start");
+    writer.number_value(start);
+    writer.end_object();
+
+    /* Players */
+    writer.key("players");
+    writer.begin_array();
+    for (i = 0; i < sap_player_count(log); i++) {
+        const char *guid = sap_player_string(log, i, SAP_PLAYER_GUID);
+
+        writer.begin_object();
+        writer.key("account");
+        writer.string_value(sap_player_string(log, i, SAP_PLAYER_ACCOUNT));
+        writer.key("character");
+        writer.string_value(sap_player_string(log, i, SAP_PLAYER_CHARACTER));
+
+        /* Add the Guild UID if we found it */
+        if (guid) {
+            writer.key("guid");
+            writer.string_value(guid);
+        }
+
+        writer.key("subgroup");
+        writer.string_value(sap_player_string(log, i, SAP_PLAYER_SUBGROUP));
+        writer.end_object();
+    }
+    writer.end_array();
+
+    /* server timestamps */
+    writer.key("server_time");
+    writer.begin_object();
+    writer.key("end");
+    writer.number_value(sap_get_number(log, SAP_FIELD_SERVER_END));
+    writer.key("start");
+    writer.number_value(sap_get_number(log, SAP_FIELD_SERVER_START));
+    writer.end_object();
+
+    /* Track what version of simpleArcParse was used */
+    writer.key("simpleArcParse");
+    writer.begin_object();
+    writer.key("version");
+    writer.string_value(version);
+    writer.end_object();
+
+    writer.end_object();
+}
+
+/**
+ * output_json - Output data in JSON format
+ * @data: the compact json details to output
+ *
+ * Writes the details produced by write_details_json to the console, with
+ * an indent of four spaces.
+ */
+static void
+output_json(const string& data)
+{
+    string text;
+    json_writer writer(text, 4);
+
+    writer.raw_value(data);
+    cout << text << std::endl;
+}
+
+/**
+ * output_cbor - Output data in CBOR format
+ * @data: the compact json details to output
+ *
+ * Writes the details produced by write_details_json to the console as a
+ * single CBOR data item.
+ */
+static void
+output_cbor(const string& data)
+{
+    string bytes;
+    cbor_writer writer(bytes);
+
+    writer.raw_value(data);
+
+    set_binary_stdout();
+    cout.write(bytes.data(), bytes.size());
+    cout.flush();
+}
+
+/**
+ * output_movement - Output the movement tracks of a log
+ * @log: the parsed log
+ *
+ * Writes the tracks returned by sap_movement_tracks to the console as is.
+ */
+static void
+output_movement(const sap_log *log)
+{
+    size_t len;
+    const char *tracks = (const char *)sap_movement_tracks(log, &len);
+
+    set_binary_stdout();
+    cout.write(tracks, len);
+    cout.flush();
+}
+
+/**
+ * damage_per_second - Convert damage to damage per second
+ * @damage: the damage dealt
+ * @duration: the length of the encounter in milliseconds
+ */
+static uint64_t
+damage_per_second(uint64_t damage, uint64_t duration)
+{
+    if (!duration) {
+        return 0;
+    }
+
+    return damage * 1000 / duration;
+}
+
+/* Names of the boons output by boons, in the order of enum sap_boon */
+static const char *const boon_names[] = {
+    "might", "fury", "quickness", "alacrity", "protection", "regeneration",
+    "vigor", "aegis", "stability", "swiftness", "retaliation", "resistance",
+};
+
+static_assert(extent<decltype(boon_names)>::value == SAP_BOON_RESISTANCE + 1,
+              "boon_names must match enum sap_boon");
+
+/* Milliseconds covered by each line of health output, unless specified */
+static const uint32_t default_health_resolution = 1000;
+
+/**
+ * parse_resolution - Parse the resolution of health output
+ * @text: the resolution in milliseconds
+ * @resolution: on success, the parsed resolution
+ *
+ * Returns -EINVAL unless @text is a whole number of milliseconds from 0 to
+ * UINT32_MAX, so that negative or oversized values are not wrapped around.
+ */
+static int
+parse_resolution(const string& text, uint32_t& resolution)
+{
+    const char *end = text.data() + text.size();
+    auto res = from_chars(text.data(), end, resolution);
+
+    if (res.ec != errc() || res.ptr != end) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * format_health - Format health in hundredths of a percent as a percentage
+ * @text: buffer to hold the formatted health
+ * @size: the size of @text
+ * @health: the health to format
+ */
+static const char *
+format_health(char *text, size_t size, uint64_t health)
+{
+    snprintf(text, size, "%.2f", health / 100.0);
+    return text;
+}
+
+/**
+ * output_details - Output the parsed details for a single output type
+ * @type: the output type, other than json
+ * @log: the parsed log to output
+ * @resolution: milliseconds covered by each line of health output
+ * @out: the stream to write to
+ */
+static void
+output_details(const string& type, const sap_log *log, uint32_t resolution, ostream& out)
+{
+    uint64_t start = sap_get_number(log, SAP_FIELD_LOCAL_START);
+    uint64_t end = sap_get_number(log, SAP_FIELD_LOCAL_END);
+    uint32_t i;
+
+    if (type == "header") {
+        out << sap_get_string(log, SAP_FIELD_ARCDPS_VERSION) << endl;
+        out << sap_get_string(log, SAP_FIELD_BOSS_NAME) << endl;
+        out << sap_get_number(log, SAP_FIELD_BOSS_ID) << endl;
+    } else if (type == "revision") {
+        out << sap_get_number(log, SAP_FIELD_REVISION) << endl;
+    } else if (type == "players") {
+        for (i = 0; i < sap_player_count(log); i++) {
+            out << sap_player_string(log, i, SAP_PLAYER_ACCOUNT) << endl;
+        }
+    } else if (type == "success") {
+        if (sap_get_number(log, SAP_FIELD_SUCCESS)) {
+            out << "SUCCESS" << endl;
+        } else {
+            out << "FAILURE" << endl;
+        }
+    } else if (type == "start_time") {
+        out << sap_get_number(log, SAP_FIELD_SERVER_START) << endl;
+    } else if (type == "end_time") {
+        out << sap_get_number(log, SAP_FIELD_SERVER_END) << endl;
+    } else if (type == "boss_maxhealth") {
+        out << sap_get_number(log, SAP_FIELD_BOSS_MAXHEALTH) << endl;
+    } else if (type == "is_cm") {
+        switch (sap_get_number(log, SAP_FIELD_BOSS_CM)) {
+        case SAP_CM_NO:
+            out << "NO" << endl;
+            break;
+        case SAP_CM_YES:
+            out << "YES" << endl;
+            break;
+        case SAP_CM_UNKNOWN:
+        case SAP_CM_HEALTH_BASED:
+        default:
+            out << "UNKNOWN" << endl;
+            break;
+        }
+    } else if (type == "duration") {
+        if (end >= start)
+            out << (end - start) << endl;
+    } else if (type == "local_start_time") {
+        out << start << endl;
+    } else if (type == "local_end_time") {
+        out << end << endl;
+    } else if (type == "location") {
+        out << sap_get_string(log, SAP_FIELD_BOSS_LOCATION) << endl;
+    } else if (type == "dps") {
+        uint64_t duration = end >= start ? end - start : 0;
+
+        /* Account names may contain spaces, so columns are tab separated */
+        for (i = 0; i < sap_player_count(log); i++) {
+            uint64_t boss_direct = sap_player_damage(log, i, SAP_DAMAGE_BOSS_DIRECT);
+            uint64_t boss_condition = sap_player_damage(log, i, SAP_DAMAGE_BOSS_CONDITION);
+            uint64_t all_direct = sap_player_damage(log, i, SAP_DAMAGE_ALL_DIRECT);
+            uint64_t all_condition = sap_player_damage(log, i, SAP_DAMAGE_ALL_CONDITION);
+
+            out << sap_player_string(log, i, SAP_PLAYER_ACCOUNT) << '\t'
+                << damage_per_second(boss_direct + boss_condition, duration) << '\t'
+                << damage_per_second(all_direct + all_condition, duration) << '\t'
+                << boss_direct << '\t' << boss_condition << '\t'
+                << all_direct << '\t' << all_condition << endl;
+        }
+    } else if (type == "boons") {
+        uint64_t duration = end >= start ? end - start : 0;
+        char text[64];
+
+        /* One line per player and boon, with the uptime as a percentage
+         * and the average number of stacks
+         */
+        for (i = 0; i < sap_player_count(log); i++) {
+            for (int boon = SAP_BOON_MIGHT; boon <= SAP_BOON_RESISTANCE; boon++) {
+                uint64_t uptime = sap_player_boon(log, i, (sap_boon)boon, SAP_BOON_FIELD_UPTIME);
+                uint64_t stack_time = sap_player_boon(log, i, (sap_boon)boon,
+                                                      SAP_BOON_FIELD_STACK_TIME);
+
+                snprintf(text, sizeof(text), "%.2f\t%.2f",
+                         duration ? uptime * 100.0 / duration : 0.0,
+                         duration ? (double)stack_time / duration : 0.0);
+
+                out << sap_player_string(log, i, SAP_PLAYER_ACCOUNT) << '\t'
+                    << boon_names[boon] << '\t' << text << endl;
+            }
+        }
+    } else if (type == "health") {
+        uint32_t count = sap_boss_health(log, resolution, nullptr, nullptr, 0);
+        vector<uint64_t> times(count);
+        vector<uint32_t> health(count);
+        char text[32];
+
+        /* One line per sample, with the milliseconds since the log start
+         * and the health as a percentage
+         */
+        sap_boss_health(log, resolution, times.data(), health.data(), count);
+        for (i = 0; i < count; i++) {
+            out << (times[i] >= start ? times[i] - start : 0) << '\t'
+                << format_health(text, sizeof(text), health[i]) << endl;
+        }
+    } else if (type == "phases") {
+        char start_health[32], end_health[32];
+
+        /* One line per phase, numbered from one, with the milliseconds
+         * since the log start and the health at each end of the phase
+         */
+        for (i = 0; i < sap_phase_count(log); i++) {
+            uint64_t phase_start = sap_phase(log, i, SAP_PHASE_START);
+            uint64_t phase_end = sap_phase(log, i, SAP_PHASE_END);
+
+            out << (i + 1) << '\t' << (phase_start - start) << '\t' << (phase_end - start) << '\t'
+                << format_health(start_health, sizeof(start_health),
+                                 sap_phase(log, i, SAP_PHASE_START_HEALTH)) << '\t'
+                << format_health(end_health, sizeof(end_health),
+                                 sap_phase(log, i, SAP_PHASE_END_HEALTH)) << endl;
+        }
+    }
+}
+
+/**
+ * is_evtc_filename - Check if a file name has an EVTC extension
+ * @filename: the name to check
+ *
+ * Matches the uncompressed (.evtc) and compressed (.evtc.zip and .zevtc)
+ * extensions, ignoring case, just like ExtensionIs-EVTC in the scripts.
+ */
+static bool
+is_evtc_filename(const string& filename)
+{
+    static const string extensions[] = {".evtc", ".evtc.zip", ".zevtc"};
+    string lower = filename;
+
+    transform(lower.begin(), lower.end(), lower.begin(),
+              [](unsigned char c) { return tolower(c); });
+
+    for (auto& ext : extensions) {
+        if (lower.size() >= ext.size() &&
+            lower.compare(lower.size() - ext.size(), ext.size(), ext) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * get_file_mtime - Get the last write time of a file
+ * @path: the file to check
+ * @mtime: on return, the last write time in seconds since the Unix epoch
+ *
+ * Returns false if the file could not be checked.
+ */
+static bool
+get_file_mtime(const string& path, int64_t& mtime)
+{
+#ifdef _WIN32
+    struct __stat64 st;
+
+    if (_stat64(path.c_str(), &st))
+        return false;
+#else
+    struct stat st;
+
+    if (stat(path.c_str(), &st))
+        return false;
+#endif
+
+    mtime = st.st_mtime;
+    return true;
+}
+
+/**
+ * collect_batch_files - Find the EVTC files within a directory
+ * @dir: the directory to scan recursively
+ * @since: only include files written after this Unix time
+ * @files: list to append the matching file names to
+ *
+ * Files are appended in order of their last write time, oldest first, so
+ * that they are processed in the order they were recorded.
+ */
+static void
+collect_batch_files(const string& dir, int64_t since, vector<string>& files)
+{
+    vector<pair<int64_t, string>> found;
+    error_code ec;
+
+    for (auto it = filesystem::recursive_directory_iterator(dir, ec);
+         it != filesystem::recursive_directory_iterator();
+         it.increment(ec)) {
+        string path;
+        int64_t mtime;
+
+        if (ec)
+            break;
+
+        if (!it->is_regular_file(ec))
+            continue;
+
+        path = it->path().string();
+        if (!is_evtc_filename(it->path().filename().string()))
+            continue;
+
+        if (!get_file_mtime(path, mtime) || mtime <= since)
+            continue;
+
+        found.emplace_back(mtime, path);
+    }
+
+    stable_sort(found.begin(), found.end(),
+                [](const pair<int64_t, string>& a, const pair<int64_t, string>& b) {
+                    return a.first < b.first;
+                });
+
+    for (auto& entry : found)
+        files.push_back(entry.second);
+}
+
+/* Parse result cache
+ *
+ * The json details of every log parsed are kept in a per-user cache
+ * directory, so that parsing the same log again only costs a lookup. Each
+ * log has its own small entry file, named after a hash of its full path.
+ * An entry is only used if the size, last write time, and a hash of the
+ * header and agent table of the log still match, and it was written by the
+ * same version of simpleArcParse.
+ *
+ * Entries are written to a temporary file which is then renamed over the
+ * entry, so concurrent readers only ever see a complete entry, and
+ * concurrent writers simply replace each other's entries.
+ *
+ * The cache is stored in SIMPLEARCPARSE_CACHE if it is set, and is
+ * disabled by setting it to "off".
+ */
+
+/* Format of the cache entries. Bump it whenever evtc_cache_entry changes */
+static const uint32_t EVTC_CACHE_FORMAT = 1;
+
+/* Cache entries larger than this are assumed to be corrupt */
+static const uint32_t EVTC_CACHE_MAX_DATA = 1 << 24;
+
+#pragma pack(push, 1)
+/* Header of a cache entry, followed by the version, path and data */
+struct evtc_cache_entry {
+    char magic[4];          /* "SAPC" */
+    uint32_t format;        /* EVTC_CACHE_FORMAT */
+    uint64_t size;          /* size of the log */
+    int64_t mtime;          /* last write time of the log */
+    uint64_t content_hash;  /* hash of the log header and agent table */
+    uint32_t version_len;   /* length of the simpleArcParse version */
+    uint32_t path_len;      /* length of the log path */
+    uint32_t data_len;      /* length of the compact json data */
+    uint64_t check;         /* hash of the version, path and data */
+};
+#pragma pack(pop)
+
+struct evtc_cache_key {
+    string path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t content_hash;
+};
+
+/**
+ * evtc_cache_dir - Find the directory holding the parse cache
+ *
+ * Returns an empty path if the cache is disabled.
+ */
+static filesystem::path
+evtc_cache_dir()
+{
+    const char *dir = getenv("SIMPLEARCPARSE_CACHE");
+
+    if (dir) {
+        if (!strcmp(dir, "off"))
+            return filesystem::path();
+        return filesystem::path(dir);
+    }
+
+#ifdef _WIN32
+    dir = getenv("LOCALAPPDATA");
+    if (dir && *dir)
+        return filesystem::path(dir) / "simpleArcParse" / "cache";
+#else
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir)
+        return filesystem::path(dir) / "simpleArcParse";
+
+    dir = getenv("HOME");
+    if (dir && *dir)
+        return filesystem::path(dir) / ".cache" / "simpleArcParse";
+#endif
+
+    return filesystem::path();
+}
+
+/**
+ * get_evtc_cache_key - Identify a log for the parse cache
+ * @filename: the log file
+ * @key: on return, the identity of the log
+ *
+ * Only regular files can be cached. Compressed logs are hashed using their
+ * decompressed contents, along with the encounter overlay file if one is
+ * used. Returns a negative error code if the file cannot be cached.
+ */
+static int
+get_evtc_cache_key(const string& filename, evtc_cache_key& key)
+{
+    uint64_t overlay_hash;
+    sap_log *log;
+    error_code ec;
+    int err;
+
+    if (filename == "-" || !filesystem::is_regular_file(filename, ec)) {
+        return -ESPIPE;
+    }
+
+    key.path = filesystem::absolute(filename, ec).string();
+    if (ec) {
+        return -ENOENT;
+    }
+
+    key.size = filesystem::file_size(filename, ec);
+    if (ec) {
+        return -ENOENT;
+    }
+
+    auto mtime = filesystem::last_write_time(filename, ec);
+    if (ec) {
+        return -ENOENT;
+    }
+
+    key.mtime = mtime.time_since_epoch().count();
+
+    err = sap_open_file(filename.c_str(), SAP_QUERY_AGENT_HASH, 1, &log);
+    if (err) {
+        return err;
+    }
+
+    key.content_hash = sap_get_number(log, SAP_FIELD_AGENT_HASH);
+    sap_close(log);
+
+    /* Encounter details may come from an overlay file, so results parsed
+     * with a different overlay must not be reused. The library hashes the
+     * overlay as it loaded it, since the file may have changed since then.
+     * An overlay which was ignored does not change the results.
+     */
+    if (!sap_encounter_overlay(nullptr, &overlay_hash) && overlay_hash) {
+        key.content_hash = sap_hash(key.content_hash, &overlay_hash, sizeof(overlay_hash));
+    }
+
+    return 0;
+}
+
+/* Location of the cache entry for a log */
+static filesystem::path
+evtc_cache_entry_path(const filesystem::path& dir, const evtc_cache_key& key)
+{
+    stringstream ss;
+
+    ss << hex << setw(16) << setfill('0') << sap_hash(SAP_HASH_INIT, key.path.data(), key.path.size());
+
+    return dir / (ss.str() + ".sapc");
+}
+
+/**
+ * evtc_cache_lookup - Find the parsed details of a log in the cache
+ * @dir: the cache directory
+ * @key: the identity of the log
+ * @data: on return, the compact json details of the log
+ *
+ * Returns true if a valid entry was found. Missing, stale and corrupt
+ * entries are all treated as a miss.
+ */
+static bool
+evtc_cache_lookup(const filesystem::path& dir, const evtc_cache_key& key, string& data)
+{
+    ifstream in(evtc_cache_entry_path(dir, key), ios::binary);
+    evtc_cache_entry entry;
+    string contents;
+    uint64_t check;
+
+    if (!in.read((char *)&entry, sizeof(entry))) {
+        return false;
+    }
+
+    if (memcmp(entry.magic, "SAPC", 4) || entry.format != EVTC_CACHE_FORMAT ||
+        entry.size != key.size || entry.mtime != key.mtime ||
+        entry.content_hash != key.content_hash ||
+        entry.version_len != version.size() || entry.path_len != key.path.size() ||
+        entry.data_len > EVTC_CACHE_MAX_DATA) {
+        return false;
+    }
+
+    contents.resize((size_t)entry.version_len + entry.path_len + entry.data_len);
+    if (!in.read(&contents[0], contents.size())) {
+        return false;
+    }
+
+    check = sap_hash(SAP_HASH_INIT, contents.data(), contents.size());
+    if (check != entry.check) {
+        return false;
+    }
+
+    if (contents.compare(0, entry.version_len, version) ||
+        contents.compare(entry.version_len, entry.path_len, key.path)) {
+        return false;
+    }
+
+    data.assign(contents, entry.version_len + entry.path_len, entry.data_len);
+
+    return true;
+}
+
+/**
+ * evtc_cache_store - Store the parsed details of a log in the cache
+ * @dir: the cache directory
+ * @key: the identity of the log
+ * @data: the compact json details of the log
+ *
+ * Failing to update the cache is not an error, the log will simply be
+ * parsed again next time.
+ */
+static void
+evtc_cache_store(const filesystem::path& dir, const evtc_cache_key& key, const string& data)
+{
+    static atomic<unsigned int> counter;
+    filesystem::path entry_path, temp_path;
+    evtc_cache_entry entry = {};
+    string contents;
+    stringstream ss;
+    error_code ec;
+
+    contents = version + key.path + data;
+
+    memcpy(entry.magic, "SAPC", 4);
+    entry.format = EVTC_CACHE_FORMAT;
+    entry.size = key.size;
+    entry.mtime = key.mtime;
+    entry.content_hash = key.content_hash;
+    entry.version_len = version.size();
+    entry.path_len = key.path.size();
+    entry.data_len = contents.size() - entry.version_len - entry.path_len;
+    entry.check = sap_hash(SAP_HASH_INIT, contents.data(), contents.size());
+
+    if (entry.data_len > EVTC_CACHE_MAX_DATA) {
+        return;
+    }
+
+    filesystem::create_directories(dir, ec);
+
+    /* The temporary file must be unique to this process and thread */
+#ifdef _WIN32
+    ss << GetCurrentProcessId();
+#else
+    ss << getpid();
+#endif
+    ss << "-" << hash<thread::id>()(this_thread::get_id()) << "-" << counter++;
+
+    entry_path = evtc_cache_entry_path(dir, key);
+    temp_path = entry_path;
+    temp_path += "." + ss.str() + ".tmp";
+
+    {
+        ofstream out(temp_path, ios::binary);
+
+        out.write((const char *)&entry, sizeof(entry));
+        out.write(contents.data(), contents.size());
+        out.close();
+
+        if (!out) {
+            filesystem::remove(temp_path, ec);
+            return;
+        }
+    }
+
+    filesystem::rename(temp_path, entry_path, ec);
+    if (ec) {
+        filesystem::remove(temp_path, ec);
+    }
+}
+
+/**
+ * parse_evtc_json - Parse the json details of an EVTC file
+ * @filename: the file to parse, or "-" for standard input
+ * @scan_threads: number of threads to scan the combat events with
+ * @data: on return, the compact json details of the file
+ *
+ * Uses the parse cache when possible, so that a log which has not changed
+ * since it was last parsed is not parsed again.
+ *
+ * Returns zero on success, or a negative error code as for sap_open_file.
+ */
+static int
+parse_evtc_json(const string& filename, unsigned int scan_threads, string& data)
+{
+    filesystem::path cache_dir = evtc_cache_dir();
+    evtc_cache_key key;
+    sap_log *log;
+    bool cacheable;
+    int err;
+
+    cacheable = !cache_dir.empty() && !get_evtc_cache_key(filename, key);
+
+    if (cacheable && evtc_cache_lookup(cache_dir, key, data)) {
+        return 0;
+    }
+
+    err = sap_open_file(filename.c_str(), SAP_QUERY_ALL, scan_threads, &log);
+    if (err) {
+        return err;
+    }
+
+    json_writer writer(data);
+
+    data.clear();
+    write_details_json(writer, log);
+    sap_close(log);
+
+    if (cacheable) {
+        evtc_cache_store(cache_dir, key, data);
+    }
+
+    return 0;
+}
+
+/**
+ * batch_record - Parse one EVTC file into a batch output record
+ * @filename: the file to parse
+ * @scan_threads: number of threads to scan the combat events with
+ * @format: the encoding of the record
+ * @record: on return, the output record
+ *
+ * The record holds the path of the file along with the same data as the
+ * json output, or an error if the file could not be parsed. JSON records
+ * are a single line, including the newline, while CBOR records are a
+ * single data item.
+ */
+static void
+batch_record(const string& filename, unsigned int scan_threads, output_format format,
+             string& record)
+{
+    /* Reused by every record parsed on this thread */
+    static thread_local string data;
+    json_writer json_out(record);
+    cbor_writer cbor_out(record);
+    output_writer& writer = format == FORMAT_CBOR ? (output_writer&)cbor_out : json_out;
+    int err;
+
+    record.clear();
+    writer.begin_object();
+    writer.key("path");
+    writer.string_value(filename);
+
+#ifdef SIMPLEARCPARSE_COUNT_ALLOCATIONS
+    uint64_t allocations = heap_allocations;
+#endif
+
+    err = parse_evtc_json(filename, scan_threads, data);
+
+#ifdef SIMPLEARCPARSE_COUNT_ALLOCATIONS
+    allocations = heap_allocations - allocations;
+#endif
+
+    if (err) {
+        writer.key("error");
+        writer.begin_object();
+        writer.key("code");
+        writer.signed_value(err);
+        writer.key("message");
+        writer.string_value(sap_strerror(err));
+        writer.end_object();
+    } else {
+        writer.merge_object(data);
+    }
+
+#ifdef SIMPLEARCPARSE_COUNT_ALLOCATIONS
+    writer.key("heap_allocations");
+    writer.number_value(allocations);
+#endif
+
+    writer.end_object();
+
+    if (format == FORMAT_JSON) {
+        record += '\n';
+    }
+}
+
+/**
+ * evtc_work_pool - fixed size thread pool with work stealing
+ *
+ * Each worker owns a queue of task numbers, initially a contiguous share of
+ * all the tasks. A worker takes tasks from the front of its own queue, and
+ * once that is empty, steals from the back of the other queues. A few huge
+ * logs landing on one worker therefore do not leave the other workers idle.
+ * No tasks are added once the pool is running, so a worker exits as soon
+ * as it finds every queue empty.
+ */
+class evtc_work_pool
+{
+private:
+    struct worker_queue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    vector<worker_queue> queues;
+
+    bool next_task(size_t self, size_t& task);
+    void worker(size_t self, const function<void(size_t)>& fn);
+public:
+    explicit evtc_work_pool(size_t threads)
+        : queues(threads)
+    {
+    }
+
+    void run(size_t count, const function<void(size_t)>& fn);
+};
+
+/**
+ * next_task - find the next task for a worker
+ * @self: the worker looking for a task
+ * @task: on return, the task to run
+ *
+ * Returns false once every queue is empty.
+ */
+bool
+evtc_work_pool::next_task(size_t self, size_t& task)
+{
+    size_t i;
+
+    {
+        lock_guard<mutex> guard(queues[self].lock);
+
+        if (!queues[self].tasks.empty()) {
+            task = queues[self].tasks.front();
+            queues[self].tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (i = 1; i < queues.size(); i++) {
+        worker_queue& victim = queues[(self + i) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+evtc_work_pool::worker(size_t self, const function<void(size_t)>& fn)
+{
+    size_t task;
+
+    while (next_task(self, task))
+        fn(task);
+}
+
+/**
+ * run - run tasks on the pool, returning once they have all completed
+ * @count: number of tasks, numbered from zero
+ * @fn: function to run each task
+ *
+ * The calling thread acts as one of the workers.
+ */
+void
+evtc_work_pool::run(size_t count, const function<void(size_t)>& fn)
+{
+    vector<thread> threads;
+    size_t i;
+
+    for (i = 0; i < queues.size(); i++)
+        queues[i].tasks.clear();
+
+    for (i = 0; i < count; i++)
+        queues[i * queues.size() / count].tasks.push_back(i);
+
+    for (i = 1; i < queues.size(); i++)
+        threads.emplace_back(&evtc_work_pool::worker, this, i, cref(fn));
+
+    worker(0, fn);
+
+    for (auto& t : threads)
+        t.join();
+}
+
+/**
+ * run_batch - Parse many EVTC files, outputting JSON Lines
+ * @argc: number of batch arguments
+ * @argv: the batch arguments
+ *
+ * Usage: batch [--since <unix time>] [--threads <count>]
+ *              [--order input|completion] [--format json|cbor]
+ *              <file or directory>...
+ *
+ * Every file is parsed, and the same data as the json output is written on
+ * a single line for each one, along with the path of the file. Directories
+ * are scanned recursively for EVTC files. When --since is given, only files
+ * written after that time are parsed. A file which fails to parse produces
+ * an error record rather than stopping the batch:
+ *
+ *   {"path": "...", "error": {"code": -22, "message": "..."}}
+ *
+ * Files are parsed in parallel by up to --threads workers, defaulting to one
+ * per CPU. A single file has its combat events scanned by up to --threads
+ * workers instead. With --order input (the default) records are written in the
+ * same order as the files, while --order completion writes each record as
+ * soon as its file is parsed.
+ *
+ * With --format cbor, each record is written as a CBOR data item instead of
+ * a line, so the output is a CBOR sequence (RFC 8742).
+ *
+ * Returns zero once every file has been attempted, or a negative error code
+ * if the arguments are invalid.
+ */
+static int
+run_batch(int argc, char *argv[])
+{
+    vector<string> paths, files;
+    int64_t since = INT64_MIN;
+    size_t threads = max(1u, thread::hardware_concurrency());
+    output_format format = FORMAT_JSON;
+    bool input_order = true;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--since" || arg == "--threads" || arg == "--order" || arg == "--format") {
+            string value;
+
+            if (++i == argc) {
+                return -EINVAL;
+            }
+            value = argv[i];
+
+            try {
+                if (arg == "--since") {
+                    since = stoll(value);
+                } else if (arg == "--threads") {
+                    threads = stoul(value);
+                } else if (arg == "--format") {
+                    if (!parse_output_format(value, format)) {
+                        return -EINVAL;
+                    }
+                } else if (value == "input" || value == "completion") {
+                    input_order = (value == "input");
+                } else {
+                    return -EINVAL;
+                }
+            } catch (const exception&) {
+                return -EINVAL;
+            }
+
+            if (!threads) {
+                return -EINVAL;
+            }
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    for (auto& arg : paths) {
+        error_code ec;
+
+        if (filesystem::is_directory(arg, ec)) {
+            collect_batch_files(arg, since, files);
+        } else {
+            int64_t mtime;
+
+            /* Let missing files produce an error record */
+            if (since != INT64_MIN && get_file_mtime(arg, mtime) && mtime <= since)
+                continue;
+
+            files.push_back(arg);
+        }
+    }
+
+    if (files.empty()) {
+        return 0;
+    }
+
+    if (format == FORMAT_CBOR) {
+        set_binary_stdout();
+    }
+
+    evtc_work_pool pool(min(threads, files.size()));
+    mutex output_lock;
+
+    /* Only split up the combat events when there is a single file. With
+     * more files, the threads are better spent on parsing files in parallel.
+     */
+    unsigned int scan_threads = files.size() == 1 ? threads : 1;
+    condition_variable output_cond;
+
+    if (!input_order) {
+        /* Write each record as soon as it is ready */
+        pool.run(files.size(), [&](size_t task) {
+            static thread_local string record;
+
+            batch_record(files[task], scan_threads, format, record);
+
+            lock_guard<mutex> guard(output_lock);
+
+            cout << record << flush;
+        });
+
+        return 0;
+    }
+
+    /* Records are written by this thread in order, while the pool parses
+     * in the background, so output starts as soon as the first file is
+     * done rather than once every file is.
+     */
+    vector<string> records(files.size());
+    vector<bool> done(files.size());
+    size_t next = 0;
+
+    thread parser([&]() {
+        pool.run(files.size(), [&](size_t task) {
+            batch_record(files[task], scan_threads, format, records[task]);
+
+            lock_guard<mutex> guard(output_lock);
+
+            done[task] = true;
+            output_cond.notify_all();
+        });
+    });
+
+    while (next < files.size()) {
+        string record;
+        bool more;
+
+        {
+            unique_lock<mutex> guard(output_lock);
+
+            output_cond.wait(guard, [&] { return done[next]; });
+            record = move(records[next]);
+            next++;
+            more = next < files.size() && done[next];
+        }
+
+        /* Only flush once there is nothing else ready to write */
+        cout << record;
+        if (!more) {
+            cout << flush;
+        }
+    }
+
+    parser.join();
+
+    return 0;
+}
+
+/* Serve mode
+ *
+ * A resident simpleArcParse process answers newline delimited JSON requests
+ * such as {"id": 1, "type": "json", "path": "..."}, so that scripts parsing
+ * many logs only pay for starting the process once. Requests are read from
+ * standard input, or from clients of a local socket, and are answered by a
+ * pool of worker threads. Several requests may be in flight at once, so
+ * responses can arrive out of order, and carry the id of their request.
+ * Responses are JSON lines, or CBOR data items for a server started with
+ * --format cbor.
+ */
+
+/**
+ * serve_connection - a source of requests and destination for responses
+ */
+class serve_connection
+{
+protected:
+    mutex write_lock;
+public:
+    virtual ~serve_connection() {}
+
+    virtual bool read_line(string& line) = 0;
+    virtual void write_response(const string& response) = 0;
+};
+
+/* Requests read from standard input, answered on standard output */
+class serve_stdio_connection : public serve_connection
+{
+public:
+    bool read_line(string& line)
+    {
+        return (bool)getline(cin, line);
+    }
+
+    void write_response(const string& response)
+    {
+        lock_guard<mutex> guard(write_lock);
+
+        cout << response << flush;
+    }
+};
+
+#ifdef _WIN32
+typedef SOCKET serve_socket_t;
+#define close_serve_socket closesocket
+#define SHUT_RD SD_RECEIVE
+#define SHUT_RDWR SD_BOTH
+#else
+typedef int serve_socket_t;
+#define INVALID_SOCKET (-1)
+#define close_serve_socket close
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Requests from one client of the local socket */
+class serve_socket_connection : public serve_connection
+{
+private:
+    serve_socket_t sock;
+    string buffer;
+public:
+    explicit serve_socket_connection(serve_socket_t sock)
+        : sock(sock)
+    {
+    }
+
+    ~serve_socket_connection()
+    {
+        close_serve_socket(sock);
+    }
+
+    bool read_line(string& line);
+    void write_response(const string& response);
+
+    /* Make a blocked read_line() return, while responses can still be sent */
+    void stop_reading()
+    {
+        shutdown(sock, SHUT_RD);
+    }
+};
 
-    /* The evtc file has a 16 byte header. It consists of
-     * 4 bytes containing "EVTC", followed by 8 bytes
-     * with a YYYYMMDD representing the arcdps build,
-     * followed by a NUL byte, followed by 2 bytes holding
-     * the area encounter id, followed by another NUL
-     */
-    file.seekg(SEEKG_EVTC_HEADER);
-    file.read(raw_header, 16);
+bool
+serve_socket_connection::read_line(string& line)
+{
+    size_t end;
 
-    /* Make sure we have the 4 bytes of EVTC */
-    if (strncmp(raw_header, "EVTC", 4)) {
-        return -EINVAL;
-    }
+    while ((end = buffer.find('\n')) == string::npos) {
+        char block[4096];
+        int len = recv(sock, block, sizeof(block), 0);
 
-    /* Make sure the version is a number */
-    for (int i = 4; i < 12; i++) {
-        if (!isdigit(raw_header[i])) {
-            return -EINVAL;
+        if (len <= 0) {
+            return false;
         }
+
+        buffer.append(block, len);
     }
 
-    /* Extract the main EVTC header string */
-    memcpy(details.arc_header, raw_header, 12);
-    details.arc_header[12] = '\0';
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
 
-    /* Extract the cbtevent revision */
-    details.revision = raw_header[12];
+    return true;
+}
 
-    /* Only v0 and v1 are currently supported */
-    if (details.revision > 1) {
-        return -EINVAL;
-    }
+void
+serve_socket_connection::write_response(const string& response)
+{
+    lock_guard<mutex> guard(write_lock);
+    size_t sent = 0;
 
-    /* Make sure there is a NUL in the byte following the area id */
-    if (raw_header[15] != '\0') {
-        return -EINVAL;
-    }
+    /* Responses to a client which has gone away are dropped */
+    while (sent < response.size()) {
+        int len = send(sock, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
 
-    /* extract the area id */
-    memcpy(&details.boss_id, &raw_header[13], sizeof(uint16_t));
-    auto iter = all_encounter_info.find(details.boss_id);
+        if (len <= 0) {
+            return;
+        }
 
-    if (iter != all_encounter_info.end()) {
-        details.boss_info = iter->second;
-    } else {
-        std::stringstream ss;
-        ss << "Unknown encounter " << details.boss_id;
-        details.boss_info.name = std::move(ss.str().c_str());
-        details.boss_info.cm = CM_UNKNOWN;
-        details.boss_info.health_threshold = 0;
+        sent += len;
     }
-
-    return 0;
 }
 
 /**
- * parse_agent_count: extract the agent count from the file
- * @details: structure to hold extracted data and metadata
- * @file: the file to scan from
+ * serve_queue - requests waiting for a worker
  *
- * Seeks to the location of the EVTC file and reads the count
- * of the number of agent objects stored in the file. Assumes the
- * file has already been validated by parse_header.
+ * The queue is bounded, so a client sending requests faster than they can
+ * be parsed is slowed down rather than using ever more memory.
  */
-static void
-parse_agent_count(parsed_details& details, ifstream& file)
+class serve_queue
 {
-    file.seekg(SEEKG_EVTC_AGENT_COUNT);
-    file.read((char *)&details.agent_count, sizeof(uint32_t));
-}
+private:
+    typedef pair<shared_ptr<serve_connection>, string> request;
 
-/**
- * get_agent_details: extract one agent details object from the file
- * @file: the file to read from
- * @agent: which agent from the array to read
- * @agent_details: structure to hold the agent data
- *
- * Seeks to the point where agent data for the @agent number is located
- * and reads it into the @agent_details structure.
- */
-static void
-get_agent_details(ifstream& file, uint32_t agent, evtc_agent& agent_details)
-{
-    uint32_t fdindex = SEEKG_EVTC_FIRST_AGENT;
+    static constexpr size_t max_depth = 64;
 
-    fdindex += agent * sizeof(evtc_agent);
+    mutex lock;
+    condition_variable not_empty;
+    condition_variable not_full;
+    deque<request> requests;
+    bool closed;
+public:
+    serve_queue()
+        : closed(false)
+    {
+    }
 
-    file.seekg(fdindex);
-    file.read((char *)&agent_details, sizeof(evtc_agent));
-}
+    /* Returns false if the queue was closed, and the request dropped */
+    bool push(shared_ptr<serve_connection> conn, string line)
+    {
+        unique_lock<mutex> guard(lock);
 
-/**
- * parse_player_agent: parse player data out of an agent data structure
- * @details: data structure to hold parsed EVTC data
- * @file: the EVTC file to scan
- * @agent: the agent number to read
- *
- * Extracts agent data for a given @agent number, and determines if it's a
- * player agent. If so, store the player data within @details.players
- */
-static void
-parse_player_agent(parsed_details& details, ifstream& file, unsigned int agent)
-{
-    evtc_agent agent_details = {};
-    player_details player = {};
-    char *name;
+        not_full.wait(guard, [&] { return closed || requests.size() < max_depth; });
+        if (closed) {
+            return false;
+        }
 
-    /* Copy the agent details from the file */
-    get_agent_details(file, agent, agent_details);
+        requests.emplace_back(move(conn), move(line));
+        not_empty.notify_one();
 
-    if (agent_details.is_elite == EVTC_AGENT_NON_PLAYER_AGENT) {
-        return;
+        return true;
     }
 
-    player.addr = agent_details.addr;
+    /* Returns false once the queue is closed and empty */
+    bool pop(shared_ptr<serve_connection>& conn, string& line)
+    {
+        unique_lock<mutex> guard(lock);
 
-    /* The EVTC format stores the name as a sequence of 3 NUL
-     * terminated UTF-8 strings. First, the character name,
-     * then the account name, and finally the subgroup name.
-     * We're mainly interested in the account name...
-     */
-    name = agent_details.name;
-    player.character = string(name);
-    name += player.character.size() + 1;
-    player.account = string(name);
-    name += player.account.size() + 1;
-    player.subgroup = string(name);
-
-    /* The file seems to always store the account name with a
-     * leading ':', we we'll remove it
-     */
-    if (player.account[0] == ':') {
-        player.account.erase(0, 1);
+        not_empty.wait(guard, [&] { return closed || !requests.empty(); });
+        if (requests.empty()) {
+            return false;
+        }
+
+        conn = move(requests.front().first);
+        line = move(requests.front().second);
+        requests.pop_front();
+        not_full.notify_one();
+
+        return true;
     }
 
-    details.players[player.addr] = player;
-}
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
 
 /**
- * parse_all_player_agents: extract all player data
- * @details: EVTC parsed data structure
- * @file: the EVTC file to read
+ * check_serve_path - Check that a request names a log which can be parsed
+ * @path: the path of the log to parse
  *
- * Loops over every agent and extracts all player data information from
- * the @file and stores it in @details.players
+ * In serve mode standard input carries the requests themselves, and a pipe
+ * or device could leave a worker blocked forever, so only regular files are
+ * parsed. Returns zero if @path is a regular file, -ENOENT if it does not
+ * exist, or -ESPIPE if it is "-" or any other kind of file.
  */
-static void
-parse_all_player_agents(parsed_details& details, ifstream& file)
+static int
+check_serve_path(const string& path)
 {
-    unsigned int agent;
+    filesystem::file_status status;
+    error_code ec;
+
+    if (path == "-") {
+        return -ESPIPE;
+    }
+
+    status = filesystem::status(path, ec);
+    if (!filesystem::exists(status)) {
+        return -ENOENT;
+    }
 
-    for (agent = 0; agent < details.agent_count; agent++) {
-        parse_player_agent(details, file, agent);
+    if (!filesystem::is_regular_file(status)) {
+        return -ESPIPE;
     }
+
+    return 0;
 }
 
 /**
- * parse_boss_agent: extract boss agent details
- * @detals: EVTC parsed data structure
- * @file: the EVTC file to read
+ * serve_request - Answer a single request
+ * @line: the request, a JSON object on a single line
+ * @scan_threads: number of threads to scan the combat events with
+ * @format: the encoding of the response
  *
- * Loops over every agent searching for the agent associated with
- * the boss creature, extracting useful information about the boss
- * and storing it in the @details structure.
+ * The "type" of a request is any of the output types accepted on the
+ * command line, other than batch, serve, cbor and movement, and "path" is
+ * the log to parse. The encoding is chosen for the whole server instead of
+ * cbor. Health requests may give the "resolution" of the output in
+ * milliseconds. Only regular files are parsed, never standard input. The
+ * response holds the "id" of the request, if it had one, along with the
+ * "result". For json requests the result is the same object as the json
+ * output, while for other types it is the array of lines which would have
+ * been printed. Failures produce an "error" object instead.
  */
-static void
-parse_boss_agent(parsed_details& details, ifstream& file)
+static string
+serve_request(const string& line, unsigned int scan_threads, output_format format)
 {
-    unsigned int agent;
+    const output_type *output = nullptr;
+    string type, path, id, result, response;
+    uint32_t resolution = default_health_resolution;
+    const char *message = nullptr;
+    json_writer json_out(response);
+    cbor_writer cbor_out(response);
+    output_writer& writer = format == FORMAT_CBOR ? (output_writer&)cbor_out : json_out;
+    unsigned int i;
+    int err = 0;
 
-    for (agent = 0; agent < details.agent_count; agent++) {
-        evtc_agent agent_details;
-        uint16_t species_id;
+    try {
+        json request = json::parse(line);
 
-        /* Copy the agent details from the file */
-        get_agent_details(file, agent, agent_details);
+        if (request.contains("id")) {
+            id = request["id"].dump(-1, ' ', false, json::error_handler_t::replace);
+        }
 
-        /* If this is a player agent, then skip it */
-        if (agent_details.is_elite != EVTC_AGENT_NON_PLAYER_AGENT) {
-            continue;
+        type = request.at("type").get<string>();
+        path = request.value("path", string());
+
+        /* The resolution must be a whole number that fits, rather than being
+         * wrapped around or truncated into one
+         */
+        if (request.contains("resolution")) {
+            const json& value = request["resolution"];
+
+            if (!value.is_number_unsigned() || value.get<uint64_t>() > UINT32_MAX) {
+                err = -EINVAL;
+                message = "Invalid resolution";
+            } else {
+                resolution = value.get<uint32_t>();
+            }
         }
+    } catch (const exception&) {
+        err = -EBADMSG;
+    }
 
-        /* If this is a gadget, then skip it */
-        if ((agent_details.prof & EVTC_AGENT_GADGET_AGENT) == EVTC_AGENT_GADGET_AGENT) {
-            continue;
+    for (i = 0; i < valid_types_size; i++) {
+        if (type == valid_types[i].name)
+            output = &valid_types[i];
+    }
+
+    if (err) {
+        /* The request could not be parsed, or is invalid */
+    } else if (type == "version") {
+        json_writer result_writer(result);
+
+        result_writer.begin_array();
+        result_writer.string_value(version);
+        result_writer.end_array();
+    } else if (!output || !output->query || type == "cbor" || type == "movement") {
+        err = -ENOTSUP;
+    } else if ((err = check_serve_path(path))) {
+        /* The log is not a regular file */
+    } else if (type == "json") {
+        err = parse_evtc_json(path, scan_threads, result);
+    } else {
+        json_writer result_writer(result);
+        stringstream out;
+        sap_log *log;
+        string text;
+
+        err = sap_open_file(path.c_str(), output->query, scan_threads, &log);
+        if (!err) {
+            output_details(type, log, resolution, out);
+            sap_close(log);
+
+            result_writer.begin_array();
+            while (getline(out, text)) {
+                result_writer.string_value(text);
+            }
+            result_writer.end_array();
         }
+    }
 
-        species_id = agent_details.prof & EVTC_AGENT_SPECIES_ID_MASK;
+    writer.begin_object();
+    if (!id.empty()) {
+        writer.key("id");
+        writer.raw_value(id);
+    }
 
-        if (species_id == details.boss_id) {
-            details.boss_src_agent = agent_details.addr;
-            break;
+    if (err) {
+        writer.key("error");
+        writer.begin_object();
+        writer.key("code");
+        writer.signed_value(err);
+        writer.key("message");
+        if (!message) {
+            message = err == -EBADMSG ? "Invalid request" : sap_strerror(err);
         }
+        writer.string_value(message);
+        writer.end_object();
+    } else {
+        writer.key("result");
+        writer.raw_value(result);
     }
-}
+    writer.end_object();
 
-/**
- * parse_skill_count: extract the number of skills
- * @details: the EVTC parsed data structure
- * @file: the file to read from
- *
- * Extracts the skill count from the EVTC @file. Assumes that the
- * number of agents has already been extracted, so it reads the bytes
- * for the number of skill structures stored in the file.
- */
-static void
-parse_skill_count(parsed_details& details, ifstream& file)
-{
-    file.seekg(SEEKG_EVTC_SKILL_COUNT(details.agent_count));
-    file.read((char *)&details.skill_count, sizeof(uint32_t));
+    if (format == FORMAT_JSON) {
+        response += '\n';
+    }
+
+    return response;
 }
 
 /**
- * calculate_cbt_event_count: calculate number of combat events
- * @details: the EVTC parsed data structure
- * @file: the EVTC file to read from
+ * read_serve_requests - Queue every request received on a connection
+ * @conn: the connection to read
+ * @queue: the queue of requests for the workers
  *
- * Unlike for agents and skills, the EVTC file format does not store
- * the number of combat events. Instead, this must be determined based
- * on the size of the file. It is calculated by determining the total
- * number of bytes the combat events take up using file seek positions,
- * divided by the cbtevent data structure defined by the EVTC file format.
+ * Stops once the connection is closed, or the queue no longer accepts
+ * requests.
  */
 static void
-calculate_cbt_event_count(parsed_details& details, ifstream& file)
+read_serve_requests(shared_ptr<serve_connection> conn, serve_queue& queue)
 {
-    streampos cbtevent_pos, cbtevent_length;
+    string line;
 
-    /* Seek to the beginning of the combat events */
-    details.cbt_event_start = SEEKG_EVTC_FIRST_CBTEVENT(details.agent_count,
-                                                        details.skill_count);
-    file.seekg(details.cbt_event_start);
-    cbtevent_pos = file.tellg();
-    file.seekg(0, ios::end);
-    cbtevent_length = file.tellg() - cbtevent_pos;
+    while (conn->read_line(line)) {
+        /* Accept requests terminated by CRLF too */
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
 
-    details.cbt_event_count = cbtevent_length / EVTC_CBTEVENT_SIZE(details.revision);
+        if (!line.empty() && !queue.push(conn, move(line))) {
+            break;
+        }
+    }
 }
 
 /**
- * parse_reward_event: Parser for CBTS_REWARD events
- * @details: structure to hold parsed EVTC data
- * @event: the combat event to parse
+ * open_serve_socket - Create the local socket to listen for clients on
+ * @path: the file system path of the socket
+ * @listener: on return, the listening socket
  *
- * Checks if the event is a CBTS_REWARD event, which indicates that the
- * encounter was successfully completed. If the event matches, this parser
- * stores the success data in @details, and returns true. Otherwise it
- * returns false.
+ * Any stale socket left at @path by an earlier server is replaced.
  */
-static bool
-parse_reward_event(parsed_details& details, evtc_cbtevent& event)
+static int
+open_serve_socket(const string& path, serve_socket_t& listener)
 {
-    if (event.is_statechange() == CBTS_REWARD) {
-        /* A reward event indicates that the boss was killed successfully */
-        details.encounter_success = true;
-        details.precise_reward_time = event.time();
-        return true;
-    }
+    struct sockaddr_un addr = {};
+    error_code ec;
 
-    return false;
-}
+#ifdef _WIN32
+    WSADATA wsa_data;
 
-/**
- * parse_logstart_event: Parser for CBTS_LOGSTART events
- * @details: structure to hold parsed EVTC data
- * @event: the combat event to parse
- *
- * Checks if the event is a CBTS_LOGSTART event which indicates the start time
- * according to the server. If the event matches, this parser stores the start
- * time in @details and returns true. Otherwise it returns false.
- */
-static bool
-parse_logstart_event(parsed_details& details, evtc_cbtevent& event)
-{
-    if (event.is_statechange() == CBTS_LOGSTART &&
-        event.src_agent() == arcdps_src_agent) {
-        /* The log start event indicates the server time when logs started */
-        details.server_start = event.value();
-        details.precise_start = event.time();
-        return true;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+        return -EIO;
     }
+#endif
 
-    return false;
-}
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
 
-/**
- * parse_logend_event: Parser for CBTS_LOGEND events
- * @details: structure to hold parsed EVTC data
- * @event: the combat event to parse
- *
- * Checks if the event is a CBTS_LOGEND event which indicates the end time
- * according to the server. If the event matches, this parser stores the end
- * time in @details and returns true. Otherwise it returns false.
- */
-static bool
-parse_logend_event(parsed_details& details, evtc_cbtevent& event)
-{
-    if (event.is_statechange() == CBTS_LOGEND &&
-        event.src_agent() == arcdps_src_agent) {
-        /* The log end event indicates the server time when logs ended */
-        details.server_end = event.value();
-        details.precise_logend_time = event.time();
-        return true;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) {
+        return -EIO;
     }
 
-    return false;
-}
+    filesystem::remove(path, ec);
 
-/**
- * parse_boss_maxhealth_event: Parser for CBTS_MAXHEALTHUPDATE events
- * @details: structure to hold parsed EVTC data
- * @event: the combat event to parse
- *
- * Checks if the event is a CBTS_MAXHEALTHUPDATE event that matches the
- * boss id we've found for the encounter. This will enable obtaining the
- * maximum health for the boss, which is useful for determining if an encounter
- * is a Challenge Mote variant. If the event matches, the parser stores the
- * maximum health in the @details and returns true. Otherwise it returns false.
- */
-static bool
-parse_boss_maxhealth_event(parsed_details& details, evtc_cbtevent& event)
-{
-    if (event.is_statechange() == CBTS_MAXHEALTHUPDATE &&
-        event.src_agent() == details.boss_src_agent) {
-        details.boss_maxhealth = event.dst_agent();
-        return true;
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listener, SOMAXCONN)) {
+        close_serve_socket(listener);
+        return -EADDRINUSE;
     }
 
-    return false;
+    return 0;
 }
 
 /**
- * parse_guild_event: Parser for CBTS_GUILD events
- * @details: structure to hold parsed EVTC data
- * @event: the combat event to parse
- *
- * Checks if the event is a CBTS_GUILD event. If it is, and the src_agent
- * matches one of the player agent ids, store the 16-byte guid for that player.
+ * serve_clients - the clients connected to the local socket
  *
- * Returns true if the event was a CBTS_GUILD event, and false otherwise.
+ * Each client is read by a thread of its own, which pushes its requests to
+ * the queue of the server. The threads are kept so that the server can stop
+ * them and wait for them to finish before the queue goes away. Threads of
+ * clients which have disconnected are joined as new clients arrive, so
+ * they do not pile up in a long running server.
  */
-static bool
-parse_guild_event(parsed_details& details, evtc_cbtevent& event)
+class serve_clients
 {
-    if (event.is_statechange() == CBTS_GUILD) {
-        auto it = details.players.find(event.src_agent());
+private:
+    struct client {
+        shared_ptr<serve_socket_connection> conn;
+        thread reader;
+        atomic<bool> done{false};
+    };
+
+    list<client> clients;
 
-        if (it != details.players.end()) {
-            player_details& player = it->second;
-            player.guid = event.guid();
+    void reap()
+    {
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (it->done) {
+                it->reader.join();
+                it = clients.erase(it);
+            } else {
+                it++;
+            }
         }
+    }
+public:
+    ~serve_clients()
+    {
+        stop();
+    }
 
-        return true;
+    void add(serve_socket_t sock, serve_queue& queue)
+    {
+        reap();
+
+        client& c = clients.emplace_back();
+
+        c.conn = make_shared<serve_socket_connection>(sock);
+        c.reader = thread([&c, &queue]() {
+            read_serve_requests(c.conn, queue);
+            c.done = true;
+        });
     }
 
-    return false;
-}
+    /* Stop reading from every client, and wait for the readers to finish */
+    void stop()
+    {
+        for (auto& c : clients) {
+            c.conn->stop_reading();
+        }
 
-/**
- * eventparser: typedef for combat event parsers
- * @details: the structure storing parsed EVTC data
- * @event: the combat event to parse
- *
- * A parser is expected to determine if this @event matches, and if so
- * extract data into the @details structure. Returning true indicates
- * that the event matched. Returning false indicates that the event did
- * not match this parser.
- */
-using eventparser = bool (*)(parsed_details& details, evtc_cbtevent& event);
-
-/* List of all current combat event parsers */
-static const eventparser parsers[] = {
-    parse_reward_event,
-    parse_logstart_event,
-    parse_logend_event,
-    parse_boss_maxhealth_event,
-    parse_guild_event,
+        for (auto& c : clients) {
+            c.reader.join();
+        }
+        clients.clear();
+    }
 };
 
-static const int parsers_count = extent<decltype(parsers)>::value;
+/* Listening socket of the server, shut down by a signal to stop serving */
+static serve_socket_t serve_listener = INVALID_SOCKET;
+static volatile sig_atomic_t serve_stopped;
 
-/**
- * parse_all_cbt_events: parse all combat events
- * @details: structure to hold parsed EVTC data
- * @file: the file to scan
- *
- * Loop through the entire list of combat events, checking each combat
- * event for information. Events are scanned by parsers one at a time until
- * a parser returns true.
- *
- * An event parser should return true if the event matched, and false otherwise.
- *
- * The events are scanned in order from beginning to end.
- */
 static void
-parse_all_cbt_events(parsed_details& details, ifstream& file)
+stop_serving(int)
 {
-    unsigned int event, parser;
-
-    for (event = 0; event < details.cbt_event_count; event++) {
-        evtc_cbtevent event_details = evtc_cbtevent(file, details.revision,
-                                                    details.cbt_event_start, event);
-
-        for (parser = 0; parser < parsers_count; parser++) {
-            if (parsers[parser](details, event_details))
-                break;
-        }
-    }
+    serve_stopped = 1;
+    shutdown(serve_listener, SHUT_RDWR);
 }
 
 /**
- * detect_health_based_cm - Detect CM status based on maximum health
- * @details: structure to store EVTC data
+ * accept_serve_client - Wait for the next client of the local socket
+ * @listener: the listening socket
  *
- * Using the maximum health data and boss info already gathered, update
- * the CM status depending on the maximum health found.
+ * Failures which only concern a single connection, or which may clear up
+ * once other clients disconnect, such as running out of file descriptors,
+ * are retried. Returns INVALID_SOCKET once the server is stopped, or if the
+ * listening socket fails for good.
  */
-static void
-detect_health_based_cm(parsed_details& details)
+static serve_socket_t
+accept_serve_client(serve_socket_t listener)
 {
-    if (details.boss_info.cm == CM_HEALTH_BASED) {
-        if (details.boss_maxhealth < details.boss_info.health_threshold) {
-            details.boss_info.cm = CM_NO;
-        } else {
-            details.boss_info.cm = CM_YES;
+    serve_socket_t client;
+
+    while (!serve_stopped) {
+        client = accept(listener, nullptr, nullptr);
+        if (client != INVALID_SOCKET) {
+            return client;
+        }
+
+#ifdef _WIN32
+        switch (WSAGetLastError()) {
+        case WSAEINTR:
+        case WSAECONNRESET:
+            continue;
+        case WSAEMFILE:
+        case WSAENOBUFS:
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+#else
+        switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+            continue;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
         }
+#endif
+        break;
     }
+
+    return INVALID_SOCKET;
 }
 
 /**
- * output_json - Output data in JSON format
- * @details: the details structure to output
+ * run_serve - Answer requests until standard input is closed
+ * @argc: number of serve arguments
+ * @argv: the serve arguments
+ *
+ * Usage: serve [--socket <path>] [--threads <count>] [--format json|cbor]
  *
- * Convert the details structure into a JSON object which can be dumped to
- * the console.
+ * Without --socket, requests are read from standard input and responses
+ * written to standard output, until standard input is closed. With
+ * --socket, the server listens for any number of clients on a local socket
+ * until it is stopped by SIGINT or SIGTERM, and then removes the socket.
  */
-static void
-output_json(parsed_details& details)
+static int
+run_serve(int argc, char *argv[])
 {
-    json data = json::object();
-
-    /* Track what version of simpleArcParse was used */
-    data["simpleArcParse"]["version"] = version;
-
-    /* ArcDPS data */
-    data["header"]["arcdps_version"] = details.arc_header;
-    data["header"]["revision"] = details.revision;
-
-    /* Boss information */
-    data["boss"]["name"] = details.boss_info.name;
-    data["boss"]["location"] = details.boss_info.location;
-    data["boss"]["id"] = details.boss_id;
+    unsigned int threads = max(1u, thread::hardware_concurrency());
+    output_format format = FORMAT_JSON;
+    atomic<unsigned int> busy(0);
+    vector<thread> workers;
+    string socket_path;
+    serve_queue queue;
+    unsigned int t;
+    int i, err;
+
+    for (i = 0; i < argc; i++) {
+        string arg = argv[i];
+
+        if ((arg != "--socket" && arg != "--threads" && arg != "--format") || ++i == argc) {
+            return -EINVAL;
+        }
 
-    switch (details.boss_info.cm) {
-    case CM_NO:
-        data["boss"]["is_cm"] = "NO";
-        break;
-    case CM_YES:
-        data["boss"]["is_cm"] = "YES";
-        break;
-    case CM_UNKNOWN:
-        data["boss"]["is_cm"] = "UNKNOWN";
-        break;
-    case CM_HEALTH_BASED:
-        data["boss"]["is_cm"] = "INVALID";
-        break;
+        if (arg == "--socket") {
+            socket_path = argv[i];
+        } else if (arg == "--format") {
+            if (!parse_output_format(argv[i], format)) {
+                return -EINVAL;
+            }
+        } else {
+            try {
+                threads = stoul(argv[i]);
+            } catch (const exception&) {
+                return -EINVAL;
+            }
+
+            if (!threads) {
+                return -EINVAL;
+            }
+        }
     }
 
-    data["boss"]["maxhealth"] = details.boss_maxhealth;
-    data["boss"]["success"] = details.encounter_success;
-    data["boss"]["duration"] = (details.precise_end - details.precise_start);
-
-    /* Local timestamps */
-    data["local_time"]["start"] = details.precise_start;
-    data["local_time"]["end"] = details.precise_end;
-    data["local_time"]["last_event"] = details.precise_last_event;
-
-    if (details.precise_reward_time) {
-        data["local_time"]["reward"] = details.precise_reward_time;
+    if (format == FORMAT_CBOR && socket_path.empty()) {
+        set_binary_stdout();
     }
 
-    if (details.precise_logend_time) {
-        data["local_time"]["log_end"] = details.precise_logend_time;
+    for (t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            shared_ptr<serve_connection> conn;
+            string line;
+
+            while (queue.pop(conn, line)) {
+                /* Share the threads between the requests being parsed */
+                unsigned int scan_threads = max(1u, threads / ++busy);
+                string response = serve_request(line, scan_threads, format);
+
+                busy--;
+                conn->write_response(response);
+                conn.reset();
+            }
+        });
     }
 
-    /* server timestamps */
-    data["server_time"]["start"] = details.server_start;
-    data["server_time"]["end"] = details.server_end;
-
-    /* Players */
-    data["players"] = json::array();
+    if (socket_path.empty()) {
+        read_serve_requests(make_shared<serve_stdio_connection>(), queue);
+    } else {
+        serve_socket_t listener, client;
+        serve_clients clients;
+        error_code ec;
+
+        err = open_serve_socket(socket_path, listener);
+        if (err) {
+            cerr << "Failed to listen on " << socket_path << endl;
+            queue.close();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            return err;
+        }
 
-    for (auto& kv : details.players) {
-        auto& player = kv.second;
-        json player_data = json::object();
+        serve_listener = listener;
+        signal(SIGINT, stop_serving);
+        signal(SIGTERM, stop_serving);
 
-        player_data["account"] = player.account;
-        player_data["character"] = player.character;
-        player_data["subgroup"] = player.subgroup;
+        while ((client = accept_serve_client(listener)) != INVALID_SOCKET) {
+            clients.add(client, queue);
+        }
 
-        /* Add the Guild UID if we found it */
-        if (player.guid.valid) {
-            stringstream ss;
+        /* Requests already received are still answered below */
+        clients.stop();
+        close_serve_socket(listener);
+        filesystem::remove(socket_path, ec);
+    }
 
-            ss << std::hex << std::uppercase;
+    /* Finish answering every request which was received */
+    queue.close();
+    for (auto& worker : workers) {
+        worker.join();
+    }
 
-            ss << setw(8) << setfill('0') << player.guid.data.p1 << "-";
-            ss << setw(4) << setfill('0') << player.guid.data.p2 << "-";
-            ss << setw(4) << setfill('0') << player.guid.data.p3 << "-";
-            ss << setw(4) << setfill('0') << player.guid.data.p4 << "-";
-            ss << setw(4) << setfill('0') << player.guid.data.p5;
-            ss << setw(8) << setfill('0') << player.guid.data.p6;
+    return 0;
+}
 
-            player_data["guid"] = ss.str().c_str();
-        }
+/* Warn when the encounter overlay file is ignored, rather than silently
+ * falling back to the built-in encounters
+ */
+static void
+report_encounter_overlay()
+{
+    const char *message;
 
-        data["players"] += player_data;
+    if (sap_encounter_overlay(&message, nullptr)) {
+        cerr << "Ignoring encounter overlay " << getenv("SIMPLEARCPARSE_ENCOUNTERS") << ": "
+             << message << endl;
     }
-
-    cout << data.dump(4) << std::endl;
 }
 
 /* Main control function */
 int main(int argc, char *argv[])
 {
-    parsed_details details = {};
+    unsigned int i, scan_threads;
+    uint32_t resolution = default_health_resolution;
     string type, filename;
-    ifstream evtc_file;
-    unsigned int i;
+    uint32_t query = 0;
+    sap_log *log;
     int err;
 
     /* argv[0] is the command name
@@ -1125,8 +2758,10 @@ int main(int argc, char *argv[])
 
     err = -ENOTSUP;
     for (i = 0; i < valid_types_size; i++) {
-        if (type == valid_types[i])
+        if (type == valid_types[i].name) {
+            query = valid_types[i].query;
             err = 0;
+        }
     }
     if (err) {
         return err;
@@ -1137,110 +2772,81 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    /* Delay checking for filename until after we handle version */
-    if (argc != 3) {
-        return -E2BIG;
-    }
-
-    /* argv[2] will hold the file name to parse */
-    filename = string(argv[2]);
-    evtc_file.open(filename, ios::in | ios::binary);
-    if (!evtc_file.is_open()) {
-        cerr << "Failed to open " << filename << endl;
-        return -ENOENT;
-    }
+    /* Check the vector kernels of this CPU against the scalar kernels */
+    if (type == "check_kernels") {
+        err = sap_check_kernels();
+        if (err < 0) {
+            cerr << "Vector kernels disagree with the scalar kernels" << endl;
+            return err;
+        }
 
-    err = parse_header(details, evtc_file);
-    if (err) {
-        return err;
+        cout << err << endl;
+        return 0;
     }
 
-    /* We must parse agent count first */
-    parse_agent_count(details, evtc_file);
+    report_encounter_overlay();
 
-    /* Followed by the skill count */
-    parse_skill_count(details, evtc_file);
+    /* Batch mode takes its own list of files */
+    if (type == "batch") {
+        return run_batch(argc - 2, argv + 2);
+    }
 
-    /* The number of combat events is not stored but we can calculate it */
-    calculate_cbt_event_count(details, evtc_file);
+    /* Serve mode reads its requests once running */
+    if (type == "serve") {
+        return run_serve(argc - 2, argv + 2);
+    }
 
-    /* Extract data for each player in the encounter */
-    parse_all_player_agents(details, evtc_file);
+    /* Delay checking for filename until after we handle version. Health
+     * output may be followed by its resolution in milliseconds.
+     */
+    if (argc == 4 && type == "health") {
+        err = parse_resolution(argv[3], resolution);
+        if (err) {
+            return err;
+        }
+    } else if (argc != 3) {
+        return -E2BIG;
+    }
 
-    /* Extract data about the boss agent */
-    parse_boss_agent(details, evtc_file);
+    /* argv[2] will hold the file name to parse, or "-" for standard input */
+    filename = string(argv[2]);
+    scan_threads = max(1u, thread::hardware_concurrency());
 
-    /* Parse all of the combat events for relevant information */
-    parse_all_cbt_events(details, evtc_file);
+    /* The json details may already be cached */
+    if (type == "json" || type == "cbor") {
+        string data;
 
-    /* Extract the local time of the last event */
-    evtc_cbtevent event_details = evtc_cbtevent(evtc_file, details.revision,
-                                                details.cbt_event_start,
-                                                details.cbt_event_count - 1);
-    details.precise_last_event = event_details.time();
+        err = parse_evtc_json(filename, scan_threads, data);
+        if (err == -ENOENT) {
+            cerr << "Failed to open " << filename << endl;
+        }
+        if (err) {
+            return err;
+        }
 
-    /* Detect CM status based on health */
-    detect_health_based_cm(details);
+        if (type == "cbor") {
+            output_cbor(data);
+        } else {
+            output_json(data);
+        }
+        return 0;
+    }
 
-    /* Use the most appropriate ending time available */
-    if (details.precise_reward_time) {
-        details.precise_end = details.precise_reward_time;
-    } else if (details.precise_logend_time) {
-        details.precise_end = details.precise_logend_time;
-    } else {
-        details.precise_end = details.precise_last_event;
+    err = sap_open_file(filename.c_str(), query, scan_threads, &log);
+    if (err == -ENOENT) {
+        cerr << "Failed to open " << filename << endl;
+    }
+    if (err) {
+        return err;
     }
 
     /* Handle the various output requests */
-    if (type == "header") {
-        cout << details.arc_header << endl;
-        cout << details.boss_info.name << endl;
-        cout << details.boss_id << endl;
-    } else if (type == "revision") {
-        cout << +details.revision << endl;
-    } else if (type == "players") {
-        for (auto& kv : details.players) {
-            auto& player = kv.second;
-            cout << player.account << endl;
-        }
-    } else if (type == "success") {
-        if (details.encounter_success) {
-            cout << "SUCCESS" << endl;
-        } else {
-            cout << "FAILURE" << endl;
-        }
-    } else if (type == "start_time") {
-        cout << details.server_start << endl;
-    } else if (type == "end_time") {
-        cout << details.server_end << endl;
-    } else if (type == "boss_maxhealth") {
-        cout << details.boss_maxhealth << endl;
-    } else if (type == "is_cm") {
-        switch (details.boss_info.cm) {
-        case CM_NO:
-            cout << "NO" << endl;
-            break;
-        case CM_YES:
-            cout << "YES" << endl;
-            break;
-        case CM_UNKNOWN:
-        case CM_HEALTH_BASED:
-        default:
-            cout << "UNKNOWN" << endl;
-            break;
-        }
-    } else if (type == "duration") {
-        if (details.precise_end >= details.precise_start)
-            cout << (details.precise_end - details.precise_start) << endl;
-    } else if (type == "local_start_time") {
-        cout << details.precise_start << endl;
-    } else if (type == "local_end_time") {
-        cout << details.precise_end << endl;
-    } else if (type == "location") {
-        cout << details.boss_info.location << endl;
-    } else if (type == "json") {
-        output_json(details);
+    if (type == "movement") {
+        output_movement(log);
+    } else {
+        output_details(type, log, resolution, cout);
     }
+    sap_close(log);
 
     return 0;
 }
@@ -0,0 +1,6706 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright 2018 Jacob Keller. All rights reserved.
+ *
+ * Some structure definitions and names taken from https://www.deltaconnected.com/arcdps/evtc
+ *
+ * libsimplearcparse: the EVTC parser behind simpleArcParse, exposed through
+ * the C interface declared in simplearcparse.h
+ */
+#define SIMPLEARCPARSE_BUILD
+#include "simplearcparse.h"
+#include "json.hpp"
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <map>
+#include <algorithm>
+#include <type_traits>
+#include <tuple>
+#include <array>
+#include <new>
+
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* The vectorized statechange prefilters are only built for x86-64, using
+ * GCC function attributes to enable each instruction set. The kernel is
+ * selected at runtime based on the features of the CPU.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define EVTC_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const char version[] = "v2.5.0";
+
+/*
+ * The following enumeration definitions were taken from the
+ * evtc README.txt file available at:
+ *
+ * https://www.deltaconnected.com/arcdps/evtc/README.txt
+ *
+ * They were last updated on March 30th, 2019.
+ */
+
+/* iff */
+enum iff {
+    IFF_FRIEND,
+    IFF_FOE,
+    IFF_UNKNOWN // or uncertain
+};
+
+/* combat result (physical) */
+enum cbtresult {
+    CBTR_NORMAL,      // good physical hit
+    CBTR_CRIT,        // physical hit was crit
+    CBTR_GLANCE,      // physical hit was glance
+    CBTR_BLOCK,       // physical hit was blocked eg. mesmer shield 4
+    CBTR_EVADE,       // physical hit was evaded, eg. dodge or mesmer sword 2
+    CBTR_INTERRUPT,   // physical hit interrupted something
+    CBTR_ABSORB,      // physical hit was "invlun" or absorbed eg. guardian elite
+    CBTR_BLIND,       // physical hit missed
+    CBTR_KILLINGBLOW, // hit was killing hit
+    CBTR_DOWNED,      // hit was downing hit
+};
+
+/* combat activation */
+enum cbtactivation {
+    ACTV_NONE,          // not used - not this kind of event
+    ACTV_NORMAL,        // started skill activation without quickness
+    ACTV_QUICKNESS,     // started skill activation with quickness
+    ACTV_CANCEL_FIRE,   // stopped skill activation with reaching tooltip time
+    ACTV_CANCEL_CANCEL, // stopped skill activation without reaching tooltip time
+    ACTV_RESET          // animation completed fully
+};
+
+/* combat state change */
+enum cbtstatechange {
+    CBTS_NONE,            // not used - not this kind of event
+    CBTS_ENTERCOMBAT,     // src_agent entered combat, dst_agent is subgroup
+    CBTS_EXITCOMBAT,      // src_agent left combat
+    CBTS_CHANGEUP,        // src_agent is now alive
+    CBTS_CHANGEDEAD,      // src_agent is now dead
+    CBTS_CHANGEDOWN,      // src_agent is now downed
+    CBTS_SPAWN,           // src_agent is now in game tracking range (not in realtime api)
+    CBTS_DESPAWN,         // src_agent is no longer being tracked (not in realtime api)
+    CBTS_HEALTHUPDATE,    // src_agent has reached a health marker. dst_agent = percent * 10000 (eg. 99.5% will be 9950) (not in realtime api)
+    CBTS_LOGSTART,        // log start. value = server unix timestamp **uint32**. buff_dmg = local unix timestamp. src_agent = 0x637261 (arcdps id)
+    CBTS_LOGEND,          // log end. value = server unix timestamp **uint32**. buff_dmg = local unix timestamp. src_agent = 0x637261 (arcdps id)
+    CBTS_WEAPSWAP,        // src_agent swapped weapon set. dst_agent = current set id (0/1 water, 4/5 land)
+    CBTS_MAXHEALTHUPDATE, // src_agent has had it's maximum health changed. dst_agent = new max health (not in realtime api)
+    CBTS_POINTOFVIEW,     // src_agent is agent of "recording" player
+    CBTS_LANGUAGE,        // src_agent is text language
+    CBTS_GWBUILD,         // src_agent is game build
+    CBTS_SHARDID,         // src_agent is sever shard id
+    CBTS_REWARD,          // src_agent is self, dst_agent is reward id, value is reward type. these are the wiggly boxes that you get
+    CBTS_BUFFINITIAL,     // combat event that will appear once per buff per agent on logging start (statechange==18, buff==18, normal cbtevent otherwise)
+    CBTS_POSITION,        // src_agent changed, cast float* p = (float*)&dst_agent, access as x/y/z (float[3]) (not in realtime api)
+    CBTS_VELOCITY,        // src_agent changed, cast float* v = (float*)&dst_agent, access as x/y/z (float[3]) (not in realtime api)
+    CBTS_FACING,          // src_agent changed, cast float* f = (float*)&dst_agent, access as x/y (float[2]) (not in realtime api)
+    CBTS_TEAMCHANGE,      // src_agent change, dst_agent new team id
+    CBTS_ATTACKTARGET,    // src_agent is an attacktarget, dst_agent is the parent agent (gadget type), value is the current targetable state (not in realtime api)
+    CBTS_TARGETABLE,      // dst_agent is new target-able state (0 = no, 1 = yes. default yes) (not in realtime api)
+    CBTS_MAPID,           // src_agent is map id
+    CBTS_REPLINFO,        // internal use, won't see anywhere
+    CBTS_STACKACTIVE,     // src_agent is agent with buff, dst_agent is the stackid marked active
+    CBTS_STACKRESET,      // src_agent is agent with buff, value is the duration to reset to (also marks inactive), pad61- is the stackid
+    CBTS_GUILD            // src_agent is agent, dst_agent through buff_dmg is 16 byte guid (client form, needs minor rearrange for api form)
+};
+
+/* combat buff remove type */
+enum cbtbuffremove {
+    CBTB_NONE,   // not used - not this kind of event
+    CBTB_ALL,    // last/all stacks removed (sent by server)
+    CBTB_SINGLE, // single stack removed (sent by server). will happen for each stack on cleanse
+    CBTB_MANUAL, // single stack removed (auto by arc on ooc or all stack, ignore for strip/cleanse calc, use for in/out volume)
+};
+
+/* custom skill ids */
+enum cbtcustomskill {
+    CSK_RESURRECT = 1066, // not custom but important and unnamed
+    CSK_BANDAGE = 1175,   // personal healing only
+    CSK_DODGE = 65001     // will occur in is_activation==normal event
+};
+
+/* language */
+enum gwlanguage {
+    GWL_ENG = 0,
+    GWL_FRE = 2,
+    GWL_GEM = 3,
+    GWL_SPA = 4,
+};
+
+/* The EVTC structures below are read in place from the memory mapped file.
+ * None of them contain any padding, but their location within the file only
+ * guarantees byte alignment. Pack them so that the compiler never assumes a
+ * stricter alignment when reading a field through a pointer into the file.
+ */
+#pragma pack(push, 1)
+
+/* define agent. stats range from 0-10 */
+struct evtc_agent {
+    uint64_t addr;
+    uint32_t prof;
+    uint32_t is_elite;
+    uint16_t toughness;
+    uint16_t concentration;
+    uint16_t healing;
+    uint16_t hitbox_width;
+    uint16_t condition;
+    uint16_t hitbox_height;
+    char name[64];
+    uint8_t pad[4]; /* alignment padding, stored in the file */
+};
+
+/* define skill */
+struct evtc_skill {
+    int32_t id;
+    char name[64];
+};
+
+/* combat event (old, when header[12] == 0) */
+struct evtc_cbtevent_v0 {
+    uint64_t time;                 /* timegettime() at time of event */
+    uint64_t src_agent;            /* unique identifier */
+    uint64_t dst_agent;            /* unique identifier */
+    int32_t value;                 /* event-specific */
+    int32_t buff_dmg;              /* estimated buff damage. zero on application event */
+    uint16_t overstack_value;      /* estimated overwritten stack duration for buff application */
+    uint16_t skillid;              /* skill id */
+    uint16_t src_instid;           /* agent map instance id */
+    uint16_t dst_instid;           /* agent map instance id */
+    uint16_t src_master_instid;    /* master source agent map instance id if source is a minion/pet */
+    uint8_t iss_offset;            /* internal tracking. garbage */
+    uint8_t iss_offset_target;     /* internal tracking. garbage */
+    uint8_t iss_bd_offset;         /* internal tracking. garbage */
+    uint8_t iss_bd_offset_target;  /* internal tracking. garbage */
+    uint8_t iss_alt_offset;        /* internal tracking. garbage */
+    uint8_t iss_alt_offset_target; /* internal tracking. garbage */
+    uint8_t skar;                  /* internal tracking. garbage */
+    uint8_t skar_alt;              /* internal tracking. garbage */
+    uint8_t skar_use_alt;          /* internal tracking. garbage */
+    uint8_t iff;                   /* from iff enum */
+    uint8_t buff;                  /* buff application, removal, or damage event */
+    uint8_t result;                /* from cbtresult enum */
+    uint8_t is_activation;         /* from cbtactivation enum */
+    uint8_t is_buffremove;         /* buff removed. src=relevant, dst=caused it (for strips/cleanses). from cbtr enum */
+    uint8_t is_ninety;             /* source agent health was over 90% */
+    uint8_t is_fifty;              /* target agent health was under 50% */
+    uint8_t is_moving;             /* source agent was moving */
+    uint8_t is_statechange;        /* from cbtstatechange enum */
+    uint8_t is_flanking;           /* target agent was not facing source */
+    uint8_t is_shields;            /* all or part damage was vs barrier/shield */
+    uint8_t is_offcycle;           /* zero if buff dmg happened during tick, non-zero otherwise */
+    uint8_t pad64;                 /* internal tracking. garbage */
+};
+
+/* Guild UIDs are 16byte values which are stored over the dst_agent, value,
+ * and buff_dmg members of the evtc_cbtevent values.
+ */
+struct evtc_guid {
+    struct {
+        uint32_t p1; /* Little Endian */
+        uint16_t p2; /* Little Endian */
+        uint16_t p3; /* Little Endian */
+        uint16_t p4; /* Big Endian */
+        uint16_t p5; /* Big Endian*/
+        uint32_t p6; /* Big Endian */
+    } data;
+    uint8_t valid;
+};
+
+/* combat event logging (revision 1, when header[12] == 1) */
+struct evtc_cbtevent_v1 {
+    uint64_t time;
+    uint64_t src_agent;
+    uint64_t dst_agent;
+    int32_t value;
+    int32_t buff_dmg;
+    uint32_t overstack_value;
+    uint32_t skillid;
+    uint16_t src_instid;
+    uint16_t dst_instid;
+    uint16_t src_master_instid;
+    uint16_t dst_master_instid;
+    uint8_t iff;
+    uint8_t buff;
+    uint8_t result;
+    uint8_t is_activation;
+    uint8_t is_buffremove;
+    uint8_t is_ninety;
+    uint8_t is_fifty;
+    uint8_t is_moving;
+    uint8_t is_statechange;
+    uint8_t is_flanking;
+    uint8_t is_shields;
+    uint8_t is_offcycle;
+    uint8_t pad61;
+    uint8_t pad62;
+    uint8_t pad63;
+    uint8_t pad64;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(evtc_agent) == 96, "Invalid evtc_agent size");
+static_assert(sizeof(evtc_skill) == 68, "Invalid evtc_skill size");
+static_assert(sizeof(evtc_cbtevent_v0) == 64, "Invalid evtc_cbtevent_v0 size");
+static_assert(sizeof(evtc_cbtevent_v1) == 64, "Invalid evtc_cbtevent_v1 size");
+
+/* Layout traits for each revision of the combat event data
+ *
+ * Each trait names the raw structure used by one cbtevent revision. The
+ * combat event pipeline is instantiated once for every layout, and the
+ * revision of a file is only checked once, when selecting the layout to
+ * parse it with. Supporting a new revision only requires adding its raw
+ * structure and a trait to cbtevent_layouts.
+ */
+struct cbtevent_layout_v0 {
+    using raw_event = evtc_cbtevent_v0;
+    static constexpr uint8_t revision = 0;
+    static constexpr uint32_t statechange_offset = offsetof(raw_event, is_statechange);
+    static constexpr bool has_stack_ids = false;
+};
+
+struct cbtevent_layout_v1 {
+    using raw_event = evtc_cbtevent_v1;
+    static constexpr uint8_t revision = 1;
+    static constexpr uint32_t statechange_offset = offsetof(raw_event, is_statechange);
+    static constexpr bool has_stack_ids = true;
+};
+
+/* All supported layouts, in order of revision */
+using cbtevent_layouts = tuple<cbtevent_layout_v0, cbtevent_layout_v1>;
+
+static const uint8_t max_cbtevent_revision = tuple_size<cbtevent_layouts>::value - 1;
+
+template <typename Fn, typename... Layouts>
+static bool
+dispatch_cbtevent_layouts(uint8_t revision, Fn& fn, tuple<Layouts...> *)
+{
+    return ((revision == Layouts::revision && (fn(Layouts()), true)) || ...);
+}
+
+/**
+ * dispatch_cbtevent_layout - call a function with the layout of a revision
+ * @revision: the cbtevent revision
+ * @fn: generic function taking the layout trait as its only argument
+ *
+ * Returns false if the revision is not supported.
+ */
+template <typename Fn>
+static bool
+dispatch_cbtevent_layout(uint8_t revision, Fn&& fn)
+{
+    return dispatch_cbtevent_layouts(revision, fn, (cbtevent_layouts *)nullptr);
+}
+
+static const uint32_t EVTC_CBTEVENT_SIZE(uint8_t revision);
+
+/**
+ * parse_arena - bump allocator for the state of one parse
+ *
+ * Everything allocated while parsing a log lives exactly as long as the
+ * parsed log, so rather than freeing each allocation, memory is handed out
+ * from a few large blocks which are all reused once the log is closed.
+ * Arenas are pooled between logs, so once the blocks of an arena have grown
+ * to fit the logs being parsed, parsing another log does not touch the
+ * heap at all.
+ */
+class parse_arena
+{
+private:
+    struct block {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    vector<block> blocks;
+    size_t current;
+    size_t used;
+
+    void add_block(size_t size);
+public:
+    /* Size of the first block, which fits the state of most logs */
+    static constexpr size_t min_block_size = 256 * 1024;
+
+    parse_arena();
+
+    parse_arena(const parse_arena&) = delete;
+    parse_arena& operator=(const parse_arena&) = delete;
+
+    void *allocate(size_t size, size_t align);
+    void reset();
+};
+
+parse_arena::parse_arena()
+    : current(0), used(0)
+{
+}
+
+/**
+ * add_block - add a new block to the arena
+ * @size: the size of the block
+ */
+void
+parse_arena::add_block(size_t size)
+{
+    blocks.push_back({unique_ptr<char[]>(new char[size]), size});
+}
+
+/**
+ * allocate - allocate memory from the arena
+ * @size: the number of bytes to allocate
+ * @align: the alignment of the allocation, a power of two
+ *
+ * The memory stays valid until the arena is reset. Blocks which are too
+ * full for the allocation are skipped, and a new block is only added once
+ * every block has been used. Throws bad_alloc if memory runs out.
+ */
+void *
+parse_arena::allocate(size_t size, size_t align)
+{
+    if (size > SIZE_MAX / 2 - align) {
+        throw bad_alloc();
+    }
+
+    for (; current < blocks.size(); current++, used = 0) {
+        block& b = blocks[current];
+        uintptr_t start = ((uintptr_t)b.data.get() + used + align - 1) & ~(uintptr_t)(align - 1);
+        size_t offset = start - (uintptr_t)b.data.get();
+
+        if (offset <= b.size && size <= b.size - offset) {
+            used = offset + size;
+            return b.data.get() + offset;
+        }
+    }
+
+    add_block(max({min_block_size, blocks.empty() ? 0 : blocks.back().size * 2, size + align}));
+    used = 0;
+
+    return allocate(size, align);
+}
+
+/**
+ * reset - free everything allocated from the arena
+ *
+ * The blocks are kept for the next parse. If the last parse needed more
+ * than one block, they are replaced by a single block as large as all of
+ * them together, so that the next parse of a similar log fits in it.
+ */
+void
+parse_arena::reset()
+{
+    if (blocks.size() > 1) {
+        size_t total = 0;
+
+        for (auto& b : blocks) {
+            total += b.size;
+        }
+
+        blocks.clear();
+        add_block(total);
+    }
+
+    current = 0;
+    used = 0;
+}
+
+/**
+ * arena_allocator - standard allocator handing out memory from a parse_arena
+ *
+ * Memory is never freed individually, it is all released when the arena is
+ * reset. An allocator without an arena uses the heap instead. Copies of a
+ * container use the heap, so that copies made for other threads, such as
+ * those for parallel scans, never allocate from an arena concurrently.
+ */
+template <typename T>
+class arena_allocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = true_type;
+    using propagate_on_container_swap = true_type;
+
+    parse_arena *arena;
+
+    arena_allocator(parse_arena *arena = nullptr) noexcept
+        : arena(arena)
+    {
+    }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) noexcept
+        : arena(other.arena)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw bad_alloc();
+        }
+
+        if (!arena) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t) noexcept
+    {
+        if (!arena) {
+            ::operator delete(p);
+        }
+    }
+
+    arena_allocator select_on_container_copy_construction() const
+    {
+        return arena_allocator();
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const
+    {
+        return arena == other.arena;
+    }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const
+    {
+        return arena != other.arena;
+    }
+};
+
+template <typename T>
+using arena_vector = vector<T, arena_allocator<T>>;
+
+/**
+ * evtc_file_view - read-only view of an EVTC file mapped into memory
+ *
+ * Rather than seeking and reading every structure out of the file
+ * separately, the whole file is mapped into memory once. Agents, skills and
+ * combat events are then accessed in place from the mapping, without copying
+ * them out first.
+ *
+ * A view may also be attached to data which is already in memory, such as
+ * the agent table read from a stream.
+ */
+class evtc_file_view
+{
+private:
+    const char *base;
+    uint64_t length;
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE mapping_handle;
+#else
+    int fd;
+#endif
+
+    void close();
+public:
+    evtc_file_view();
+    ~evtc_file_view();
+
+    evtc_file_view(const evtc_file_view&) = delete;
+    evtc_file_view& operator=(const evtc_file_view&) = delete;
+
+    int open(const char *filename);
+    void attach(const char *data, uint64_t len);
+
+    uint64_t size() const
+    {
+        return length;
+    }
+
+    /* Returns a pointer to @len bytes at @offset, or nullptr if the file is
+     * not large enough to contain them.
+     */
+    const char *at(uint64_t offset, uint64_t len) const
+    {
+        if (offset > length || len > length - offset)
+            return nullptr;
+        return base + offset;
+    }
+};
+
+evtc_file_view::evtc_file_view()
+    : base(nullptr), length(0)
+#ifdef _WIN32
+    , file_handle(INVALID_HANDLE_VALUE), mapping_handle(NULL)
+#else
+    , fd(-1)
+#endif
+{
+}
+
+evtc_file_view::~evtc_file_view()
+{
+    close();
+}
+
+/**
+ * close - release the mapping and the underlying file
+ */
+void
+evtc_file_view::close()
+{
+#ifdef _WIN32
+    if (mapping_handle) {
+        if (base)
+            UnmapViewOfFile(base);
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(file_handle);
+    mapping_handle = NULL;
+    file_handle = INVALID_HANDLE_VALUE;
+#else
+    if (fd >= 0) {
+        if (base)
+            munmap((void *)base, length);
+        ::close(fd);
+    }
+    fd = -1;
+#endif
+    base = nullptr;
+    length = 0;
+}
+
+/**
+ * open - map an EVTC file into memory
+ * @filename: path of the file to map
+ *
+ * Opens @filename and maps its entire contents read-only. An empty file is
+ * opened successfully, but has no bytes available. Returns zero on success,
+ * -ESPIPE if the file is a pipe or other object which cannot be mapped, or
+ * -ENOENT if the file could not be opened or mapped.
+ */
+int
+evtc_file_view::open(const char *filename)
+{
+    close();
+
+#ifdef _WIN32
+    LARGE_INTEGER file_size;
+
+    file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ,
+                              NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                              NULL);
+    if (file_handle == INVALID_HANDLE_VALUE)
+        return -ENOENT;
+
+    if (GetFileType(file_handle) != FILE_TYPE_DISK) {
+        close();
+        return -ESPIPE;
+    }
+
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        close();
+        return -ENOENT;
+    }
+
+    /* Windows refuses to map an empty file */
+    if (file_size.QuadPart == 0)
+        return 0;
+
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping_handle) {
+        close();
+        return -ENOENT;
+    }
+
+    base = (const char *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (!base) {
+        close();
+        return -ENOENT;
+    }
+    length = file_size.QuadPart;
+#else
+    struct stat st;
+    void *mapping;
+
+    fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return -ENOENT;
+
+    if (fstat(fd, &st)) {
+        close();
+        return -ENOENT;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close();
+        return -ESPIPE;
+    }
+
+    /* mmap refuses to map an empty file */
+    if (st.st_size == 0)
+        return 0;
+
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close();
+        return -ENOENT;
+    }
+
+    /* Combat events are scanned front to back */
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    base = (const char *)mapping;
+    length = st.st_size;
+#endif
+
+    return 0;
+}
+
+/**
+ * attach - view data which is already in memory
+ * @data: start of the EVTC data
+ * @len: number of bytes available at @data
+ *
+ * Releases any previously mapped file and views @data instead. The caller
+ * owns @data, and must keep it valid for as long as the view is in use.
+ */
+void
+evtc_file_view::attach(const char *data, uint64_t len)
+{
+    close();
+
+    base = data;
+    length = len;
+}
+
+/**
+ * evtc_byte_source - a forward-only source of bytes for evtc_stream
+ *
+ * read() returns the number of bytes copied into @dst, which is only zero
+ * once the source is exhausted. error() reports whether the source ended
+ * early because its data was corrupt.
+ */
+class evtc_byte_source
+{
+public:
+    virtual ~evtc_byte_source() {}
+    virtual size_t read(char *dst, size_t len) = 0;
+    virtual int error()
+    {
+        return 0;
+    }
+};
+
+/* Byte source reading from a plain file, pipe or standard input */
+class evtc_file_source : public evtc_byte_source
+{
+private:
+    FILE *fp;
+    bool owned;
+public:
+    evtc_file_source(FILE *fp, bool owned)
+        : fp(fp), owned(owned)
+    {
+    }
+
+    ~evtc_file_source()
+    {
+        if (owned)
+            fclose(fp);
+    }
+
+    size_t read(char *dst, size_t len) override
+    {
+        return fread(dst, 1, len, fp);
+    }
+};
+
+/**
+ * evtc_chunk_queue - bounded queue handing chunks between two threads
+ *
+ * The producer blocks once @max_chunks are queued, so a fast producer cannot
+ * run ahead of the consumer and grow memory usage. Either side may stop
+ * early: close() marks the end of the data, while cancel() tells a blocked
+ * producer that nobody will consume its chunks.
+ */
+class evtc_chunk_queue
+{
+private:
+    mutex lock;
+    condition_variable cond;
+    deque<vector<char>> chunks;
+    size_t max_chunks;
+    bool closed;
+    bool cancelled;
+public:
+    explicit evtc_chunk_queue(size_t max_chunks)
+        : max_chunks(max_chunks), closed(false), cancelled(false)
+    {
+    }
+
+    /* Returns false if the consumer has cancelled the queue */
+    bool push(vector<char>&& chunk)
+    {
+        unique_lock<mutex> guard(lock);
+
+        cond.wait(guard, [this] { return cancelled || chunks.size() < max_chunks; });
+        if (cancelled)
+            return false;
+
+        chunks.push_back(move(chunk));
+        cond.notify_all();
+        return true;
+    }
+
+    /* Returns false once the queue is closed and drained */
+    bool pop(vector<char>& chunk)
+    {
+        unique_lock<mutex> guard(lock);
+
+        cond.wait(guard, [this] { return closed || !chunks.empty(); });
+        if (chunks.empty())
+            return false;
+
+        chunk = move(chunks.front());
+        chunks.pop_front();
+        cond.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+
+        closed = true;
+        cond.notify_all();
+    }
+
+    void cancel()
+    {
+        lock_guard<mutex> guard(lock);
+
+        cancelled = true;
+        cond.notify_all();
+    }
+};
+
+/**
+ * evtc_inflater - decompress a raw DEFLATE stream (RFC 1951)
+ *
+ * Compressed EVTC files are ZIP archives holding a single DEFLATE
+ * compressed entry. The inflater decodes the entire entry, handing the
+ * output to a sink function one block at a time. Only the most recent 32KB
+ * of output is kept for back references, so memory usage does not depend
+ * on the size of the entry.
+ */
+class evtc_inflater
+{
+public:
+    /* Returns false to stop inflating early */
+    using sink_fn = function<bool(const char *data, size_t len)>;
+
+    evtc_inflater(const uint8_t *data, size_t len, size_t block_size, sink_fn sink);
+
+    int inflate();
+
+    /* Number of input bytes used by the stream once it has been inflated */
+    size_t consumed() const
+    {
+        return in_pos - bitcnt / 8;
+    }
+private:
+    static constexpr size_t window_size = 32768;
+    static constexpr unsigned fast_bits = 10;
+    static constexpr unsigned max_bits = 15;
+
+    struct huffman {
+        uint16_t count[max_bits + 1];
+        uint16_t symbol[288];
+        /* symbol | (length << 9) for codes of up to fast_bits, or zero */
+        uint16_t fast[1 << fast_bits];
+    };
+
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+    uint64_t bitbuf;
+    unsigned bitcnt;
+
+    vector<char> window;
+    size_t pos;
+    size_t emitted;
+    sink_fn sink;
+
+    huffman lencode;
+    huffman distcode;
+
+    void refill();
+    uint32_t bits(unsigned n);
+    int decode(const huffman& h);
+    static int build(huffman& h, const uint8_t *lengths, unsigned n);
+    bool flush();
+    int stored();
+    int fixed();
+    int dynamic();
+    int codes();
+};
+
+evtc_inflater::evtc_inflater(const uint8_t *data, size_t len, size_t block_size, sink_fn sink)
+    : in(data), in_len(len), in_pos(0), bitbuf(0), bitcnt(0),
+      window(window_size + block_size), pos(0), emitted(0), sink(sink)
+{
+}
+
+/**
+ * refill - top up the bit buffer to at least 57 bits
+ *
+ * This is enough to decode a length and distance pair without checking
+ * again. Reading past the end of the input supplies zero bits, and the
+ * decoder fails once it has gone too far past the end to be valid.
+ */
+void
+evtc_inflater::refill()
+{
+    while (bitcnt <= 56) {
+        uint64_t byte = in_pos < in_len ? in[in_pos] : 0;
+
+        in_pos++;
+        bitbuf |= byte << bitcnt;
+        bitcnt += 8;
+    }
+}
+
+uint32_t
+evtc_inflater::bits(unsigned n)
+{
+    uint32_t val;
+
+    if (bitcnt < n)
+        refill();
+
+    val = (uint32_t)(bitbuf & ((1ULL << n) - 1));
+    bitbuf >>= n;
+    bitcnt -= n;
+
+    return val;
+}
+
+/**
+ * decode - decode one symbol using a Huffman table
+ * @h: the table to decode with
+ *
+ * Codes of up to fast_bits are resolved with a single table lookup. Longer
+ * codes are decoded one bit at a time using the canonical code counts.
+ * Returns the symbol, or -1 if the code is not valid.
+ */
+int
+evtc_inflater::decode(const huffman& h)
+{
+    uint16_t entry;
+    int code, first, index, count;
+    unsigned len;
+
+    if (bitcnt < max_bits)
+        refill();
+
+    entry = h.fast[bitbuf & ((1 << fast_bits) - 1)];
+    if (entry) {
+        len = entry >> 9;
+        bitbuf >>= len;
+        bitcnt -= len;
+        return entry & 0x1ff;
+    }
+
+    code = first = index = 0;
+    for (len = 1; len <= max_bits; len++) {
+        code |= bitbuf & 1;
+        bitbuf >>= 1;
+        bitcnt--;
+
+        count = h.count[len];
+        if (code - count < first)
+            return h.symbol[index + (code - first)];
+
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+/**
+ * build - construct a canonical Huffman decoding table
+ * @h: the table to build
+ * @lengths: the code length of each symbol, zero if unused
+ * @n: number of symbols
+ *
+ * Returns -EINVAL if the code lengths are over-subscribed. Incomplete codes
+ * are permitted, as they are used for single distance code blocks.
+ */
+int
+evtc_inflater::build(huffman& h, const uint8_t *lengths, unsigned n)
+{
+    uint16_t offs[max_bits + 1];
+    uint16_t next_code[max_bits + 1];
+    unsigned len, symbol;
+    int left;
+
+    memset(h.count, 0, sizeof(h.count));
+    memset(h.fast, 0, sizeof(h.fast));
+
+    for (symbol = 0; symbol < n; symbol++)
+        h.count[lengths[symbol]]++;
+
+    if (h.count[0] == n)
+        return 0;
+
+    left = 1;
+    for (len = 1; len <= max_bits; len++) {
+        left <<= 1;
+        left -= h.count[len];
+        if (left < 0)
+            return -EINVAL;
+    }
+
+    offs[1] = 0;
+    next_code[1] = 0;
+    for (len = 1; len < max_bits; len++) {
+        offs[len + 1] = offs[len] + h.count[len];
+        next_code[len + 1] = (next_code[len] + h.count[len]) << 1;
+    }
+
+    for (symbol = 0; symbol < n; symbol++) {
+        unsigned code, reversed, i;
+
+        len = lengths[symbol];
+        if (!len)
+            continue;
+
+        h.symbol[offs[len]++] = symbol;
+
+        code = next_code[len]++;
+        if (len > fast_bits)
+            continue;
+
+        /* Codes are stored most significant bit first */
+        reversed = 0;
+        for (i = 0; i < len; i++)
+            reversed |= ((code >> i) & 1) << (len - 1 - i);
+
+        for (i = reversed; i < (1u << fast_bits); i += 1u << len)
+            h.fast[i] = symbol | (len << 9);
+    }
+
+    return 0;
+}
+
+/**
+ * flush - hand the completed output block to the sink
+ *
+ * Keeps the most recent window_size bytes for back references. Returns
+ * false if the sink asked to stop.
+ */
+bool
+evtc_inflater::flush()
+{
+    size_t keep;
+
+    if (pos > emitted && !sink(window.data() + emitted, pos - emitted))
+        return false;
+
+    keep = min(pos, window_size);
+    memmove(window.data(), window.data() + pos - keep, keep);
+    pos = keep;
+    emitted = keep;
+
+    return true;
+}
+
+/* Copy a stored (uncompressed) block */
+int
+evtc_inflater::stored()
+{
+    uint32_t len, nlen;
+
+    /* Stored blocks start on a byte boundary */
+    bits(bitcnt & 7);
+
+    len = bits(16);
+    nlen = bits(16);
+    if (len != (~nlen & 0xffff))
+        return -EINVAL;
+
+    while (len--) {
+        if (pos == window.size() && !flush())
+            return -ECANCELED;
+        window[pos++] = (char)bits(8);
+    }
+
+    return 0;
+}
+
+static const uint16_t inflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t inflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t inflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t inflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Decode literals and length/distance pairs until the end of block */
+int
+evtc_inflater::codes()
+{
+    for (;;) {
+        int symbol, dist_symbol;
+        uint32_t len, dist;
+
+        refill();
+
+        /* Zero bits are supplied past the end, but not indefinitely */
+        if (in_pos > in_len + 16)
+            return -EINVAL;
+
+        symbol = decode(lencode);
+        if (symbol < 0)
+            return -EINVAL;
+
+        if (symbol < 256) {
+            if (pos == window.size() && !flush())
+                return -ECANCELED;
+            window[pos++] = (char)symbol;
+            continue;
+        }
+
+        if (symbol == 256)
+            return 0;
+
+        symbol -= 257;
+        if (symbol >= 29)
+            return -EINVAL;
+        len = inflate_length_base[symbol] + bits(inflate_length_extra[symbol]);
+
+        dist_symbol = decode(distcode);
+        if (dist_symbol < 0 || dist_symbol >= 30)
+            return -EINVAL;
+        dist = inflate_dist_base[dist_symbol] + bits(inflate_dist_extra[dist_symbol]);
+
+        if (pos + len > window.size() && !flush())
+            return -ECANCELED;
+
+        if (dist > pos)
+            return -EINVAL;
+
+        /* The source may overlap the destination, so copy bytewise */
+        {
+            char *dst = window.data() + pos;
+            const char *src = dst - dist;
+
+            pos += len;
+            while (len--)
+                *dst++ = *src++;
+        }
+    }
+}
+
+/* Decode a block using the fixed Huffman codes */
+int
+evtc_inflater::fixed()
+{
+    uint8_t lengths[288];
+    unsigned symbol;
+
+    for (symbol = 0; symbol < 144; symbol++)
+        lengths[symbol] = 8;
+    for (; symbol < 256; symbol++)
+        lengths[symbol] = 9;
+    for (; symbol < 280; symbol++)
+        lengths[symbol] = 7;
+    for (; symbol < 288; symbol++)
+        lengths[symbol] = 8;
+    build(lencode, lengths, 288);
+
+    for (symbol = 0; symbol < 30; symbol++)
+        lengths[symbol] = 5;
+    build(distcode, lengths, 30);
+
+    return codes();
+}
+
+/* Decode a block using Huffman codes described at the start of the block */
+int
+evtc_inflater::dynamic()
+{
+    static const uint8_t order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint8_t lengths[288 + 32];
+    unsigned nlen, ndist, ncode, index;
+
+    nlen = bits(5) + 257;
+    ndist = bits(5) + 1;
+    ncode = bits(4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return -EINVAL;
+
+    memset(lengths, 0, sizeof(lengths));
+    for (index = 0; index < ncode; index++)
+        lengths[order[index]] = bits(3);
+
+    if (build(lencode, lengths, 19))
+        return -EINVAL;
+
+    index = 0;
+    while (index < nlen + ndist) {
+        int symbol;
+        unsigned len, repeat;
+
+        refill();
+        symbol = decode(lencode);
+        if (symbol < 0)
+            return -EINVAL;
+
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+
+        len = 0;
+        if (symbol == 16) {
+            if (!index)
+                return -EINVAL;
+            len = lengths[index - 1];
+            repeat = 3 + bits(2);
+        } else if (symbol == 17) {
+            repeat = 3 + bits(3);
+        } else {
+            repeat = 11 + bits(7);
+        }
+
+        if (index + repeat > nlen + ndist)
+            return -EINVAL;
+        while (repeat--)
+            lengths[index++] = len;
+    }
+
+    /* A block without an end of block code can never terminate */
+    if (!lengths[256])
+        return -EINVAL;
+
+    if (build(lencode, lengths, nlen) || build(distcode, lengths + nlen, ndist))
+        return -EINVAL;
+
+    return codes();
+}
+
+/**
+ * inflate - decompress the entire stream
+ *
+ * Returns zero once the final block has been decoded and handed to the
+ * sink, -ECANCELED if the sink stopped early, or -EINVAL if the data is
+ * corrupt.
+ */
+int
+evtc_inflater::inflate()
+{
+    unsigned last, type;
+    int err;
+
+    do {
+        last = bits(1);
+        type = bits(2);
+
+        switch (type) {
+        case 0:
+            err = stored();
+            break;
+        case 1:
+            err = fixed();
+            break;
+        case 2:
+            err = dynamic();
+            break;
+        default:
+            err = -EINVAL;
+            break;
+        }
+
+        if (err)
+            return err;
+    } while (!last);
+
+    /* The final block must lie within the input */
+    if ((in_pos * 8) - bitcnt > (uint64_t)in_len * 8)
+        return -EINVAL;
+
+    return flush() ? 0 : -ECANCELED;
+}
+
+/* Local file header of a ZIP archive entry */
+#pragma pack(push, 1)
+struct zip_local_header {
+    uint32_t signature;
+    uint16_t version;
+    uint16_t flags;
+    uint16_t method;
+    uint16_t mod_time;
+    uint16_t mod_date;
+    uint32_t crc32;
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+    uint16_t name_length;
+    uint16_t extra_length;
+};
+#pragma pack(pop)
+
+static const uint32_t ZIP_LOCAL_HEADER_SIGNATURE = 0x04034b50;
+static const uint16_t ZIP_FLAG_ENCRYPTED = 0x0001;
+static const uint16_t ZIP_FLAG_DATA_DESCRIPTOR = 0x0008;
+static const uint16_t ZIP_METHOD_STORED = 0;
+static const uint16_t ZIP_METHOD_DEFLATE = 8;
+static const uint32_t ZIP_DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+
+/* Lookup tables for computing the CRC-32 of ZIP entries 8 bytes at a time */
+struct zip_crc_table {
+    uint32_t entries[8][256];
+};
+
+static constexpr zip_crc_table
+make_zip_crc_table()
+{
+    zip_crc_table table = {};
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+        table.entries[0][i] = crc;
+    }
+
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t prev = table.entries[k - 1][i];
+
+            table.entries[k][i] = (prev >> 8) ^ table.entries[0][prev & 0xff];
+        }
+    }
+
+    return table;
+}
+
+static constexpr zip_crc_table zip_crc = make_zip_crc_table();
+
+static uint32_t
+load_le32(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * zip_crc32 - update the CRC-32 of a ZIP entry
+ * @crc: the CRC-32 of the preceding data, or zero at the start of the entry
+ * @data: the next bytes of the entry
+ * @len: the size of @data
+ */
+static uint32_t
+zip_crc32(uint32_t crc, const char *data, size_t len)
+{
+    const uint32_t (*t)[256] = zip_crc.entries;
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    crc = ~crc;
+
+    for (; len >= 8; bytes += 8, len -= 8) {
+        uint32_t lo = crc ^ load_le32(bytes);
+        uint32_t hi = load_le32(bytes + 4);
+
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+
+    for (; len; bytes++, len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *bytes) & 0xff];
+    }
+
+    return ~crc;
+}
+
+static const uint16_t ZIP_EXTRA_ZIP64 = 0x0001;
+
+/**
+ * is_zip64_entry - check whether an entry has a ZIP64 extended information field
+ * @header: the local header of the entry, followed by its name and extra fields
+ */
+static bool
+is_zip64_entry(const zip_local_header *header)
+{
+    const uint8_t *extra = (const uint8_t *)(header + 1) + header->name_length;
+    size_t pos = 0;
+
+    while (pos + 4 <= header->extra_length) {
+        uint16_t tag = extra[pos] | extra[pos + 1] << 8;
+        uint16_t size = extra[pos + 2] | extra[pos + 3] << 8;
+
+        if (tag == ZIP_EXTRA_ZIP64)
+            return true;
+
+        pos += 4 + size;
+    }
+
+    return false;
+}
+
+/**
+ * check_zip_entry - verify a decompressed entry against its archive record
+ * @header: the local header of the entry
+ * @trailer: the archive data following the compressed entry
+ * @trailer_len: the size of @trailer
+ * @compressed: the size of the compressed entry
+ * @crc: the CRC-32 of the decompressed entry
+ * @size: the size of the decompressed entry
+ *
+ * The CRC-32 and sizes are found in the local header, or in a data
+ * descriptor following the entry when the header flags say so. A data
+ * descriptor may start with a signature, and holds 8 byte sizes for ZIP64
+ * entries. Returns zero if the entry matches, or -EINVAL if it is corrupt.
+ */
+static int
+check_zip_entry(const zip_local_header *header, const uint8_t *trailer, size_t trailer_len,
+                uint64_t compressed, uint32_t crc, uint64_t size)
+{
+    uint64_t expected_size;
+    uint32_t expected_crc;
+
+    if (!(header->flags & ZIP_FLAG_DATA_DESCRIPTOR)) {
+        expected_crc = header->crc32;
+        expected_size = header->uncompressed_size;
+
+        /* ZIP64 entries keep their real sizes in an extra field */
+        if (expected_size == UINT32_MAX) {
+            expected_size = size;
+        }
+    } else {
+        if (trailer_len >= 4 && load_le32(trailer) == ZIP_DATA_DESCRIPTOR_SIGNATURE) {
+            trailer += 4;
+            trailer_len -= 4;
+        }
+
+        if (!is_zip64_entry(header)) {
+            if (trailer_len < 12 || load_le32(trailer + 4) != compressed) {
+                return -EINVAL;
+            }
+            expected_size = load_le32(trailer + 8);
+        } else {
+            if (trailer_len < 20 ||
+                (load_le32(trailer + 4) | (uint64_t)load_le32(trailer + 8) << 32) != compressed) {
+                return -EINVAL;
+            }
+            expected_size = load_le32(trailer + 12) | (uint64_t)load_le32(trailer + 16) << 32;
+        }
+        expected_crc = load_le32(trailer);
+    }
+
+    if (crc != expected_crc || size != expected_size) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * is_zip_archive - check whether a mapped file is a ZIP archive
+ * @file: the mapped file to check
+ *
+ * Compressed EVTC files (.zevtc and .evtc.zip) are ZIP archives, which are
+ * recognized by the local header signature at the start of the file.
+ */
+static bool
+is_zip_archive(const evtc_file_view& file)
+{
+    const char *signature = file.at(0, sizeof(uint32_t));
+    uint32_t value;
+
+    if (!signature)
+        return false;
+
+    memcpy(&value, signature, sizeof(value));
+
+    return value == ZIP_LOCAL_HEADER_SIGNATURE;
+}
+
+/**
+ * evtc_zip_source - byte source decompressing a compressed EVTC file
+ *
+ * The archive is mapped, or read from memory, and the first entry is
+ * decompressed by a worker thread into a small queue of blocks. The parser consumes blocks which are
+ * already decompressed while the worker inflates the next ones, so the
+ * decompressed log is never written to disk or held in memory all at once.
+ */
+class evtc_zip_source : public evtc_byte_source
+{
+private:
+    /* Number of decompressed blocks the worker may run ahead */
+    static constexpr size_t queue_depth = 4;
+
+    evtc_file_view file;
+    evtc_chunk_queue queue;
+    thread worker;
+    atomic<int> worker_err;
+    size_t block_size;
+    vector<char> current;
+    size_t current_pos;
+
+    int start();
+    void inflate_entry(const zip_local_header *header, const uint8_t *data, size_t len);
+public:
+    explicit evtc_zip_source(size_t block_size);
+    ~evtc_zip_source();
+
+    int open(const char *filename);
+    int attach(const char *data, uint64_t len);
+    size_t read(char *dst, size_t len) override;
+    int error() override
+    {
+        return worker_err;
+    }
+};
+
+evtc_zip_source::evtc_zip_source(size_t block_size)
+    : queue(queue_depth), worker_err(0), block_size(block_size), current_pos(0)
+{
+}
+
+evtc_zip_source::~evtc_zip_source()
+{
+    /* Stop the worker if the parser gave up before reaching the end */
+    queue.cancel();
+    if (worker.joinable())
+        worker.join();
+}
+
+/**
+ * open - start decompressing the EVTC file within a ZIP archive
+ * @filename: the archive to open
+ *
+ * Only the first entry of the archive is read, as compressed EVTC files
+ * only ever contain the one log. Returns zero on success, -ENOENT if the
+ * file cannot be opened, or -EINVAL if it is not a supported archive.
+ */
+int
+evtc_zip_source::open(const char *filename)
+{
+    int err;
+
+    err = file.open(filename);
+    if (err)
+        return err;
+
+    return start();
+}
+
+/**
+ * attach - start decompressing an archive which is already in memory
+ * @data: the contents of the archive
+ * @len: the size of @data
+ *
+ * The caller owns @data, and must keep it valid until the source is
+ * destroyed. Returns zero on success, or -EINVAL if it is not a supported
+ * archive.
+ */
+int
+evtc_zip_source::attach(const char *data, uint64_t len)
+{
+    file.attach(data, len);
+
+    return start();
+}
+
+/**
+ * start - start the worker decompressing the first entry of the archive
+ */
+int
+evtc_zip_source::start()
+{
+    const zip_local_header *header;
+    const char *data;
+    uint64_t data_start, data_len;
+
+    header = (const zip_local_header *)file.at(0, sizeof(*header));
+    if (!header || header->signature != ZIP_LOCAL_HEADER_SIGNATURE)
+        return -EINVAL;
+
+    if (header->flags & ZIP_FLAG_ENCRYPTED)
+        return -EINVAL;
+
+    data_start = sizeof(*header) + header->name_length + header->extra_length;
+
+    if (header->method == ZIP_METHOD_DEFLATE) {
+        /* A DEFLATE stream marks its own end, so the compressed size is
+         * not needed. It may not even be known if the sizes were written
+         * in a data descriptor after the entry.
+         */
+        data_len = data_start < file.size() ? file.size() - data_start : 0;
+    } else if (header->method == ZIP_METHOD_STORED &&
+               !(header->flags & ZIP_FLAG_DATA_DESCRIPTOR)) {
+        data_len = header->compressed_size;
+    } else {
+        return -EINVAL;
+    }
+
+    data = file.at(data_start, data_len);
+    if (!data)
+        return -EINVAL;
+
+    worker = thread(&evtc_zip_source::inflate_entry, this, header,
+                    (const uint8_t *)data, (size_t)data_len);
+
+    return 0;
+}
+
+/**
+ * inflate_entry - worker thread decompressing the archive entry
+ * @header: the local header of the entry
+ * @data: the compressed entry data, followed by the rest of the archive
+ * @len: the size of @data
+ *
+ * Once the whole entry has been decompressed, its CRC-32 and size are
+ * checked against the archive, so that damaged data which still happens to
+ * decompress is reported rather than parsed.
+ */
+void
+evtc_zip_source::inflate_entry(const zip_local_header *header, const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0;
+    uint64_t size = 0;
+    auto sink = [this, &crc, &size](const char *block, size_t block_len) {
+        crc = zip_crc32(crc, block, block_len);
+        size += block_len;
+        return queue.push(vector<char>(block, block + block_len));
+    };
+    int err = 0;
+
+    if (header->method == ZIP_METHOD_STORED) {
+        size_t offset;
+
+        for (offset = 0; offset < len; offset += block_size) {
+            if (!sink((const char *)data + offset, min(block_size, len - offset))) {
+                err = -ECANCELED;
+                break;
+            }
+        }
+
+        if (!err) {
+            err = check_zip_entry(header, data + len, 0, len, crc, size);
+        }
+    } else {
+        evtc_inflater inflater(data, len, block_size, sink);
+
+        err = inflater.inflate();
+        if (!err) {
+            size_t used = inflater.consumed();
+
+            err = check_zip_entry(header, data + used, len - used, used, crc, size);
+        }
+    }
+
+    if (err && err != -ECANCELED)
+        worker_err = err;
+
+    queue.close();
+}
+
+size_t
+evtc_zip_source::read(char *dst, size_t len)
+{
+    size_t copied = 0;
+
+    while (copied < len) {
+        size_t chunk;
+
+        if (current_pos == current.size()) {
+            current_pos = 0;
+            if (!queue.pop(current)) {
+                current.clear();
+                break;
+            }
+        }
+
+        chunk = min(len - copied, current.size() - current_pos);
+        memcpy(dst + copied, current.data() + current_pos, chunk);
+        current_pos += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+/**
+ * evtc_stream - forward-only block reader for EVTC data
+ *
+ * Pipes and standard input cannot be mapped or seeked, and their total size
+ * is not known until they are exhausted. The stream reader pulls data in
+ * large fixed size blocks, and hands out whole records from the current
+ * block, so memory usage does not depend on the size of the log.
+ */
+class evtc_stream
+{
+private:
+    unique_ptr<evtc_byte_source> source;
+    arena_vector<char> block;
+    size_t head;
+    size_t tail;
+
+    bool fill();
+public:
+    /* Multiple of every cbtevent size, so blocks hold whole events */
+    static constexpr size_t block_size = 1 << 20;
+
+    explicit evtc_stream(parse_arena *arena);
+    ~evtc_stream();
+
+    evtc_stream(const evtc_stream&) = delete;
+    evtc_stream& operator=(const evtc_stream&) = delete;
+
+    int open(const char *filename);
+    int open_zip(const char *filename);
+    int open_zip(const char *data, uint64_t len);
+    bool read(char *dst, uint64_t len);
+    bool skip(uint64_t len);
+    uint32_t next_records(uint32_t record_size, const char **records);
+
+    int error()
+    {
+        return source ? source->error() : 0;
+    }
+};
+
+/**
+ * evtc_stream - Construct a stream which is not yet open
+ * @arena: the arena to allocate the block buffer from once opened, or
+ *         nullptr to use the heap
+ *
+ * The block buffer is only allocated once the stream is opened, so that
+ * logs which are mapped rather than streamed never need it.
+ */
+evtc_stream::evtc_stream(parse_arena *arena)
+    : block(arena_allocator<char>(arena)), head(0), tail(0)
+{
+}
+
+evtc_stream::~evtc_stream()
+{
+}
+
+/**
+ * open - open a stream for reading
+ * @filename: the file or pipe to read, or "-" for standard input
+ *
+ * Returns zero on success, or -ENOENT if the file could not be opened.
+ */
+int
+evtc_stream::open(const char *filename)
+{
+    FILE *fp;
+
+    if (!strcmp(filename, "-")) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        source.reset(new evtc_file_source(stdin, false));
+        block.resize(block_size);
+        return 0;
+    }
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        return -ENOENT;
+    }
+
+    source.reset(new evtc_file_source(fp, true));
+    block.resize(block_size);
+    return 0;
+}
+
+/**
+ * open_zip - open a compressed EVTC file for reading
+ * @filename: the .zevtc or .evtc.zip archive
+ *
+ * The archive is decompressed in the background while it is being read.
+ * Returns zero on success, or a negative error code if the archive cannot
+ * be opened.
+ */
+int
+evtc_stream::open_zip(const char *filename)
+{
+    evtc_zip_source *zip = new evtc_zip_source(block_size);
+    int err;
+
+    source.reset(zip);
+    block.resize(block_size);
+
+    err = zip->open(filename);
+    if (err) {
+        source.reset();
+    }
+
+    return err;
+}
+
+/**
+ * open_zip - open a compressed EVTC file held in memory for reading
+ * @data: the contents of the .zevtc or .evtc.zip archive
+ * @len: the size of @data
+ *
+ * The caller owns @data, and must keep it valid while the stream is open.
+ */
+int
+evtc_stream::open_zip(const char *data, uint64_t len)
+{
+    evtc_zip_source *zip = new evtc_zip_source(block_size);
+    int err;
+
+    source.reset(zip);
+    block.resize(block_size);
+
+    err = zip->attach(data, len);
+    if (err) {
+        source.reset();
+    }
+
+    return err;
+}
+
+/**
+ * fill - read more data into the current block
+ *
+ * Moves any unconsumed bytes to the front of the block, and then reads
+ * until the block is full or the stream ends. Returns false if no new data
+ * could be read.
+ */
+bool
+evtc_stream::fill()
+{
+    size_t bytes;
+
+    if (head) {
+        memmove(block.data(), block.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    if (tail == block.size())
+        return false;
+
+    bytes = source->read(block.data() + tail, block.size() - tail);
+    tail += bytes;
+
+    return bytes != 0;
+}
+
+/**
+ * read - copy bytes from the stream
+ * @dst: buffer to store the data
+ * @len: number of bytes to copy
+ *
+ * Returns false if the stream ended before @len bytes were read.
+ */
+bool
+evtc_stream::read(char *dst, uint64_t len)
+{
+    while (len) {
+        size_t chunk;
+
+        if (head == tail && !fill())
+            return false;
+
+        chunk = min<uint64_t>(len, tail - head);
+        memcpy(dst, block.data() + head, chunk);
+        head += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+/**
+ * skip - discard bytes from the stream
+ * @len: number of bytes to discard
+ *
+ * Returns false if the stream ended before @len bytes were skipped.
+ */
+bool
+evtc_stream::skip(uint64_t len)
+{
+    while (len) {
+        size_t chunk;
+
+        if (head == tail && !fill())
+            return false;
+
+        chunk = min<uint64_t>(len, tail - head);
+        head += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+/**
+ * next_records - get the next run of whole records from the stream
+ * @record_size: size of a single record
+ * @records: on return, points to the first record
+ *
+ * Returns the number of whole records available at @records, reading
+ * another block if necessary. The records remain valid until the next call.
+ * Returns zero once the stream is exhausted. A trailing partial record is
+ * ignored.
+ */
+uint32_t
+evtc_stream::next_records(uint32_t record_size, const char **records)
+{
+    uint32_t count;
+
+    if (tail - head < record_size) {
+        while (fill()) {
+            /* keep reading until the block is full */
+        }
+    }
+
+    count = (tail - head) / record_size;
+    *records = block.data() + head;
+    head += (size_t)count * record_size;
+
+    return count;
+}
+
+/* The evtc_cbtevent structure is used to abstract away the layout differences
+ * of the different versions of the cbtevent data in evtc_cbtevent_v0 and
+ * evtc_cbtevent_v1 data structures. The class is a template over the layout
+ * traits, so every accessor compiles down to a direct load from a fixed
+ * offset of the raw structure, without checking the revision per event.
+ * Almost every field has the same name. A few fields have different sizes,
+ * but can be easily type-casted up to the larger size.
+ *
+ * This macro is provided as a convenient way to define accessors for the most
+ * common fields that do not need any special handling between versions.
+ */
+#define CBTEVENT_ACCESSOR(type, field)                                         \
+  type field() const                                                           \
+  {                                                                            \
+    return (type)(raw->field);                                                 \
+  }
+
+/* Abstraction of the various evtc_cbtevent versions
+ *
+ * The event data is not copied, it points directly into the mapped file.
+ */
+template <typename Layout>
+class evtc_cbtevent
+{
+private:
+    const typename Layout::raw_event *raw;
+public:
+    static constexpr uint32_t size = sizeof(typename Layout::raw_event);
+
+    explicit evtc_cbtevent(const char *data);
+    evtc_cbtevent(const evtc_file_view& file,
+                  uint64_t cbt_event_start,
+                  uint32_t cbtevent);
+
+    CBTEVENT_ACCESSOR(uint8_t, is_statechange)
+    CBTEVENT_ACCESSOR(uint64_t, src_agent)
+    CBTEVENT_ACCESSOR(uint64_t, dst_agent)
+    CBTEVENT_ACCESSOR(uint32_t, value)
+    CBTEVENT_ACCESSOR(uint64_t, time)
+    CBTEVENT_ACCESSOR(uint16_t, src_instid)
+    CBTEVENT_ACCESSOR(uint16_t, dst_instid)
+    CBTEVENT_ACCESSOR(uint16_t, src_master_instid)
+    CBTEVENT_ACCESSOR(int32_t, buff_dmg)
+    CBTEVENT_ACCESSOR(uint8_t, iff)
+    CBTEVENT_ACCESSOR(uint8_t, buff)
+    CBTEVENT_ACCESSOR(uint8_t, result)
+    CBTEVENT_ACCESSOR(uint8_t, is_activation)
+    CBTEVENT_ACCESSOR(uint8_t, is_buffremove)
+    CBTEVENT_ACCESSOR(uint32_t, skillid)
+    CBTEVENT_ACCESSOR(uint32_t, overstack_value)
+
+    /* Buff stack id of buff events, stored over the padding at the end of
+     * the event. Zero if the layout does not record stack ids.
+     */
+    uint32_t stack_id() const
+    {
+        uint32_t id = 0;
+
+        if constexpr (Layout::has_stack_ids)
+            memcpy(&id, &raw->pad61, sizeof(id));
+
+        return id;
+    }
+
+    /* Floats of position, velocity and facing events, stored over the
+     * dst_agent and value fields. Facing events only use the first two.
+     */
+    void coordinates(float xyz[3]) const
+    {
+        memcpy(xyz, &raw->dst_agent, 2 * sizeof(float));
+        memcpy(&xyz[2], &raw->value, sizeof(float));
+    }
+
+    struct evtc_guid guid() const
+    {
+        struct evtc_guid guid = {};
+
+        /* v0 never supported CBTS_GUILD events... */
+        memcpy(&guid.data, &raw->dst_agent, sizeof(guid.data));
+        guid.valid = true;
+
+#define BSWAP16(val) val = __builtin_bswap16(val)
+#define BSWAP32(val) val = __builtin_bswap32(val)
+
+        /* Some of the bytes in the GUID are stored in Big Endian format,
+         * so we need to swap them back into the right order for use with
+         * the GW2 API.
+         *
+         * Since we're assuming the host is "Little Endian" format, we only
+         * need to swap the values which are "Big Endian".
+         */
+        BSWAP16(guid.data.p4);
+        BSWAP16(guid.data.p5);
+        BSWAP32(guid.data.p6);
+
+        return guid;
+    };
+};
+
+/**
+ * evtc_cbtevent - Construct an EVTC combat event from raw event data
+ * @data: the raw combat event
+ *
+ * Construct an evtc_cbtevent item pointing at @data, which must hold a
+ * complete combat event of the given layout.
+ */
+template <typename Layout>
+evtc_cbtevent<Layout>::evtc_cbtevent(const char *data)
+    : raw((const typename Layout::raw_event *)data)
+{
+}
+
+/**
+ * evtc_cbtevent - Construct an EVTC combat event from the mapped file
+ * @file: the mapped file to read
+ * @cbt_event_start: where in the file combat events start
+ * @cbtevent: which combat event number to read
+ *
+ * Construct an evtc_cbtevent item pointing at the event within the mapped
+ * file. The caller must ensure that @cbtevent is less than the number of
+ * combat events in the file.
+ */
+template <typename Layout>
+evtc_cbtevent<Layout>::evtc_cbtevent(const evtc_file_view& file,
+                                     uint64_t cbt_event_start,
+                                     uint32_t cbtevent)
+    : raw((const typename Layout::raw_event *)
+          file.at(cbt_event_start + (uint64_t)cbtevent * size, size))
+{
+}
+
+/* Facts which parse_evtc can be asked to extract, see SAP_QUERY_*
+ *
+ * Each output type queries only the facts that it prints, and parsing stops
+ * as soon as those are known. The header is always parsed.
+ */
+static const uint32_t QUERY_HEADER = SAP_QUERY_HEADER;
+static const uint32_t QUERY_PLAYERS = SAP_QUERY_PLAYERS;
+static const uint32_t QUERY_CM = SAP_QUERY_CM;
+static const uint32_t QUERY_MAXHEALTH = SAP_QUERY_MAXHEALTH;
+static const uint32_t QUERY_LOGSTART = SAP_QUERY_LOGSTART;
+static const uint32_t QUERY_EVENTS = SAP_QUERY_EVENTS;
+static const uint32_t QUERY_REWARD = SAP_QUERY_REWARD;
+static const uint32_t QUERY_LOGEND = SAP_QUERY_LOGEND;
+static const uint32_t QUERY_AGENT_HASH = SAP_QUERY_AGENT_HASH;
+static const uint32_t QUERY_DAMAGE = SAP_QUERY_DAMAGE;
+static const uint32_t QUERY_BUFFS = SAP_QUERY_BUFFS;
+static const uint32_t QUERY_HEALTH = SAP_QUERY_HEALTH;
+static const uint32_t QUERY_MOVEMENT = SAP_QUERY_MOVEMENT;
+static const uint32_t QUERY_END = SAP_QUERY_END;
+
+/* Internal facts, which are not part of the C interface, use the upper
+ * half of the query so they never collide with new SAP_QUERY_* values
+ */
+static const uint32_t QUERY_INSTIDS = 0x10000;  /* instid lifetimes of every agent */
+static const uint32_t QUERY_INTERNAL = 0xffff0000;
+
+
+/* Positions for various useful data in the evtc file format
+ *
+ * The first few are static, but later parts of the file are
+ * dependent on how many agents, skills, and combat events
+ * are recorded.
+ */
+static const uint64_t OFFSET_EVTC_HEADER = 0;
+static const uint64_t EVTC_HEADER_SIZE = 16; /* 16 bytes */
+
+static const uint64_t OFFSET_EVTC_AGENT_COUNT = OFFSET_EVTC_HEADER + EVTC_HEADER_SIZE;
+static const uint64_t EVTC_AGENT_COUNT_SIZE = sizeof(uint32_t); /* 4 bytes */
+
+static const uint64_t OFFSET_EVTC_FIRST_AGENT = OFFSET_EVTC_AGENT_COUNT + EVTC_AGENT_COUNT_SIZE;
+
+static uint64_t OFFSET_EVTC_SKILL_COUNT(uint32_t agent_count)
+{
+    return (OFFSET_EVTC_FIRST_AGENT + (uint64_t)sizeof(evtc_agent) * agent_count);
+}
+static const uint64_t EVTC_SKILL_COUNT_SIZE = sizeof(uint32_t); /* 4 bytes */
+
+static uint64_t OFFSET_EVTC_FIRST_SKILL(uint32_t agent_count)
+{
+    return OFFSET_EVTC_SKILL_COUNT(agent_count) + EVTC_SKILL_COUNT_SIZE;
+}
+
+static uint64_t OFFSET_EVTC_FIRST_CBTEVENT(uint32_t agent_count, uint32_t skill_count)
+{
+    return (OFFSET_EVTC_FIRST_SKILL(agent_count) + (uint64_t)sizeof(evtc_skill) * skill_count);
+}
+
+static const uint32_t EVTC_CBTEVENT_SIZE(uint8_t revision)
+{
+    uint32_t size = 0;
+
+    if (!dispatch_cbtevent_layout(revision, [&](auto layout) {
+            size = sizeof(typename decltype(layout)::raw_event);
+        }))
+        throw "Invalid EVTC cbtevent revision";
+
+    return size;
+}
+
+enum cm_type {
+    CM_UNKNOWN = SAP_CM_UNKNOWN,
+    CM_HEALTH_BASED = SAP_CM_HEALTH_BASED,
+    CM_NO = SAP_CM_NO,
+    CM_YES = SAP_CM_YES,
+};
+
+/*
+ * @struct encounter_info
+ * @brief Encounter data determined based on encounter ID
+ *
+ * Structure which represents encounter data based on the EVTC encounter ID.
+ * This includes the human readable name and location (wing) that the encounter
+ * belongs in.
+ *
+ * @note By convention, raid wings will have their location set as a number
+ * based on the release order of the raid wing. Fractals and other encounters
+ * will set their location based on the name of the area in game.
+ */
+struct encounter_info {
+    const char *name;
+    const char *location;
+    enum cm_type cm;
+    uint64_t health_threshold;
+};
+
+/* An entry of the built-in encounter table */
+struct encounter_entry {
+    uint16_t id;
+    struct encounter_info info;
+};
+
+/* Built-in encounters. If an id appears more than once, the first entry is
+ * used.
+ */
+static constexpr encounter_entry builtin_encounters[] = {
+    /* Raid Wing 1 */
+    {0x3C4E, {"Vale Guardian", "1", CM_NO, 0}},
+    {0x3C45, {"Gorseval", "1", CM_NO, 0}},
+    {0x3C0F, {"Sabetha", "1", CM_NO, 0}},
+    /* Raid Wing 2 */
+    {0x3EFB, {"Slothasor", "2", CM_NO, 0}},
+    {0x3ED8, {"Bandit Trio", "2", CM_NO, 0}},
+    {0x3F09, {"Bandit Trio", "2", CM_NO, 0}},
+    {0x3EFD, {"Bandit Trio", "2", CM_NO, 0}},
+    {0x3EF3, {"Matthias", "2", CM_NO, 0}},
+    /* Raid Wing 3 */
+    {0x3F6B, {"Keep Construct", "3", CM_NO, 0}},
+    {0x3F77, {"Twisted Castle", "3", CM_NO, 0}},
+    {0x3F76, {"Xera", "3", CM_NO, 0}},
+    {0x3F9E, {"Xera", "3", CM_NO, 0}},
+    /* Raid Wing 4 */
+    {0x432A, {"Cairn", "4", CM_UNKNOWN, 0}},
+    {0x4314, {"Mursaat Overseer", "4", CM_HEALTH_BASED, 25000000}},
+    {0x4324, {"Samarog", "4", CM_HEALTH_BASED, 35000000}},
+    {0x4302, {"Deimos", "4", CM_HEALTH_BASED, 40000000}},
+    /* Raid Wing 5 */
+    {0x4d37, {"Soulless Horror", "5", CM_UNKNOWN, 0}},
+    {0x4d74, {"Rainbow Road", "5", CM_NO, 0}},
+    {0x4ceb, {"Broken King", "5", CM_NO, 0}},
+    {0x4c50, {"Soul Eater", "5", CM_NO, 0}},
+    {0x4cc3, {"Eye of Judgement", "5", CM_NO, 0}},
+    {0x4d84, {"Eye of Fate", "5", CM_NO, 0}},
+    {0x4bfa, {"Dhuum", "5", CM_HEALTH_BASED, 35000000}},
+    /* Raid Wing 6 */
+    {0xabc6, {"Conured Amalgamate", "6", CM_UNKNOWN, 0}},
+    {0x5271, {"Largos Twins", "6", CM_HEALTH_BASED, 18000000}},
+    {0x5261, {"Largos Twins", "6", CM_HEALTH_BASED, 18000000}},
+    {0x51c6, {"Qadim", "6", CM_HEALTH_BASED, 21000000}},
+    /* Raid Wing 7 */
+    {0x55f6, {"Cardinal Adina", "7", CM_UNKNOWN, 0}},
+    {0x55cc, {"Cardinal Sabir", "7", CM_UNKNOWN, 0}},
+    {0x55f0, {"Qadim the Peerless", "7", CM_UNKNOWN, 0}},
+    /* Winter Strike Mission */
+    {0x5355, {"Freezie", "Wintersday", CM_NO, 0}},
+    /* Fractal 99 CM */
+    {0x427d, {"MAMA", "99cm", CM_YES, 0}},
+    {0x4284, {"Siax", "99cm", CM_YES, 0}},
+    {0x4234, {"Ensolyss", "99cm", CM_YES, 0}},
+    /* Fractal 100 CM */
+    {0x44e0, {"Skorvald the Shattered", "100cm", CM_YES, 0}},
+    {0x461d, {"Artsariiv", "100cm", CM_YES, 0}},
+    {0x455f, {"Arkk", "100cm", CM_YES, 0}},
+    /* Aquatic Ruins Fractal */
+    {0x2C8A, {"Jellyfish Beast", "Aquatic Ruins", CM_NO, 0}},
+    /* Captain Mai Trin Boss */
+    {0x4263, {"Champion Inquest Technician", "Mai Trin Boss", CM_NO, 0}},
+    {0x2fea, {"Mai Trin", "Mai Trin Boss", CM_NO, 0}},
+    /* Chaos Isles Fractal */
+    {0x40E9, {"Brazen Gladiator", "Chaos Isles", CM_NO, 0}},
+    /* Cliffside Fractal */
+    {0x2C20, {"Archdiviner", "Cliffside", CM_NO, 0}},
+    /* Molten Boss */
+    {0x325E, {"Molten Effigy", "Molten Boss", CM_NO, 0}},
+    /* Nightmare */
+    {0x4268, {"MAMA", "Nightmare", CM_NO, 0}},
+    {0x4215, {"Siax the Unclean", "Nightmare", CM_NO, 0}},
+    {0x429B, {"Ensolyss", "Nightmare", CM_NO, 0}},
+    /* Shattered Observatory */
+    {0x44E0, {"Skorvald the Shattered", "Shattered Observatory", CM_NO, 0}},
+    /* Snowblind */
+    {0x2C45, {"Svanir Shaman", "Snowblind", CM_NO, 0}},
+    /* Solid Ocean */
+    {0x2BF6, {"The Jade Maw", "Solid Ocean", CM_NO, 0}},
+    /* Swampland */
+    {0x2C00, {"Mossman", "Swampland", CM_NO, 0}},
+    {0x2C01, {"Bloomhunger", "Swampland", CM_NO, 0}},
+    /* Thaumanova Reactor */
+    {0x3268, {"Subject 6", "Thaumanova", CM_NO, 0}},
+    {0x326A, {"Thaumanova Anomaly", "Thaumanova", CM_NO, 0}},
+    /* Underground Facility */
+    {0x2BE9, {"Rabsovich", "Underground Facility", CM_NO, 0}},
+    {0x2BE8, {"Rampaging Ice Elemental", "Underground Facility", CM_NO, 0}},
+    {0x2BE7, {"Dredge Powersuit", "Underground Facility", CM_NO, 0}},
+    /* Urban Battleground */
+    {0x2C9D, {"Siegemaster Dulfy", "Urban Battleground", CM_NO, 0}},
+    {0x2C90, {"Captain Ashym", "Urban Battleground", CM_NO, 0}},
+    /* Volcanic */
+    {0x2CDC, {"Grawl Shaman", "Volcanic", CM_NO, 0}},
+    {0x2CDD, {"Imbued Shaman", "Volcanic", CM_NO, 0}},
+    /* Uncategorized */
+    {0x2C41, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
+    {0x2C44, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
+    {0x2C43, {"Uncategorized Champions", "Uncategorized", CM_NO, 0}},
+    {0x2C3A, {"Old Tom", "Uncategorized", CM_NO, 0}},
+    {0x2C3D, {"Raving Asura", "Uncategorized", CM_NO, 0}},
+    {0x2C3C, {"Raving Asura", "Uncategorized", CM_NO, 0}},
+    {0x2C3E, {"Raving Asura", "Uncategorized", CM_NO, 0}},
+    {0x2C3F, {"Raving Asura", "Uncategorized", CM_NO, 0}},
+    /* Training Golems */
+    {0x3f46, {"Vital Kitty Golem (10m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f31, {"Average Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f47, {"Standard Kitty Golem (1m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f29, {"Massive Kitty Golem (10m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f4a, {"Massive Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f32, {"Massive Kitty Golem (1m HP)", "Training Golem", CM_NO, 0}},
+    {0x3f2e, {"Tough Kitty Golem", "Training Golem", CM_NO, 0}},
+    {0x3f30, {"Resistant Kitty Golem", "Training Golem", CM_NO, 0}},
+    {0x4cdc, {"Large Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
+    {0x4cbd, {"Medium Kitty Golem (4m HP)", "Training Golem", CM_NO, 0}},
+};
+
+static constexpr size_t builtin_encounter_count = sizeof(builtin_encounters) / sizeof(builtin_encounters[0]);
+
+/* Built-in encounters are found through a perfect hash of their id */
+static constexpr unsigned int encounter_hash_bits = 9;
+static constexpr size_t encounter_hash_size = 1 << encounter_hash_bits;
+static constexpr uint32_t max_encounter_hash_seeds = 1 << 16;
+
+static_assert(builtin_encounter_count < 256, "Encounter hash slots must fit in a byte");
+
+static constexpr size_t
+encounter_hash(uint16_t id, uint32_t seed)
+{
+    return (uint32_t)(id * seed) >> (32 - encounter_hash_bits);
+}
+
+/**
+ * encounter_hash_table - perfect hash table of the built-in encounters
+ * @seed: multiplier of the hash, for which no two encounter ids collide
+ * @slots: one more than the index in builtin_encounters of the encounter
+ *         hashing to each slot, or zero if none does
+ */
+struct encounter_hash_table {
+    uint32_t seed;
+    uint8_t slots[encounter_hash_size];
+};
+
+/**
+ * find_encounter_hash_seed - Find a seed hashing every encounter id apart
+ *
+ * Tries odd multipliers in turn, until one places every distinct built-in
+ * encounter id in a slot of its own. Slots are marked with the number of
+ * the attempt which used them, so they never need to be cleared. Returns
+ * zero if no seed was found.
+ */
+static constexpr uint32_t
+find_encounter_hash_seed()
+{
+    uint32_t used[encounter_hash_size] = {};
+    uint16_t ids[encounter_hash_size] = {};
+
+    for (uint32_t attempt = 1; attempt <= max_encounter_hash_seeds; attempt++) {
+        uint32_t seed = 0x9e3779b1 + 2 * (attempt - 1);
+        bool collided = false;
+
+        for (size_t i = 0; i < builtin_encounter_count && !collided; i++) {
+            uint16_t id = builtin_encounters[i].id;
+            size_t slot = encounter_hash(id, seed);
+
+            if (used[slot] != attempt) {
+                used[slot] = attempt;
+                ids[slot] = id;
+            } else if (ids[slot] != id) {
+                collided = true;
+            }
+        }
+
+        if (!collided) {
+            return seed;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * build_encounter_hash_table - Build the perfect hash of the built-in encounters
+ */
+static constexpr encounter_hash_table
+build_encounter_hash_table()
+{
+    encounter_hash_table table = {find_encounter_hash_seed(), {}};
+
+    for (size_t i = 0; i < builtin_encounter_count; i++) {
+        uint8_t& slot = table.slots[encounter_hash(builtin_encounters[i].id, table.seed)];
+
+        if (!slot) {
+            slot = i + 1;
+        }
+    }
+
+    return table;
+}
+
+static constexpr encounter_hash_table builtin_encounter_table = build_encounter_hash_table();
+
+static_assert(builtin_encounter_table.seed, "No perfect hash found for the built-in encounters");
+
+/**
+ * find_builtin_encounter - Look up a built-in encounter
+ * @id: the encounter id
+ *
+ * Returns the encounter, or nullptr if @id is not a built-in encounter.
+ */
+static const encounter_info *
+find_builtin_encounter(uint16_t id)
+{
+    uint8_t slot = builtin_encounter_table.slots[encounter_hash(id, builtin_encounter_table.seed)];
+
+    if (slot && builtin_encounters[slot - 1].id == id) {
+        return &builtin_encounters[slot - 1].info;
+    }
+
+    return nullptr;
+}
+
+/* Environment variable naming an optional encounter overlay file */
+static const char encounter_overlay_env[] = "SIMPLEARCPARSE_ENCOUNTERS";
+
+/**
+ * overlay_encounter - an encounter added or changed by the overlay file
+ * @name: the human readable name of the encounter
+ * @location: the location of the encounter
+ * @cm: the CM status of the encounter
+ * @health_threshold: the maximum health of a CM boss, for CM_HEALTH_BASED
+ */
+struct overlay_encounter {
+    string name;
+    string location;
+    enum cm_type cm;
+    uint64_t health_threshold;
+};
+
+/**
+ * encounter_overlay - the loaded encounter overlay file
+ * @encounters: the encounters of the overlay, by id
+ * @err: zero if the overlay was loaded or none is set, or why it was ignored
+ * @message: a description of @err
+ * @hash: sap_hash of the file contents the encounters were loaded from, or
+ *        zero if no overlay was loaded
+ */
+struct encounter_overlay {
+    map<uint16_t, overlay_encounter> encounters;
+    int err;
+    string message;
+    uint64_t hash;
+};
+
+/* Discard an overlay found to be invalid, keeping the reason why */
+static encounter_overlay
+invalid_overlay(encounter_overlay& overlay, size_t index, const string& message)
+{
+    overlay.encounters.clear();
+    overlay.err = -EINVAL;
+    overlay.hash = 0;
+    overlay.message = index ? "encounter " + to_string(index) + ": " + message : message;
+
+    return overlay;
+}
+
+/**
+ * parse_overlay_cm - Parse the CM status of an overlay encounter
+ * @text: "NO", "YES", "UNKNOWN" or "HEALTH_BASED"
+ * @cm: on success, the CM status
+ *
+ * Returns false if @text is not a CM status.
+ */
+static bool
+parse_overlay_cm(const string& text, enum cm_type& cm)
+{
+    if (text == "NO") {
+        cm = CM_NO;
+    } else if (text == "YES") {
+        cm = CM_YES;
+    } else if (text == "UNKNOWN") {
+        cm = CM_UNKNOWN;
+    } else if (text == "HEALTH_BASED") {
+        cm = CM_HEALTH_BASED;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * load_encounter_overlay - Load the encounter overlay file
+ *
+ * The overlay file is named by SIMPLEARCPARSE_ENCOUNTERS, and holds a JSON
+ * array of encounters, such as
+ *
+ *   [{"id": 22000, "name": "New Boss", "location": "8", "cm": "NO"}]
+ *
+ * Each encounter may add a new encounter id, or change a built-in one.
+ * Besides the "id", any of "name", "location", "cm" and "health_threshold"
+ * may be given, and the others keep their built-in values. If the file is
+ * missing or invalid, it is ignored entirely, and the reason is kept in the
+ * returned overlay for sap_encounter_overlay to report. The file is read
+ * once, and the bytes parsed are the ones hashed, so that the hash always
+ * matches the encounters in use even if the file changes afterwards.
+ */
+static encounter_overlay
+load_encounter_overlay()
+{
+    encounter_overlay overlay = {{}, 0, string(), 0};
+    const char *path = getenv(encounter_overlay_env);
+    size_t index = 0;
+
+    if (!path || !*path) {
+        return overlay;
+    }
+
+    ifstream file(path, ios::binary);
+    if (!file) {
+        overlay.err = -ENOENT;
+        overlay.message = string("cannot open ") + path;
+        return overlay;
+    }
+
+    string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    overlay.hash = sap_hash(SAP_HASH_INIT, contents.data(), contents.size());
+
+    try {
+        nlohmann::json encounters = nlohmann::json::parse(contents);
+
+        if (!encounters.is_array()) {
+            return invalid_overlay(overlay, index, "expected an array of encounters");
+        }
+
+        for (auto& encounter : encounters) {
+            uint64_t id;
+            const encounter_info *builtin;
+
+            index++;
+
+            id = encounter.at("id").get<uint64_t>();
+            if (id > UINT16_MAX) {
+                return invalid_overlay(overlay, index, "id " + to_string(id) + " is out of range");
+            }
+
+            builtin = find_builtin_encounter(id);
+
+            overlay_encounter entry = {"Unknown encounter " + to_string(id), "Unknown",
+                                       CM_UNKNOWN, 0};
+            if (builtin) {
+                entry = {builtin->name, builtin->location, builtin->cm,
+                         builtin->health_threshold};
+            }
+
+            auto field = encounter.find("name");
+            if (field != encounter.end()) {
+                entry.name = field->get<string>();
+            }
+
+            field = encounter.find("location");
+            if (field != encounter.end()) {
+                entry.location = field->get<string>();
+            }
+
+            field = encounter.find("cm");
+            if (field != encounter.end() && !parse_overlay_cm(field->get<string>(), entry.cm)) {
+                return invalid_overlay(overlay, index, "unknown cm \"" + field->get<string>() + "\"");
+            }
+
+            field = encounter.find("health_threshold");
+            if (field != encounter.end()) {
+                entry.health_threshold = field->get<uint64_t>();
+            }
+
+            overlay.encounters[id] = entry;
+        }
+    } catch (const nlohmann::json::exception& e) {
+        return invalid_overlay(overlay, index, e.what());
+    }
+
+    return overlay;
+}
+
+/* The encounter overlay, loaded the first time it is needed */
+static const encounter_overlay&
+get_encounter_overlay()
+{
+    static const encounter_overlay overlay = load_encounter_overlay();
+
+    return overlay;
+}
+
+/**
+ * find_encounter - Look up the details of an encounter
+ * @id: the encounter id
+ * @info: on success, the details of the encounter
+ *
+ * Encounters in the overlay file take precedence over the built-in table.
+ * The overlay is only read if SIMPLEARCPARSE_ENCOUNTERS is set, the first
+ * time an encounter is looked up, and is kept for the life of the process.
+ * Returns false if the encounter is not known.
+ */
+static bool
+find_encounter(uint16_t id, encounter_info& info)
+{
+    const map<uint16_t, overlay_encounter>& overlay = get_encounter_overlay().encounters;
+    const encounter_info *builtin;
+
+    if (!overlay.empty()) {
+        auto iter = overlay.find(id);
+
+        if (iter != overlay.end()) {
+            const overlay_encounter& entry = iter->second;
+
+            info = {entry.name.c_str(), entry.location.c_str(), entry.cm,
+                    entry.health_threshold};
+            return true;
+        }
+    }
+
+    builtin = find_builtin_encounter(id);
+    if (!builtin) {
+        return false;
+    }
+
+    info = *builtin;
+    return true;
+}
+
+static const uint64_t arcdps_src_agent = 0x637261;
+
+/* is_elite value indicating a non-player object */
+static const uint32_t EVTC_AGENT_NON_PLAYER_AGENT = 0xffffffff;
+
+/* upper bits of profession indicating whether this agent is a gadget */
+static const uint32_t EVTC_AGENT_GADGET_AGENT = 0xffff0000;
+
+/* lower bits of profession indicating species id of this agent */
+static const uint32_t EVTC_AGENT_SPECIES_ID_MASK = 0x0000ffff;
+
+struct player_details {
+    /* Names of the player, referring into parsed_details.agents */
+    string_view character;
+    string_view account;
+    string_view subgroup;
+
+    /* EVTC agent identifier */
+    uint64_t addr;
+
+    /* 16-byte Guild UID */
+    struct evtc_guid guid;
+};
+
+/**
+ * agent_index - map agent addresses to dense agent slots
+ *
+ * Every distinct agent address in the agent table is given a slot, from
+ * zero up to the number of agents, so that data kept for each agent can be
+ * stored in plain arrays indexed by slot. Addresses are found in an open
+ * addressing hash table with linear probing, sized to stay at most half
+ * full, so the cost of a lookup does not depend on the number of agents.
+ */
+class agent_index
+{
+private:
+    struct entry {
+        uint64_t addr;
+        uint32_t slot;
+    };
+
+    arena_vector<entry> entries;
+    unsigned int shift;
+    uint32_t count;
+
+    size_t bucket(uint64_t addr) const
+    {
+        /* Fibonacci hashing spreads the low bits of the address */
+        return (addr * 0x9e3779b97f4a7c15ULL) >> shift;
+    }
+public:
+    static const uint32_t no_slot = UINT32_MAX;
+
+    agent_index(uint32_t max_agents, parse_arena *arena);
+
+    uint32_t add(uint64_t addr);
+    uint32_t find(uint64_t addr) const;
+
+    uint32_t size() const
+    {
+        return count;
+    }
+};
+
+/**
+ * agent_index - Construct an empty agent index
+ * @max_agents: the most agents that will be added
+ * @arena: the arena to allocate the hash table from
+ */
+agent_index::agent_index(uint32_t max_agents, parse_arena *arena)
+    : entries(arena_allocator<entry>(arena)), shift(63), count(0)
+{
+    size_t buckets = 2;
+
+    while (buckets < (size_t)max_agents * 2) {
+        buckets *= 2;
+        shift--;
+    }
+
+    entries.assign(buckets, entry{0, no_slot});
+}
+
+/**
+ * add - Give an agent address a slot
+ * @addr: the agent address
+ *
+ * Returns the slot of @addr, which is the next unused slot unless @addr
+ * was already added.
+ */
+uint32_t
+agent_index::add(uint64_t addr)
+{
+    size_t mask = entries.size() - 1;
+    size_t i;
+
+    for (i = bucket(addr); entries[i].slot != no_slot; i = (i + 1) & mask) {
+        if (entries[i].addr == addr) {
+            return entries[i].slot;
+        }
+    }
+
+    entries[i].addr = addr;
+    entries[i].slot = count;
+
+    return count++;
+}
+
+/**
+ * find - Look up the slot of an agent address
+ * @addr: the agent address
+ *
+ * Returns the slot of @addr, or no_slot if it is not a known agent.
+ */
+uint32_t
+agent_index::find(uint64_t addr) const
+{
+    size_t mask = entries.size() - 1;
+    size_t i;
+
+    for (i = bucket(addr); entries[i].slot != no_slot; i = (i + 1) & mask) {
+        if (entries[i].addr == addr) {
+            return entries[i].slot;
+        }
+    }
+
+    return no_slot;
+}
+
+/**
+ * instid_interval - the time during which an agent held an instance id
+ * @start: local time of the first event using the instid
+ * @end: local time of the last event using the instid
+ * @slot: the agent slot, from agent_index
+ * @instid: the instance id
+ * @split: true if the interval began with a SPAWN event or a change of
+ *         instid, rather than the agent simply being seen again
+ * @despawned: true if the interval ended with a DESPAWN event
+ */
+struct instid_interval {
+    uint64_t start;
+    uint64_t end;
+    uint32_t slot;
+    uint16_t instid;
+    bool split;
+    bool despawned;
+};
+
+/* No instid interval is being extended */
+static const uint32_t no_instid_interval = UINT32_MAX;
+
+/**
+ * instid_index - resolve instance ids to agents at a point in time
+ *
+ * The game reuses instance ids as agents spawn and despawn, so an instid
+ * only identifies an agent together with the time it was used. The index
+ * holds every interval during which an agent held an instid, sorted by
+ * instid and then start time, so that resolving an instid is a binary
+ * search.
+ */
+class instid_index
+{
+private:
+    arena_vector<instid_interval> intervals;
+public:
+    explicit instid_index(arena_vector<instid_interval> intervals);
+
+    uint32_t find(uint16_t instid, uint64_t time) const;
+};
+
+/**
+ * instid_index - Construct an index of instid intervals
+ * @intervals: every interval found while scanning the combat events
+ */
+instid_index::instid_index(arena_vector<instid_interval> intervals)
+    : intervals(move(intervals))
+{
+    sort(this->intervals.begin(), this->intervals.end(),
+         [](const instid_interval& a, const instid_interval& b) {
+             return a.instid != b.instid ? a.instid < b.instid : a.start < b.start;
+         });
+}
+
+/**
+ * find - Look up which agent held an instid at a given time
+ * @instid: the instance id
+ * @time: local time of the event using @instid
+ *
+ * Returns the slot of the agent which most recently took @instid at or
+ * before @time, or agent_index::no_slot if no agent held @instid then.
+ */
+uint32_t
+instid_index::find(uint16_t instid, uint64_t time) const
+{
+    auto it = upper_bound(intervals.begin(), intervals.end(), make_pair(instid, time),
+                          [](const pair<uint16_t, uint64_t>& key, const instid_interval& interval) {
+                              return key.first != interval.instid ? key.first < interval.instid
+                                                                  : key.second < interval.start;
+                          });
+
+    if (it == intervals.begin()) {
+        return agent_index::no_slot;
+    }
+
+    --it;
+    if (it->instid != instid || time > it->end) {
+        return agent_index::no_slot;
+    }
+
+    return it->slot;
+}
+
+/**
+ * damage_totals - damage dealt by a single agent
+ * @boss_direct: direct damage to the boss
+ * @boss_condition: condition damage to the boss
+ * @all_direct: direct damage to every foe, including the boss
+ * @all_condition: condition damage to every foe, including the boss
+ */
+struct damage_totals {
+    uint64_t boss_direct;
+    uint64_t boss_condition;
+    uint64_t all_direct;
+    uint64_t all_condition;
+};
+
+/**
+ * damage_master - the master of an agent which dealt damage as a minion
+ * @instid: the src_master_instid of the first damage event of the agent,
+ *          or zero if it had no master
+ * @time: local time of that event, at which @instid is resolved
+ *
+ * A minion keeps the same master for as long as it exists, so the master
+ * is resolved once, after the instid index has been built.
+ */
+struct damage_master {
+    uint16_t instid;
+    uint64_t time;
+};
+
+/**
+ * boon_info - a boon whose uptime is tracked
+ * @id: the skill id of the buff
+ * @max_stacks: the most stacks which count towards the stack-weighted
+ *              average. Boons stacking in duration only count one stack.
+ */
+struct boon_info {
+    uint32_t id;
+    uint16_t max_stacks;
+};
+
+/* Tracked boons, in the order of enum sap_boon */
+static const boon_info boons[] = {
+    {740, 25},      /* Might */
+    {725, 1},       /* Fury */
+    {1187, 1},      /* Quickness */
+    {30328, 1},     /* Alacrity */
+    {717, 1},       /* Protection */
+    {718, 1},       /* Regeneration */
+    {726, 1},       /* Vigor */
+    {743, 1},       /* Aegis */
+    {1122, 25},     /* Stability */
+    {719, 1},       /* Swiftness */
+    {873, 1},       /* Retaliation */
+    {26980, 1},     /* Resistance */
+};
+
+static const uint32_t boon_count = extent<decltype(boons)>::value;
+
+static_assert(boon_count == SAP_BOON_RESISTANCE + 1, "boons must match enum sap_boon");
+
+/* No buff stack follows in a list */
+static const uint32_t no_buff_stack = UINT32_MAX;
+
+/**
+ * buff_stack - an active stack of a boon stacking in intensity
+ * @expires: local time at which the stack runs out
+ * @id: the stack id, or zero if not known
+ * @next: the next stack of the same buff state, or the next free stack
+ */
+struct buff_stack {
+    uint64_t expires;
+    uint32_t id;
+    uint32_t next;
+};
+
+/**
+ * buff_state - the stacks of a boon on a player
+ * @since: local time up to which @uptime and @stack_time are accounted
+ * @uptime: time with at least one stack since the log started
+ * @stack_time: stacks, up to the maximum of the boon, integrated over time
+ * @expires: for boons stacking in duration, local time at which the last
+ *           queued stack runs out
+ * @first: for boons stacking in intensity, the first active stack, linked
+ *         through buff_stack.next
+ * @stacks: the number of stacks in the @first list
+ *
+ * Stacks of a boon stacking in duration tick down one at a time, so only
+ * the time at which all of them run out matters. Stacks of a boon stacking
+ * in intensity all tick down at once, and each runs out on its own.
+ */
+struct buff_state {
+    uint64_t since;
+    uint64_t uptime;
+    uint64_t stack_time;
+    uint64_t expires;
+    uint32_t first;
+    uint32_t stacks;
+};
+
+/**
+ * buff_totals - the accounted time of a buff state at some point
+ * @uptime: time with at least one stack
+ * @stack_time: stacks integrated over time
+ */
+struct buff_totals {
+    uint64_t uptime;
+    uint64_t stack_time;
+};
+
+/**
+ * health_sample - the health of the boss at some point
+ * @time: local time of the CBTS_HEALTHUPDATE event
+ * @health: health in hundredths of a percent, from 0 to 10000
+ */
+struct health_sample {
+    uint64_t time;
+    uint32_t health;
+};
+
+/* Kinds of boss_activity changes */
+enum boss_activity_kind : uint8_t {
+    BOSS_INVULNERABLE,  /* the boss gained or lost the Determined buff */
+    BOSS_TARGETABLE,    /* an agent became targetable or untargetable */
+};
+
+/**
+ * boss_activity - a change which may start or end a phase of the boss
+ * @time: local time of the change
+ * @agent: the agent whose state changed
+ * @kind: the kind of change
+ * @state: the new state, true if invulnerable or targetable
+ *
+ * Targetability is recorded for every agent, as which agents stand for
+ * the boss is only known once the attack targets have been seen.
+ */
+struct boss_activity {
+    uint64_t time;
+    uint64_t agent;
+    boss_activity_kind kind;
+    bool state;
+};
+
+/**
+ * attack_target - an attack target and the agent it belongs to
+ * @target: the attack target agent
+ * @parent: the agent it is the attack target of
+ */
+struct attack_target {
+    uint64_t target;
+    uint64_t parent;
+};
+
+/**
+ * boss_phase - a span of time during which the boss could be damaged
+ * @start: local time the phase started
+ * @end: local time the phase ended
+ * @start_health: health of the boss at @start, in hundredths of a percent
+ * @end_health: health of the boss at @end, in hundredths of a percent
+ */
+struct boss_phase {
+    uint64_t start;
+    uint64_t end;
+    uint32_t start_health;
+    uint32_t end_health;
+};
+
+/* Buff which bosses gain while they cannot be damaged between phases */
+static const uint32_t determined_skill_id = 762;
+
+/* Kinds of movement tracks, in the order of their statechanges */
+enum movement_kind : uint8_t {
+    MOVEMENT_POSITION,
+    MOVEMENT_VELOCITY,
+    MOVEMENT_FACING,
+};
+
+static const uint32_t movement_kinds = MOVEMENT_FACING + 1;
+
+static_assert(CBTS_VELOCITY == CBTS_POSITION + MOVEMENT_VELOCITY &&
+              CBTS_FACING == CBTS_POSITION + MOVEMENT_FACING,
+              "movement kinds must follow the order of their statechanges");
+
+/* Coordinates of each kind of movement, and the steps per game unit they
+ * are quantized to. Positions are in inches, so a tenth of an inch is far
+ * finer than anything visible, while facings are unit vectors.
+ */
+static const uint8_t movement_components[movement_kinds] = {3, 3, 2};
+static const float movement_scale[movement_kinds] = {10.0f, 10.0f, 1000.0f};
+
+/* Samples from one keyframe of a movement track to the next */
+static const uint32_t movement_block_samples = 64;
+
+/* No open block of samples for a movement track */
+static const uint32_t no_movement_block = UINT32_MAX;
+
+/**
+ * movement_point - a quantized position, velocity or facing
+ * @time: local time of the event
+ * @value: the quantized coordinates
+ */
+struct movement_point {
+    uint64_t time;
+    int32_t value[3];
+};
+
+/**
+ * movement_open_block - samples of a movement track not yet encoded
+ * @track: the agent slot times movement_kinds, plus the movement_kind
+ * @count: the number of @points
+ * @points: the samples, in the order they were found
+ */
+struct movement_open_block {
+    uint32_t track;
+    uint32_t count;
+    movement_point points[movement_block_samples];
+};
+
+/**
+ * movement_block - an encoded block of samples of a movement track
+ * @time: local time of the first sample, which is encoded as a keyframe
+ * @offset: where the encoded samples start in parsed_details.movement_data
+ * @size: the size of the encoded samples
+ * @track: the agent slot times movement_kinds, plus the movement_kind
+ * @samples: the number of samples
+ */
+struct movement_block {
+    uint64_t time;
+    size_t offset;
+    uint32_t size;
+    uint32_t track;
+    uint32_t samples;
+};
+
+/* Bits of parsed_details.found, marking which combat event facts were seen */
+static const uint32_t FOUND_REWARD = 0x1;
+static const uint32_t FOUND_LOGSTART = 0x2;
+static const uint32_t FOUND_LOGEND = 0x4;
+static const uint32_t FOUND_BOSS_MAXHEALTH = 0x8;
+
+struct parsed_details {
+    /* Arena holding the containers of the details, or nullptr for the heap */
+    parse_arena *arena;
+
+    /* Parsing options */
+    unsigned int scan_threads;
+    uint32_t query;
+
+    /* Stop scanning combat events once one of these facts is found */
+    uint32_t stop_found;
+
+    /* Metadata */
+    uint32_t agent_count;
+    uint32_t skill_count;
+    uint32_t cbt_event_count;
+    uint64_t cbt_event_start;
+    uint32_t found;
+
+    /* Extracted data */
+    char arc_header[13];
+    uint8_t revision;
+    uint16_t boss_id;
+    struct encounter_info boss_info;
+    char unknown_boss_name[32];
+    uint64_t boss_src_agent;
+    uint64_t boss_maxhealth;
+    uint32_t server_start;
+    uint32_t server_end;
+    uint64_t precise_last_event;
+    uint64_t precise_logend_time;
+    uint64_t precise_reward_time;
+    uint64_t precise_start;
+    uint64_t precise_end;
+    bool encounter_success;
+    uint64_t agent_hash;
+
+    /* Players in the order of the agent table. Players are given the
+     * first slots of the agent index, so a player's slot is also its
+     * position in this array.
+     */
+    arena_vector<player_details> players;
+
+    /* Copy of the agent table, and the index of every agent within it,
+     * shared by every copy of the details
+     */
+    shared_ptr<const arena_vector<evtc_agent>> agents;
+    shared_ptr<const agent_index> agent_slots;
+
+    /* Instid intervals found so far while scanning the combat events, and
+     * the interval each agent slot is still extending, if any
+     */
+    arena_vector<instid_interval> instid_intervals;
+    arena_vector<uint32_t> open_instid_intervals;
+
+    /* Index of instid intervals, built once the combat events are parsed */
+    shared_ptr<const instid_index> instids;
+
+    /* Damage dealt by each agent slot, and the master of each slot which
+     * dealt damage as a minion. Once parsing is complete, the damage of
+     * minions is added to their masters, so the totals of each player
+     * include its minions.
+     */
+    arena_vector<damage_totals> damage;
+    arena_vector<damage_master> damage_masters;
+
+    /* Boon stacks of each player, boon_count states per player slot. The
+     * active stacks of every state share one pool, so memory grows with
+     * the most stacks active at once rather than with the length of the
+     * log. The totals at the last reward event are kept, as that is where
+     * a successful encounter ends, and once parsing is complete hold the
+     * totals of each state at the end of the encounter.
+     */
+    arena_vector<buff_state> buffs;
+    arena_vector<buff_stack> buff_stacks;
+    uint32_t free_buff_stacks;
+    arena_vector<buff_totals> buff_totals_at_end;
+    uint64_t buff_totals_time;
+
+    /* Health of the boss each time it changed, the changes which may
+     * start or end a phase, and the attack targets seen so far. Once
+     * parsing is complete, the phases are found from the changes.
+     */
+    arena_vector<health_sample> health;
+    arena_vector<boss_activity> activity;
+    arena_vector<attack_target> attack_targets;
+    arena_vector<boss_phase> phases;
+
+    /* Movement of every agent. Each track collects its samples into an
+     * open block, which is encoded as soon as it is full, while it is still
+     * in the cache. Once parsing is complete, the encoded blocks of each
+     * track are gathered into the movement tracks, along with the address
+     * of the agent of each slot. The encoded blocks are then freed, so
+     * they are held on the heap rather than in the arena.
+     */
+    arena_vector<uint64_t> movement_agents;
+    arena_vector<uint32_t> movement_open;
+    arena_vector<movement_open_block> movement_open_blocks;
+    arena_vector<movement_block> movement_blocks;
+    arena_vector<uint8_t> movement_data;
+    arena_vector<uint8_t> movement_tracks;
+};
+
+/**
+ * parse_header: extract details from the EVTC header line
+ * @details: data structure to hold extracted data
+ * @file: the mapped file to read from
+ *
+ * Parse the @file for an EVTC header, and validate that it is, then
+ * extract the file version, encounter id, and boss name into the
+ * @details structure. Otherwise, return a negative error code.
+ */
+static int
+parse_header(parsed_details& details, const evtc_file_view& file)
+{
+    const char *raw_header;
+
+    /* The evtc file has a 16 byte header. It consists of
+     * 4 bytes containing "EVTC", followed by 8 bytes
+     * with a YYYYMMDD representing the arcdps build,
+     * followed by a NUL byte, followed by 2 bytes holding
+     * the area encounter id, followed by another NUL
+     */
+    raw_header = file.at(OFFSET_EVTC_HEADER, EVTC_HEADER_SIZE);
+    if (!raw_header) {
+        return -EINVAL;
+    }
+
+    /* Make sure we have the 4 bytes of EVTC */
+    if (strncmp(raw_header, "EVTC", 4)) {
+        return -EINVAL;
+    }
+
+    /* Make sure the version is a number */
+    for (int i = 4; i < 12; i++) {
+        if (!isdigit(raw_header[i])) {
+            return -EINVAL;
+        }
+    }
+
+    /* Extract the main EVTC header string */
+    memcpy(details.arc_header, raw_header, 12);
+    details.arc_header[12] = '\0';
+
+    /* Extract the cbtevent revision */
+    details.revision = raw_header[12];
+
+    /* Only revisions with a known event layout are supported */
+    if (details.revision > max_cbtevent_revision) {
+        return -EINVAL;
+    }
+
+    /* Make sure there is a NUL in the byte following the area id */
+    if (raw_header[15] != '\0') {
+        return -EINVAL;
+    }
+
+    /* extract the area id */
+    memcpy(&details.boss_id, &raw_header[13], sizeof(uint16_t));
+    if (!find_encounter(details.boss_id, details.boss_info)) {
+        snprintf(details.unknown_boss_name, sizeof(details.unknown_boss_name),
+                 "Unknown encounter %u", details.boss_id);
+        details.boss_info.name = details.unknown_boss_name;
+        details.boss_info.location = "Unknown";
+        details.boss_info.cm = CM_UNKNOWN;
+        details.boss_info.health_threshold = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * parse_agent_count: extract the agent count from the file
+ * @details: structure to hold extracted data and metadata
+ * @file: the mapped file to scan from
+ *
+ * Reads the count of the number of agent objects stored in the file, and
+ * makes sure that the file is large enough to hold all of them. Assumes the
+ * file has already been validated by parse_header. Returns -EINVAL if the
+ * file is truncated.
+ */
+static int
+parse_agent_count(parsed_details& details, const evtc_file_view& file)
+{
+    const char *raw_count = file.at(OFFSET_EVTC_AGENT_COUNT, EVTC_AGENT_COUNT_SIZE);
+
+    if (!raw_count) {
+        return -EINVAL;
+    }
+
+    memcpy(&details.agent_count, raw_count, sizeof(uint32_t));
+
+    if (!file.at(OFFSET_EVTC_FIRST_AGENT, (uint64_t)sizeof(evtc_agent) * details.agent_count)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * hash_agent_table: hash the header and agent table of the file
+ * @details: structure to hold extracted data and metadata
+ * @file: the mapped file to read from
+ *
+ * The hash identifies the log without reading its combat events. Assumes
+ * that parse_agent_count has already verified that every agent is
+ * available in the file.
+ */
+static void
+hash_agent_table(parsed_details& details, const evtc_file_view& file)
+{
+    uint64_t len = OFFSET_EVTC_FIRST_AGENT + (uint64_t)sizeof(evtc_agent) * details.agent_count;
+
+    details.agent_hash = sap_hash(SAP_HASH_INIT, file.at(OFFSET_EVTC_HEADER, len), len);
+}
+
+/* Kinds of agent found in the agent table */
+enum agent_kind {
+    AGENT_PLAYER,
+    AGENT_NPC,
+    AGENT_GADGET,
+};
+
+/**
+ * classify_agent: determine what kind of agent an agent entry describes
+ * @agent: the agent entry to classify
+ */
+static enum agent_kind
+classify_agent(const evtc_agent& agent)
+{
+    if (agent.is_elite != EVTC_AGENT_NON_PLAYER_AGENT) {
+        return AGENT_PLAYER;
+    }
+
+    if ((agent.prof & EVTC_AGENT_GADGET_AGENT) == EVTC_AGENT_GADGET_AGENT) {
+        return AGENT_GADGET;
+    }
+
+    return AGENT_NPC;
+}
+
+/**
+ * copy_agent_table: copy the whole agent table out of the file
+ * @details: data structure to hold parsed EVTC data
+ * @table: the agent table within the file
+ *
+ * The agent table is copied with a single copy into @details.agents, so
+ * that player names can be referred to after the file has been closed.
+ * Every name is followed by padding, which is cleared in the copy so that
+ * a name filling the whole name field is still NUL terminated.
+ */
+static void
+copy_agent_table(parsed_details& details, const evtc_agent *table)
+{
+    arena_allocator<evtc_agent> alloc(details.arena);
+    auto agents = allocate_shared<arena_vector<evtc_agent>>(alloc, table,
+                                                            table + details.agent_count, alloc);
+
+    for (auto& agent : *agents) {
+        agent.pad[0] = '\0';
+    }
+
+    details.agents = move(agents);
+}
+
+/**
+ * parse_player_agent: parse player data out of an agent data structure
+ * @details: data structure to hold parsed EVTC data
+ * @index: the agent index being built
+ * @agent: the player agent, within @details.agents
+ *
+ * Gives the player the next slot of @index, and stores the player data at
+ * that position of @details.players. The names of the player refer
+ * directly to the name of @agent, rather than being copied. An agent
+ * address which appears more than once keeps its first slot, but the
+ * data of its last entry.
+ */
+static void
+parse_player_agent(parsed_details& details, agent_index& index, const evtc_agent& agent)
+{
+    player_details player = {};
+    const char *name, *name_end;
+    uint32_t slot;
+
+    player.addr = agent.addr;
+
+    /* The EVTC format stores the name as a sequence of 3 NUL
+     * terminated UTF-8 strings. First, the character name,
+     * then the account name, and finally the subgroup name.
+     * We're mainly interested in the account name...
+     */
+    name = agent.name;
+    name_end = name + sizeof(agent.name);
+    player.character = string_view(name, strnlen(name, name_end - name));
+    name = min(name + player.character.size() + 1, name_end);
+    player.account = string_view(name, strnlen(name, name_end - name));
+    name = min(name + player.account.size() + 1, name_end);
+    player.subgroup = string_view(name, strnlen(name, name_end - name));
+
+    /* The file seems to always store the account name with a
+     * leading ':', we we'll remove it
+     */
+    if (!player.account.empty() && player.account[0] == ':') {
+        player.account.remove_prefix(1);
+    }
+
+    slot = index.add(player.addr);
+    if (slot < details.players.size()) {
+        details.players[slot] = player;
+    } else {
+        details.players.push_back(player);
+    }
+}
+
+/**
+ * parse_agents: extract player and boss agent details
+ * @details: EVTC parsed data structure
+ * @file: the EVTC file to read
+ *
+ * Classifies every agent in a single pass over the agent table. Players
+ * are stored in @details.players when they were queried, and the first
+ * non-gadget agent with the species of the boss is taken as the boss
+ * creature. Gadgets are never of interest.
+ *
+ * The remaining agents are then added to @details.agent_slots after the
+ * players. Assumes that parse_agent_count has already verified that every
+ * agent is available in the file.
+ */
+static void
+parse_agents(parsed_details& details, const evtc_file_view& file)
+{
+    auto index = allocate_shared<agent_index>(arena_allocator<agent_index>(details.arena),
+                                              details.agent_count, details.arena);
+    const evtc_agent *table;
+    bool found_boss = false;
+    uint32_t agent;
+
+    if (!details.agent_count) {
+        details.agent_slots = move(index);
+        return;
+    }
+
+    table = (const evtc_agent *)file.at(OFFSET_EVTC_FIRST_AGENT,
+                                        (uint64_t)sizeof(evtc_agent) * details.agent_count);
+
+    /* Players refer to their names within the copy of the table */
+    if (details.query & QUERY_PLAYERS) {
+        copy_agent_table(details, table);
+        table = details.agents->data();
+    }
+
+    for (agent = 0; agent < details.agent_count; agent++) {
+        const evtc_agent& agent_details = table[agent];
+
+        switch (classify_agent(agent_details)) {
+        case AGENT_PLAYER:
+            if (details.query & QUERY_PLAYERS) {
+                parse_player_agent(details, *index, agent_details);
+            }
+            break;
+        case AGENT_NPC:
+            if (!found_boss &&
+                (agent_details.prof & EVTC_AGENT_SPECIES_ID_MASK) == details.boss_id) {
+                details.boss_src_agent = agent_details.addr;
+                found_boss = true;
+            }
+            break;
+        case AGENT_GADGET:
+            break;
+        }
+    }
+
+    for (agent = 0; agent < details.agent_count; agent++) {
+        index->add(table[agent].addr);
+    }
+
+    /* Movement tracks are identified by the address of their agent */
+    if (details.query & QUERY_MOVEMENT) {
+        details.movement_agents.assign(index->size(), 0);
+        for (agent = 0; agent < details.agent_count; agent++) {
+            details.movement_agents[index->find(table[agent].addr)] = table[agent].addr;
+        }
+        details.movement_open.assign((size_t)index->size() * movement_kinds, no_movement_block);
+    }
+
+    if (details.query & QUERY_INSTIDS) {
+        details.open_instid_intervals.assign(index->size(), no_instid_interval);
+    }
+
+    if (details.query & QUERY_DAMAGE) {
+        details.damage.assign(index->size(), damage_totals{});
+        details.damage_masters.assign(index->size(), damage_master{});
+    }
+
+    if (details.query & QUERY_BUFFS) {
+        details.buffs.assign((size_t)details.players.size() * boon_count,
+                             buff_state{0, 0, 0, 0, no_buff_stack, 0});
+        details.free_buff_stacks = no_buff_stack;
+    }
+
+    details.agent_slots = move(index);
+}
+
+/**
+ * parse_skill_count: extract the number of skills
+ * @details: the EVTC parsed data structure
+ * @file: the file to read from
+ *
+ * Extracts the skill count from the EVTC @file. Assumes that the
+ * number of agents has already been extracted, so it reads the bytes
+ * for the number of skill structures stored in the file. Returns -EINVAL
+ * if the file is truncated.
+ */
+static int
+parse_skill_count(parsed_details& details, const evtc_file_view& file)
+{
+    const char *raw_count = file.at(OFFSET_EVTC_SKILL_COUNT(details.agent_count),
+                                    EVTC_SKILL_COUNT_SIZE);
+
+    if (!raw_count) {
+        return -EINVAL;
+    }
+
+    memcpy(&details.skill_count, raw_count, sizeof(uint32_t));
+
+    return 0;
+}
+
+/**
+ * calculate_cbt_event_count: calculate number of combat events
+ * @details: the EVTC parsed data structure
+ * @file: the EVTC file to read from
+ *
+ * Unlike for agents and skills, the EVTC file format does not store
+ * the number of combat events. Instead, this must be determined based
+ * on the size of the file. It is calculated by determining the total
+ * number of bytes the combat events take up using the file size,
+ * divided by the cbtevent data structure defined by the EVTC file format.
+ *
+ * Returns -EINVAL if the file does not contain any combat events.
+ */
+static int
+calculate_cbt_event_count(parsed_details& details, const evtc_file_view& file)
+{
+    uint64_t cbtevent_length;
+
+    details.cbt_event_start = OFFSET_EVTC_FIRST_CBTEVENT(details.agent_count,
+                                                         details.skill_count);
+    if (details.cbt_event_start >= file.size()) {
+        return -EINVAL;
+    }
+
+    cbtevent_length = file.size() - details.cbt_event_start;
+
+    details.cbt_event_count = cbtevent_length / EVTC_CBTEVENT_SIZE(details.revision);
+    if (!details.cbt_event_count) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * parse_reward_event: Parser for CBTS_REWARD events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * A CBTS_REWARD event indicates that the encounter was successfully
+ * completed. This parser stores the success data in @details, and returns
+ * true.
+ */
+template <typename Layout>
+static bool
+parse_reward_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    /* A reward event indicates that the boss was killed successfully */
+    details.encounter_success = true;
+    details.precise_reward_time = event.time();
+    details.found |= FOUND_REWARD;
+    return true;
+}
+
+/**
+ * parse_logstart_event: Parser for CBTS_LOGSTART events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * Checks if the CBTS_LOGSTART event was recorded by arcdps, in which case it
+ * indicates the start time according to the server. If the event matches,
+ * this parser returns true, and stores the start time in @details unless an
+ * earlier log start event was already found. Otherwise it returns false.
+ *
+ * Only the first log start event counts, so that scans which stop as soon
+ * as it is found agree with scans of the whole log.
+ */
+template <typename Layout>
+static bool
+parse_logstart_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    if (event.src_agent() == arcdps_src_agent) {
+        /* The log start event indicates the server time when logs started */
+        if (!(details.found & FOUND_LOGSTART)) {
+            details.server_start = event.value();
+            details.precise_start = event.time();
+            details.found |= FOUND_LOGSTART;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * parse_logend_event: Parser for CBTS_LOGEND events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * Checks if the CBTS_LOGEND event was recorded by arcdps, in which case it
+ * indicates the end time according to the server. If the event matches, this
+ * parser stores the end time in @details and returns true. Otherwise it
+ * returns false.
+ */
+template <typename Layout>
+static bool
+parse_logend_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    if (event.src_agent() == arcdps_src_agent) {
+        /* The log end event indicates the server time when logs ended */
+        details.server_end = event.value();
+        details.precise_logend_time = event.time();
+        details.found |= FOUND_LOGEND;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * parse_boss_maxhealth_event: Parser for CBTS_MAXHEALTHUPDATE events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * Checks if the CBTS_MAXHEALTHUPDATE event matches the boss id we've found
+ * for the encounter. This will enable obtaining the
+ * maximum health for the boss, which is useful for determining if an encounter
+ * is a Challenge Mote variant. If the event matches, the parser stores the
+ * maximum health in the @details and returns true. Otherwise it returns false.
+ */
+template <typename Layout>
+static bool
+parse_boss_maxhealth_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    if (event.src_agent() == details.boss_src_agent) {
+        details.boss_maxhealth = event.dst_agent();
+        details.found |= FOUND_BOSS_MAXHEALTH;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * parse_guild_event: Parser for CBTS_GUILD events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * If the src_agent of the CBTS_GUILD event matches one of the player agent
+ * ids, store the 16-byte guid for that player.
+ *
+ * Always returns true.
+ */
+template <typename Layout>
+static bool
+parse_guild_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    uint32_t slot;
+
+    if (!details.agent_slots) {
+        return true;
+    }
+
+    slot = details.agent_slots->find(event.src_agent());
+    if (slot < details.players.size()) {
+        details.players[slot].guid = event.guid();
+    }
+
+    return true;
+}
+
+/**
+ * parse_boss_health_event: Parser for CBTS_HEALTHUPDATE events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * If the health of the boss is queried and the CBTS_HEALTHUPDATE event is
+ * for the boss, adds the new health to the timeline in @details, unless it
+ * is unchanged, and returns true. Otherwise it returns false.
+ */
+template <typename Layout>
+static bool
+parse_boss_health_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    uint32_t health;
+
+    if (!(details.query & QUERY_HEALTH) || event.src_agent() != details.boss_src_agent) {
+        return false;
+    }
+
+    health = min<uint64_t>(event.dst_agent(), 10000);
+    if (details.health.empty() || details.health.back().health != health) {
+        details.health.push_back({event.time(), health});
+    }
+
+    return true;
+}
+
+/**
+ * add_attack_target - remember the agent an attack target belongs to
+ * @details: structure holding the attack targets seen so far
+ * @target: the attack target agent
+ * @parent: the agent it is the attack target of
+ */
+static void
+add_attack_target(parsed_details& details, uint64_t target, uint64_t parent)
+{
+    for (auto& known : details.attack_targets) {
+        if (known.target == target && known.parent == parent) {
+            return;
+        }
+    }
+
+    details.attack_targets.push_back({target, parent});
+}
+
+/**
+ * parse_attack_target_event: Parser for CBTS_ATTACKTARGET events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * Bosses may be targeted through separate attack target agents, whose
+ * targetability stands for that of the boss. If the health of the boss is
+ * queried, remembers which agent the attack target belongs to.
+ *
+ * Always returns true.
+ */
+template <typename Layout>
+static bool
+parse_attack_target_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    if (details.query & QUERY_HEALTH) {
+        add_attack_target(details, event.src_agent(), event.dst_agent());
+    }
+
+    return true;
+}
+
+/**
+ * parse_targetable_event: Parser for CBTS_TARGETABLE events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * If the health of the boss is queried, records the new targetable state
+ * of the source agent. Whether the agent is the boss or one of its attack
+ * targets is only checked once parsing is complete.
+ *
+ * Always returns true.
+ */
+template <typename Layout>
+static bool
+parse_targetable_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    if (details.query & QUERY_HEALTH) {
+        details.activity.push_back({event.time(), event.src_agent(), BOSS_TARGETABLE,
+                                    event.dst_agent() != 0});
+    }
+
+    return true;
+}
+
+/**
+ * quantize_movement - Convert a coordinate to a whole number of steps
+ * @value: the coordinate
+ * @scale: the steps per game unit
+ *
+ * Coordinates too large to quantize are clamped, and NaN becomes zero.
+ */
+static int32_t
+quantize_movement(float value, float scale)
+{
+    float steps = value * scale;
+
+    if (std::isnan(steps)) {
+        return 0;
+    }
+
+    /* The largest floats which still fit in an int32_t */
+    return lrintf(min(max(steps, -2147483520.0f), 2147483520.0f));
+}
+
+/**
+ * put_zigzag - Store a signed number as a zigzag encoded varint
+ * @pos: where to store the number, with room for at least 10 bytes
+ * @value: the number to store
+ *
+ * Small numbers of either sign take a single byte, seven bits per byte.
+ * Returns a pointer just past the stored number.
+ */
+static uint8_t *
+put_zigzag(uint8_t *pos, int64_t value)
+{
+    uint64_t bits = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+    while (bits >= 0x80) {
+        *pos++ = (uint8_t)bits | 0x80;
+        bits >>= 7;
+    }
+    *pos++ = (uint8_t)bits;
+
+    return pos;
+}
+
+/* Most bytes a sample can take: a time change, and three coordinate
+ * changes, each of which needs at most 33 bits
+ */
+static const size_t movement_max_sample_size = 10 + 3 * 5;
+
+/**
+ * encode_movement_block - Encode the open block of samples of a track
+ * @details: structure holding the encoded blocks
+ * @block: the open block, which is emptied
+ *
+ * The first sample is a keyframe holding each coordinate, and every other
+ * sample holds its change in time and coordinates from the one before.
+ */
+static void
+encode_movement_block(parsed_details& details, movement_open_block& block)
+{
+    const uint8_t components = movement_components[block.track % movement_kinds];
+    uint8_t encoded[movement_block_samples * movement_max_sample_size];
+    arena_vector<uint8_t>& data = details.movement_data;
+    uint8_t *pos = encoded;
+    uint32_t i, c;
+
+    if (!block.count) {
+        return;
+    }
+
+    for (c = 0; c < components; c++) {
+        pos = put_zigzag(pos, block.points[0].value[c]);
+    }
+
+    for (i = 1; i < block.count; i++) {
+        const movement_point& point = block.points[i];
+        const movement_point& previous = block.points[i - 1];
+
+        pos = put_zigzag(pos, (int64_t)(point.time - previous.time));
+        for (c = 0; c < components; c++) {
+            pos = put_zigzag(pos, (int64_t)point.value[c] - previous.value[c]);
+        }
+    }
+
+    details.movement_blocks.push_back({block.points[0].time, data.size(),
+                                       (uint32_t)(pos - encoded), block.track, block.count});
+    data.insert(data.end(), encoded, pos);
+    block.count = 0;
+}
+
+/**
+ * parse_movement_event: Parser for CBTS_POSITION, VELOCITY and FACING events
+ * @details: structure to hold parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * If movement is queried, quantizes the coordinates of the event and adds
+ * them to the open block of the movement track of the source agent.
+ *
+ * Always returns true.
+ */
+template <typename Layout>
+static bool
+parse_movement_event(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    uint8_t kind = event.is_statechange() - CBTS_POSITION;
+    float coordinates[3];
+    uint32_t slot, track, i;
+
+    if (!(details.query & QUERY_MOVEMENT) || !details.agent_slots) {
+        return true;
+    }
+
+    slot = details.agent_slots->find(event.src_agent());
+    if (slot == agent_index::no_slot) {
+        return true;
+    }
+
+    /* Tracks are given an open block the first time they move */
+    track = slot * movement_kinds + kind;
+    if (details.movement_open[track] == no_movement_block) {
+        details.movement_open[track] = details.movement_open_blocks.size();
+        details.movement_open_blocks.emplace_back();
+        details.movement_open_blocks.back().track = track;
+    }
+
+    movement_open_block& block = details.movement_open_blocks[details.movement_open[track]];
+    movement_point& point = block.points[block.count];
+
+    event.coordinates(coordinates);
+
+    point.time = event.time();
+    for (i = 0; i < 3; i++) {
+        point.value[i] = i < movement_components[kind] ?
+                         quantize_movement(coordinates[i], movement_scale[kind]) : 0;
+    }
+
+    if (++block.count == movement_block_samples) {
+        encode_movement_block(details, block);
+    }
+
+    return true;
+}
+
+/**
+ * eventparser: typedef for combat event parsers
+ * @details: the structure storing parsed EVTC data
+ * @event: the combat event to parse
+ *
+ * A parser is only called for events with the statechange it was registered
+ * for, so it does not need to check the statechange again. It is expected
+ * to determine if this @event matches, and if so extract data into the
+ * @details structure. Returning true indicates that the event matched, and
+ * stops any later parsers for the same statechange from seeing it.
+ * Returning false indicates that the event did not match this parser.
+ */
+template <typename Layout>
+using eventparser = bool (*)(parsed_details& details, evtc_cbtevent<Layout>& event);
+
+/**
+ * eventparser_registration: a combat event parser and the events it handles
+ * @statechange: the cbtstatechange value of events to parse. Events which
+ *               are not state changes, such as damage and buff events,
+ *               are registered with CBTS_NONE.
+ * @parser: the parser function
+ */
+template <typename Layout>
+struct eventparser_registration {
+    uint8_t statechange;
+    eventparser<Layout> parser;
+};
+
+/* List of all current combat event parsers */
+template <typename Layout>
+static const eventparser_registration<Layout> parsers[] = {
+    {CBTS_REWARD, parse_reward_event<Layout>},
+    {CBTS_LOGSTART, parse_logstart_event<Layout>},
+    {CBTS_LOGEND, parse_logend_event<Layout>},
+    {CBTS_MAXHEALTHUPDATE, parse_boss_maxhealth_event<Layout>},
+    {CBTS_GUILD, parse_guild_event<Layout>},
+    {CBTS_HEALTHUPDATE, parse_boss_health_event<Layout>},
+    {CBTS_ATTACKTARGET, parse_attack_target_event<Layout>},
+    {CBTS_TARGETABLE, parse_targetable_event<Layout>},
+    {CBTS_POSITION, parse_movement_event<Layout>},
+    {CBTS_VELOCITY, parse_movement_event<Layout>},
+    {CBTS_FACING, parse_movement_event<Layout>},
+};
+
+/**
+ * eventparser_table: combat event parsers indexed by statechange
+ *
+ * Built once from the parsers[] registrations. The parsers for each
+ * statechange value are stored contiguously in registration order, so
+ * routing an event costs a single table lookup no matter how many parsers
+ * exist, and events which no parser is interested in are skipped
+ * immediately.
+ */
+template <typename Layout>
+class eventparser_table
+{
+private:
+    vector<eventparser<Layout>> handlers;
+    /* parsers for statechange sc are handlers[start[sc]] to handlers[start[sc + 1]] */
+    uint16_t start[257];
+
+    eventparser_table();
+public:
+    static const eventparser_table& get()
+    {
+        static const eventparser_table table;
+
+        return table;
+    }
+
+    /* True if a parser must see events which are not state changes */
+    bool parses_non_statechange() const
+    {
+        return start[CBTS_NONE + 1] > start[CBTS_NONE];
+    }
+
+    /**
+     * parse - parse a single combat event
+     * @details: structure to hold parsed EVTC data
+     * @event: the combat event to parse
+     *
+     * The event is passed to each parser registered for its statechange,
+     * until one of them returns true.
+     */
+    void parse(parsed_details& details, evtc_cbtevent<Layout>& event) const
+    {
+        uint8_t statechange = event.is_statechange();
+        unsigned int i;
+
+        for (i = start[statechange]; i < start[statechange + 1]; i++) {
+            if (handlers[i](details, event))
+                break;
+        }
+    }
+};
+
+template <typename Layout>
+eventparser_table<Layout>::eventparser_table()
+{
+    uint16_t count[256] = {};
+    unsigned int i;
+
+    for (auto& reg : parsers<Layout>)
+        count[reg.statechange]++;
+
+    start[0] = 0;
+    for (i = 0; i < 256; i++)
+        start[i + 1] = start[i] + count[i];
+
+    /* Place each parser after the earlier parsers for its statechange */
+    handlers.resize(start[256]);
+    for (i = 0; i < 256; i++)
+        count[i] = start[i];
+    for (auto& reg : parsers<Layout>)
+        handlers[count[reg.statechange]++] = reg.parser;
+}
+
+/* Statechange prefilters
+ *
+ * Only a tiny fraction of the combat events in a log are state changes.
+ * Rather than materializing every event, a prefilter scans the
+ * is_statechange byte of a block of raw events and produces a bitmap of
+ * the events which are state changes. Bit (n % 64) of word (n / 64) is set
+ * if event n of the block has a non-zero is_statechange. Only those events
+ * are then handed to the parsers.
+ *
+ * Every kernel fills in all (count + 63) / 64 words of the bitmap, and
+ * must produce exactly the same bitmap as the scalar kernel.
+ */
+template <typename Layout>
+using statechange_filter = void (*)(const char *events, uint32_t count, uint64_t *bitmap);
+
+/* Number of events filtered into a single bitmap */
+static const uint32_t statechange_filter_block = 4096;
+
+/**
+ * filter_statechanges_scalar - scalar statechange prefilter
+ * @events: the raw combat events
+ * @count: number of events to scan
+ * @bitmap: bitmap of state change events to fill in
+ *
+ * Reference kernel, used when the CPU lacks any of the vector extensions,
+ * and for the events remaining after the last full vector.
+ */
+template <typename Layout>
+static void
+filter_statechanges_scalar(const char *events, uint32_t count, uint64_t *bitmap)
+{
+    const char *statechange = events + Layout::statechange_offset;
+    uint32_t event;
+
+    memset(bitmap, 0, (count + 63) / 64 * sizeof(*bitmap));
+
+    for (event = 0; event < count; event++) {
+        if (statechange[(uint64_t)event * evtc_cbtevent<Layout>::size])
+            bitmap[event / 64] |= 1ULL << (event % 64);
+    }
+}
+
+#ifdef EVTC_X86_KERNELS
+
+/* The SSE2 kernel loads the last 16 bytes of each event */
+static const uint32_t sse2_tail_offset = 48;
+
+template <typename Layout, int event>
+__attribute__((target("sse2"))) static inline __m128i
+sse2_statechange_lane(const char *events, __m128i keep)
+{
+    constexpr int byte = Layout::statechange_offset - sse2_tail_offset;
+    __m128i tail;
+
+    tail = _mm_loadu_si128((const __m128i *)(events + event * evtc_cbtevent<Layout>::size +
+                                             sse2_tail_offset));
+    tail = _mm_and_si128(tail, keep);
+
+    /* Move the statechange byte of this event into byte lane @event */
+    if constexpr (event >= byte)
+        return _mm_slli_si128(tail, event - byte);
+    else
+        return _mm_srli_si128(tail, byte - event);
+}
+
+template <typename Layout, int... events>
+__attribute__((target("sse2"))) static inline uint32_t
+sse2_statechange_mask(const char *base, __m128i keep, integer_sequence<int, events...>)
+{
+    __m128i lanes = _mm_setzero_si128();
+
+    ((lanes = _mm_or_si128(lanes, sse2_statechange_lane<Layout, events>(base, keep))), ...);
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(lanes, _mm_setzero_si128())) & 0xFFFF;
+}
+
+/**
+ * filter_statechanges_sse2 - SSE2 statechange prefilter
+ * @events: the raw combat events
+ * @count: number of events to scan
+ * @bitmap: bitmap of state change events to fill in
+ *
+ * The statechange byte of 16 events is shuffled into a single vector, by
+ * masking and byte shifting the tail of each event, and then compared
+ * against zero at once.
+ */
+template <typename Layout>
+__attribute__((target("sse2"))) static void
+filter_statechanges_sse2(const char *events, uint32_t count, uint64_t *bitmap)
+{
+    static_assert(Layout::statechange_offset >= sse2_tail_offset &&
+                  evtc_cbtevent<Layout>::size == sse2_tail_offset + 16,
+                  "statechange must be in the last 16 bytes of an event");
+
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    const __m128i keep = _mm_slli_si128(_mm_cvtsi32_si128(0xFF),
+                                        Layout::statechange_offset - sse2_tail_offset);
+    uint32_t event, full = count & ~63U;
+
+    for (event = 0; event < full; event += 64) {
+        uint64_t word = 0;
+        uint32_t part;
+
+        for (part = 0; part < 64; part += 16) {
+            word |= (uint64_t)sse2_statechange_mask<Layout>(events + (uint64_t)(event + part) * size,
+                                                            keep, make_integer_sequence<int, 16>())
+                    << part;
+        }
+
+        bitmap[event / 64] = word;
+    }
+
+    if (full < count)
+        filter_statechanges_scalar<Layout>(events + (uint64_t)full * size, count - full,
+                                           bitmap + full / 64);
+}
+
+/**
+ * filter_statechanges_avx2 - AVX2 statechange prefilter
+ * @events: the raw combat events
+ * @count: number of events to scan
+ * @bitmap: bitmap of state change events to fill in
+ *
+ * Gathers the 32-bit word holding the statechange byte of 8 events at a
+ * time, masks off the other bytes and compares against zero.
+ */
+template <typename Layout>
+__attribute__((target("avx2"))) static void
+filter_statechanges_avx2(const char *events, uint32_t count, uint64_t *bitmap)
+{
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    const uint32_t word_offset = Layout::statechange_offset & ~3U;
+    const __m256i strides = _mm256_setr_epi32(0, size, 2 * size, 3 * size,
+                                              4 * size, 5 * size, 6 * size, 7 * size);
+    const __m256i keep = _mm256_set1_epi32(0xFF << (8 * (Layout::statechange_offset & 3)));
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t event, full = count & ~63U;
+
+    for (event = 0; event < full; event += 64) {
+        const char *base = events + (uint64_t)event * size + word_offset;
+        uint64_t word = 0;
+        uint32_t part;
+
+        for (part = 0; part < 64; part += 8) {
+            __m256i words = _mm256_i32gather_epi32((const int *)(base + (uint64_t)part * size),
+                                                   strides, 1);
+            __m256i zeros = _mm256_cmpeq_epi32(_mm256_and_si256(words, keep), zero);
+            uint32_t mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(zeros)) & 0xFF;
+
+            word |= (uint64_t)mask << part;
+        }
+
+        bitmap[event / 64] = word;
+    }
+
+    if (full < count)
+        filter_statechanges_scalar<Layout>(events + (uint64_t)full * size, count - full,
+                                           bitmap + full / 64);
+}
+
+#endif /* EVTC_X86_KERNELS */
+
+/**
+ * select_statechange_filter - pick the best prefilter kernel for this CPU
+ */
+template <typename Layout>
+static statechange_filter<Layout>
+select_statechange_filter()
+{
+#ifdef EVTC_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return filter_statechanges_avx2<Layout>;
+    if (__builtin_cpu_supports("sse2"))
+        return filter_statechanges_sse2<Layout>;
+#endif
+
+    return filter_statechanges_scalar<Layout>;
+}
+
+/* The prefilter kernel for a layout, selected the first time it is needed */
+template <typename Layout>
+static statechange_filter<Layout>
+get_statechange_filter()
+{
+    static const statechange_filter<Layout> filter = select_statechange_filter<Layout>();
+
+    return filter;
+}
+
+/* Damage prefilter kernels
+ *
+ * Each kernel sets the bit of every event in a block which deals damage to
+ * a foe, either a direct physical hit or a condition damage tick. The
+ * damage is then summed by sum_damage_events, which only needs to look at
+ * the selected events. Like the statechange prefilter, every kernel fills
+ * in all (count + 63) / 64 words of the bitmap, and must produce exactly
+ * the same bitmap as the scalar kernel.
+ */
+template <typename Layout>
+using damage_filter = void (*)(const char *events, uint32_t count, uint64_t *bitmap);
+
+/**
+ * is_damage_event - check if a combat event deals damage to a foe
+ * @event: the combat event
+ *
+ * Damage events are neither state changes, skill activations nor buff
+ * removals, and hit a foe. Direct hits carry their damage in value, and
+ * only count if the hit connected. Condition ticks carry their damage in
+ * buff_dmg, and only count if the result is zero, as other results mean
+ * the tick was absorbed.
+ */
+template <typename Layout>
+static inline bool
+is_damage_event(const evtc_cbtevent<Layout>& event)
+{
+    if (event.is_statechange() || event.is_activation() || event.is_buffremove() ||
+        event.iff() != IFF_FOE) {
+        return false;
+    }
+
+    if (event.buff()) {
+        return event.result() == CBTR_NORMAL && event.buff_dmg() > 0;
+    }
+
+    switch (event.result()) {
+    case CBTR_NORMAL:
+    case CBTR_CRIT:
+    case CBTR_GLANCE:
+    case CBTR_INTERRUPT:
+    case CBTR_KILLINGBLOW:
+    case CBTR_DOWNED:
+        return (int32_t)event.value() > 0;
+    default:
+        return false;
+    }
+}
+
+/**
+ * filter_damage_scalar - scalar damage prefilter
+ * @events: the raw combat events
+ * @count: number of events to scan
+ * @bitmap: bitmap of damage events to fill in
+ *
+ * Reference kernel, used when the CPU lacks AVX2, and for the events
+ * remaining after the last full vector.
+ */
+template <typename Layout>
+static void
+filter_damage_scalar(const char *events, uint32_t count, uint64_t *bitmap)
+{
+    uint32_t event;
+
+    memset(bitmap, 0, (count + 63) / 64 * sizeof(*bitmap));
+
+    for (event = 0; event < count; event++) {
+        evtc_cbtevent<Layout> event_details(events + (uint64_t)event * evtc_cbtevent<Layout>::size);
+
+        if (is_damage_event(event_details))
+            bitmap[event / 64] |= 1ULL << (event % 64);
+    }
+}
+
+#ifdef EVTC_X86_KERNELS
+
+/* Gather one byte field of 8 events into the low byte of each 32-bit lane */
+template <uint32_t offset>
+__attribute__((target("avx2"))) static inline __m256i
+avx2_gather_byte(const char *base, __m256i strides)
+{
+    __m256i words = _mm256_i32gather_epi32((const int *)(base + (offset & ~3U)), strides, 1);
+
+    return _mm256_and_si256(_mm256_srli_epi32(words, 8 * (offset & 3)), _mm256_set1_epi32(0xFF));
+}
+
+/**
+ * filter_damage_avx2 - AVX2 damage prefilter
+ * @events: the raw combat events
+ * @count: number of events to scan
+ * @bitmap: bitmap of damage events to fill in
+ *
+ * Gathers the fields checked by is_damage_event from 8 events at a time,
+ * and evaluates the checks for all of them at once.
+ */
+template <typename Layout>
+__attribute__((target("avx2"))) static void
+filter_damage_avx2(const char *events, uint32_t count, uint64_t *bitmap)
+{
+    using raw = typename Layout::raw_event;
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    const __m256i strides = _mm256_setr_epi32(0, size, 2 * size, 3 * size,
+                                              4 * size, 5 * size, 6 * size, 7 * size);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i foe = _mm256_set1_epi32(IFF_FOE);
+    const __m256i past_glance = _mm256_set1_epi32(CBTR_GLANCE + 1);
+    const __m256i interrupt = _mm256_set1_epi32(CBTR_INTERRUPT);
+    const __m256i killingblow = _mm256_set1_epi32(CBTR_KILLINGBLOW);
+    const __m256i downed = _mm256_set1_epi32(CBTR_DOWNED);
+    uint32_t event, full = count & ~63U;
+
+    for (event = 0; event < full; event += 64) {
+        uint64_t word = 0;
+        uint32_t part;
+
+        for (part = 0; part < 64; part += 8) {
+            const char *base = events + (uint64_t)(event + part) * size;
+            __m256i statechange = avx2_gather_byte<offsetof(raw, is_statechange)>(base, strides);
+            __m256i activation = avx2_gather_byte<offsetof(raw, is_activation)>(base, strides);
+            __m256i buffremove = avx2_gather_byte<offsetof(raw, is_buffremove)>(base, strides);
+            __m256i iff = avx2_gather_byte<offsetof(raw, iff)>(base, strides);
+            __m256i buff = avx2_gather_byte<offsetof(raw, buff)>(base, strides);
+            __m256i result = avx2_gather_byte<offsetof(raw, result)>(base, strides);
+            __m256i value = _mm256_i32gather_epi32((const int *)(base + offsetof(raw, value)),
+                                                   strides, 1);
+            __m256i buff_dmg = _mm256_i32gather_epi32((const int *)(base + offsetof(raw, buff_dmg)),
+                                                      strides, 1);
+            __m256i flags, valid, no_buff, hit, direct, condition;
+            uint32_t mask;
+
+            flags = _mm256_or_si256(_mm256_or_si256(statechange, activation), buffremove);
+            valid = _mm256_and_si256(_mm256_cmpeq_epi32(flags, zero), _mm256_cmpeq_epi32(iff, foe));
+
+            /* Direct hits which connected, as in is_damage_event */
+            hit = _mm256_or_si256(_mm256_cmpgt_epi32(past_glance, result),
+                                  _mm256_cmpeq_epi32(result, interrupt));
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(result, killingblow));
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(result, downed));
+
+            no_buff = _mm256_cmpeq_epi32(buff, zero);
+            direct = _mm256_and_si256(_mm256_and_si256(no_buff, hit),
+                                      _mm256_cmpgt_epi32(value, zero));
+            condition = _mm256_andnot_si256(no_buff,
+                                            _mm256_and_si256(_mm256_cmpeq_epi32(result, zero),
+                                                             _mm256_cmpgt_epi32(buff_dmg, zero)));
+
+            mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_and_si256(valid, _mm256_or_si256(direct, condition))));
+            word |= (uint64_t)mask << part;
+        }
+
+        bitmap[event / 64] = word;
+    }
+
+    if (full < count)
+        filter_damage_scalar<Layout>(events + (uint64_t)full * size, count - full,
+                                     bitmap + full / 64);
+}
+
+#endif /* EVTC_X86_KERNELS */
+
+/**
+ * select_damage_filter - pick the best damage prefilter kernel for this CPU
+ */
+template <typename Layout>
+static damage_filter<Layout>
+select_damage_filter()
+{
+#ifdef EVTC_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return filter_damage_avx2<Layout>;
+#endif
+
+    return filter_damage_scalar<Layout>;
+}
+
+/* The damage prefilter kernel for a layout, selected the first time it is needed */
+template <typename Layout>
+static damage_filter<Layout>
+get_damage_filter()
+{
+    static const damage_filter<Layout> filter = select_damage_filter<Layout>();
+
+    return filter;
+}
+
+/* Prefilter kernel checks
+ *
+ * The vector kernels are checked against the scalar kernels on the same
+ * generated events, so that a kernel which disagrees is caught on any CPU
+ * able to run it, without relying on the test logs to hit the difference.
+ */
+
+/* Event counts to check, a full block and partial blocks of odd sizes */
+static const uint32_t kernel_check_counts[] = {statechange_filter_block, 1000, 64, 37};
+
+/* Next value of a xorshift generator, so that every run checks the same events */
+static inline uint64_t
+kernel_check_random(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return state;
+}
+
+/**
+ * make_check_events - Generate the events to check the kernels with
+ * @events: buffer to hold a full block of raw events
+ *
+ * Every byte of each event is random, except for the fields checked by the
+ * prefilters. These are drawn from small ranges around the values the
+ * prefilters look for, so that events on either side of every check are
+ * common: one event in four is a state change, the iff and result include
+ * values past the end of their enums, and damage is sometimes zero.
+ */
+template <typename Layout>
+static void
+make_check_events(char *events)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint32_t event;
+    size_t byte;
+
+    for (event = 0; event < statechange_filter_block; event++) {
+        typename Layout::raw_event raw;
+        uint8_t *bytes = (uint8_t *)&raw;
+
+        for (byte = 0; byte < sizeof(raw); byte++) {
+            bytes[byte] = (uint8_t)kernel_check_random(state);
+        }
+
+        raw.is_statechange = kernel_check_random(state) % 4 ? 0 : 1 + kernel_check_random(state) % 255;
+        raw.is_activation = kernel_check_random(state) % 8 ? 0 : 1 + kernel_check_random(state) % 5;
+        raw.is_buffremove = kernel_check_random(state) % 8 ? 0 : 1 + kernel_check_random(state) % 3;
+        raw.iff = kernel_check_random(state) % 4;
+        raw.buff = kernel_check_random(state) % 2 ? 0 : 1 + kernel_check_random(state) % 255;
+        raw.result = kernel_check_random(state) % 12;
+
+        if (!(kernel_check_random(state) % 8))
+            raw.value = 0;
+        if (!(kernel_check_random(state) % 8))
+            raw.buff_dmg = 0;
+
+        memcpy(events + (uint64_t)event * evtc_cbtevent<Layout>::size, &raw, sizeof(raw));
+    }
+}
+
+/**
+ * kernel_matches - Check a prefilter kernel against the scalar kernel
+ * @scalar: the scalar kernel
+ * @kernel: the kernel to check
+ * @events: the generated events
+ *
+ * Both bitmaps start out filled with different garbage, so that a word the
+ * kernel fails to fill in is caught as well.
+ */
+static bool
+kernel_matches(void (*scalar)(const char *, uint32_t, uint64_t *),
+               void (*kernel)(const char *, uint32_t, uint64_t *), const char *events)
+{
+    uint64_t expected[statechange_filter_block / 64];
+    uint64_t actual[statechange_filter_block / 64];
+
+    for (uint32_t count : kernel_check_counts) {
+        memset(expected, 0x5A, sizeof(expected));
+        memset(actual, 0xA5, sizeof(actual));
+
+        scalar(events, count, expected);
+        kernel(events, count, actual);
+
+        if (memcmp(expected, actual, (count + 63) / 64 * sizeof(*actual))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * check_layout_kernels - Check the prefilter kernels of a layout
+ *
+ * The events start at an odd address, as events read in place from a file
+ * need not be aligned. Returns the number of kernels checked, or -EIO if
+ * any kernel disagrees with the scalar kernel.
+ */
+template <typename Layout>
+static int
+check_layout_kernels()
+{
+    vector<char> buffer((uint64_t)statechange_filter_block * evtc_cbtevent<Layout>::size + 1);
+    char *events = buffer.data() + 1;
+    int checked = 0;
+
+    make_check_events<Layout>(events);
+
+#ifdef EVTC_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+        if (!kernel_matches(filter_statechanges_scalar<Layout>, filter_statechanges_sse2<Layout>,
+                            events)) {
+            return -EIO;
+        }
+        checked++;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        if (!kernel_matches(filter_statechanges_scalar<Layout>, filter_statechanges_avx2<Layout>,
+                            events)) {
+            return -EIO;
+        }
+        checked++;
+
+        if (!kernel_matches(filter_damage_scalar<Layout>, filter_damage_avx2<Layout>, events)) {
+            return -EIO;
+        }
+        checked++;
+    }
+#endif
+
+    return checked;
+}
+
+/**
+ * sum_damage_events: add the damage of the selected events to each agent
+ * @details: structure holding the damage totals of each agent slot
+ * @events: the raw combat events
+ * @count: the number of events
+ * @bitmap: the damage events, as selected by a damage prefilter
+ *
+ * Damage is credited to the agent slot of the source agent. Consecutive
+ * hits usually come from the same source, so the slot of the previous
+ * source is reused without another lookup. Only the selection of damage
+ * events is vectorized: the sum only visits the few selected events, and
+ * scatters each one into the totals of its source slot, which vector
+ * instructions cannot do any faster.
+ */
+template <typename Layout>
+static void
+sum_damage_events(parsed_details& details, const char *events, uint32_t count,
+                  const uint64_t *bitmap)
+{
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    uint32_t slot = agent_index::no_slot;
+    uint32_t event, words, word;
+    uint64_t source = 0;
+    bool cached = false;
+
+    words = (count + 63) / 64;
+    for (word = 0; word < words; word++) {
+        uint64_t bits = bitmap[word];
+
+        while (bits) {
+            event = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            evtc_cbtevent<Layout> event_details(events + (uint64_t)event * size);
+
+            if (!cached || event_details.src_agent() != source) {
+                source = event_details.src_agent();
+                slot = details.agent_slots->find(source);
+                cached = true;
+            }
+
+            if (slot == agent_index::no_slot)
+                continue;
+
+            damage_totals& totals = details.damage[slot];
+            bool boss = event_details.dst_agent() == details.boss_src_agent;
+
+            if (event_details.buff()) {
+                totals.all_condition += event_details.buff_dmg();
+                if (boss)
+                    totals.boss_condition += event_details.buff_dmg();
+            } else {
+                totals.all_direct += event_details.value();
+                if (boss)
+                    totals.boss_direct += event_details.value();
+            }
+
+            damage_master& master = details.damage_masters[slot];
+
+            if (!master.instid && event_details.src_master_instid()) {
+                master.instid = event_details.src_master_instid();
+                master.time = event_details.time();
+            }
+        }
+    }
+}
+
+/**
+ * find_boon_state: find the state of a tracked boon on a player
+ * @details: structure holding the buff states
+ * @addr: the agent address of the player
+ * @skillid: the skill id of the buff
+ * @boon: on return, the index of the boon in boons[]
+ *
+ * Returns nullptr if the buff is not a tracked boon, or the agent is not
+ * a player.
+ */
+static buff_state *
+find_boon_state(parsed_details& details, uint64_t addr, uint32_t skillid, uint32_t& boon)
+{
+    uint32_t slot;
+
+    for (boon = 0; boon < boon_count; boon++) {
+        if (boons[boon].id == skillid)
+            break;
+    }
+    if (boon == boon_count) {
+        return nullptr;
+    }
+
+    slot = details.agent_slots->find(addr);
+    if (slot >= details.players.size()) {
+        return nullptr;
+    }
+
+    return &details.buffs[(size_t)slot * boon_count + boon];
+}
+
+/* True if the stacks of a boon count separately, rather than in duration */
+static bool
+boon_stacks_intensity(uint32_t boon)
+{
+    return boons[boon].max_stacks > 1;
+}
+
+/**
+ * unlink_buff_stack: return a stack of a buff state to the free pool
+ * @details: structure holding the pool of buff stacks
+ * @state: the buff state
+ * @link: the link pointing at the stack
+ */
+static void
+unlink_buff_stack(parsed_details& details, buff_state& state, uint32_t *link)
+{
+    uint32_t stack = *link;
+
+    *link = details.buff_stacks[stack].next;
+    details.buff_stacks[stack].next = details.free_buff_stacks;
+    details.free_buff_stacks = stack;
+    state.stacks--;
+}
+
+/**
+ * remove_buff_stack: remove a single stack from a buff state
+ * @details: structure holding the pool of buff stacks
+ * @state: the buff state
+ * @id: the stack id, or zero if not known
+ * @expires: when the removed stack would have run out
+ *
+ * Without a stack id, the stack closest to running out at @expires is
+ * removed. Removing a stack id which is not active does nothing, as it
+ * was either already removed, or was applied before the log started.
+ */
+static void
+remove_buff_stack(parsed_details& details, buff_state& state, uint32_t id, uint64_t expires)
+{
+    uint32_t *best = nullptr;
+    uint64_t best_distance = UINT64_MAX;
+    uint32_t *link;
+
+    for (link = &state.first; *link != no_buff_stack; link = &details.buff_stacks[*link].next) {
+        const buff_stack& stack = details.buff_stacks[*link];
+        uint64_t distance;
+
+        if (id) {
+            if (stack.id == id) {
+                best = link;
+                break;
+            }
+            continue;
+        }
+
+        distance = stack.expires > expires ? stack.expires - expires : expires - stack.expires;
+        if (distance < best_distance) {
+            best = link;
+            best_distance = distance;
+        }
+    }
+
+    if (best) {
+        unlink_buff_stack(details, state, best);
+    }
+}
+
+/**
+ * add_buff_stack: add a stack to a buff state
+ * @details: structure holding the pool of buff stacks
+ * @state: the buff state
+ * @id: the stack id, or zero if not known
+ * @expires: local time at which the stack runs out
+ * @max_stacks: the most stacks the boon can have
+ *
+ * A stack which is already active is refreshed rather than added twice.
+ * Once a boon has its maximum stacks, a new stack replaces the stack which
+ * would run out first, as in game.
+ */
+static void
+add_buff_stack(parsed_details& details, buff_state& state, uint32_t id, uint64_t expires,
+               uint32_t max_stacks)
+{
+    uint32_t stack;
+
+    if (id) {
+        for (stack = state.first; stack != no_buff_stack; stack = details.buff_stacks[stack].next) {
+            if (details.buff_stacks[stack].id == id) {
+                details.buff_stacks[stack].expires = expires;
+                return;
+            }
+        }
+    }
+
+    if (state.stacks >= max_stacks) {
+        remove_buff_stack(details, state, 0, 0);
+    }
+
+    if (details.free_buff_stacks != no_buff_stack) {
+        stack = details.free_buff_stacks;
+        details.free_buff_stacks = details.buff_stacks[stack].next;
+    } else {
+        stack = details.buff_stacks.size();
+        details.buff_stacks.push_back({});
+    }
+
+    details.buff_stacks[stack] = {expires, id, state.first};
+    state.first = stack;
+    state.stacks++;
+}
+
+/**
+ * expire_buff_stacks: remove the stacks of a buff state which ran out
+ * @details: structure holding the pool of buff stacks
+ * @state: the buff state
+ *
+ * Returns the time at which the next remaining stack runs out, or
+ * UINT64_MAX if no stack is left.
+ */
+static uint64_t
+expire_buff_stacks(parsed_details& details, buff_state& state)
+{
+    uint64_t next = UINT64_MAX;
+    uint32_t *link = &state.first;
+
+    while (*link != no_buff_stack) {
+        const buff_stack& stack = details.buff_stacks[*link];
+
+        if (stack.expires <= state.since) {
+            unlink_buff_stack(details, state, link);
+        } else {
+            next = min(next, stack.expires);
+            link = &details.buff_stacks[*link].next;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * advance_buff_state: account the time of a buff state up to some time
+ * @details: structure holding the pool of buff stacks
+ * @state: the buff state
+ * @boon: the index of the boon in boons[]
+ * @time: local time of the event about to change the state
+ *
+ * Time is accounted in steps, one for every stack which runs out before
+ * @time. Events are not always in exact time order, so time never goes
+ * backwards. An event earlier than the last one changes the state as of
+ * the last one.
+ */
+static void
+advance_buff_state(parsed_details& details, buff_state& state, uint32_t boon, uint64_t time)
+{
+    bool intensity = boon_stacks_intensity(boon);
+
+    while (state.since < time) {
+        uint64_t until, elapsed;
+        uint32_t stacks;
+
+        if (intensity) {
+            until = min(time, expire_buff_stacks(details, state));
+            stacks = state.stacks;
+        } else {
+            until = state.expires > state.since ? min(time, state.expires) : time;
+            stacks = state.expires > state.since;
+        }
+
+        elapsed = until - state.since;
+        if (stacks) {
+            state.uptime += elapsed;
+        }
+        state.stack_time += elapsed * min<uint32_t>(stacks, boons[boon].max_stacks);
+        state.since = until;
+    }
+
+    if (intensity) {
+        expire_buff_stacks(details, state);
+    }
+}
+
+/**
+ * apply_boon: add a stack of a boon
+ * @details: structure holding the buff states
+ * @state: the buff state
+ * @boon: the index of the boon in boons[]
+ * @time: local time of the application
+ * @duration: the duration of the new stack
+ * @id: the stack id, or zero if not known
+ */
+static void
+apply_boon(parsed_details& details, buff_state& state, uint32_t boon, uint64_t time,
+           uint32_t duration, uint32_t id)
+{
+    advance_buff_state(details, state, boon, time);
+
+    if (boon_stacks_intensity(boon)) {
+        add_buff_stack(details, state, id, state.since + duration, boons[boon].max_stacks);
+    } else {
+        state.expires = max(state.expires, state.since) + duration;
+    }
+}
+
+/**
+ * remove_boon: remove stacks of a boon
+ * @details: structure holding the buff states
+ * @state: the buff state
+ * @boon: the index of the boon in boons[]
+ * @time: local time of the removal
+ * @type: the cbtbuffremove type of the removal
+ * @remaining: the remaining duration which was removed
+ * @id: the stack id, or zero if not known
+ */
+static void
+remove_boon(parsed_details& details, buff_state& state, uint32_t boon, uint64_t time,
+            uint8_t type, uint32_t remaining, uint32_t id)
+{
+    advance_buff_state(details, state, boon, time);
+
+    if (boon_stacks_intensity(boon)) {
+        if (type == CBTB_ALL) {
+            while (state.first != no_buff_stack) {
+                unlink_buff_stack(details, state, &state.first);
+            }
+        } else {
+            remove_buff_stack(details, state, id, state.since + remaining);
+        }
+    } else if (state.expires > state.since) {
+        if (type == CBTB_ALL) {
+            state.expires = state.since;
+        } else {
+            state.expires -= min<uint64_t>(remaining, state.expires - state.since);
+        }
+    }
+}
+
+/**
+ * reset_boon_stack: reset the duration of a stack of a boon
+ * @details: structure holding the buff states
+ * @state: the buff state
+ * @boon: the index of the boon in boons[]
+ * @time: local time of the reset
+ * @duration: the duration the stack was reset to
+ * @id: the stack id
+ *
+ * The stack is added if it is not active, as it was applied before the
+ * log started.
+ */
+static void
+reset_boon_stack(parsed_details& details, buff_state& state, uint32_t boon, uint64_t time,
+                 uint32_t duration, uint32_t id)
+{
+    advance_buff_state(details, state, boon, time);
+
+    if (boon_stacks_intensity(boon)) {
+        add_buff_stack(details, state, id, state.since + duration, boons[boon].max_stacks);
+    } else {
+        state.expires = max(state.expires, state.since + duration);
+    }
+}
+
+/**
+ * restart_buff_window: start accounting boon uptime at the log start
+ * @details: structure holding the buff states
+ * @time: local time of the log start event
+ *
+ * Stacks applied before the log start, such as those reported by
+ * BUFFINITIAL events, stay active, but no time before @time is counted.
+ */
+static void
+restart_buff_window(parsed_details& details, uint64_t time)
+{
+    size_t i;
+
+    for (i = 0; i < details.buffs.size(); i++) {
+        buff_state& state = details.buffs[i];
+
+        advance_buff_state(details, state, i % boon_count, time);
+        state.uptime = 0;
+        state.stack_time = 0;
+    }
+}
+
+/**
+ * save_buff_totals: keep the accounted time of every buff state
+ * @details: structure holding the buff states
+ * @time: local time at which to save the totals
+ */
+static void
+save_buff_totals(parsed_details& details, uint64_t time)
+{
+    size_t i;
+
+    details.buff_totals_at_end.resize(details.buffs.size());
+
+    for (i = 0; i < details.buffs.size(); i++) {
+        buff_state& state = details.buffs[i];
+
+        advance_buff_state(details, state, i % boon_count, time);
+        details.buff_totals_at_end[i] = {state.uptime, state.stack_time};
+    }
+
+    details.buff_totals_time = time;
+}
+
+/**
+ * track_buffs: update the boon stacks of players from a combat event
+ * @details: structure holding the buff states
+ * @event: the combat event
+ *
+ * Buffs are applied to the destination agent, by BUFFINITIAL events for
+ * buffs active when the log started, and by buff events without damage
+ * otherwise. The duration of a stack is known when it is applied, as
+ * stacks which simply run out have no removal event. Duration lost to
+ * overstacking a boon stacking in duration is not added.
+ *
+ * Buffs are removed from the source agent. CBTB_ALL removes every stack,
+ * while CBTB_SINGLE and CBTB_MANUAL remove one. STACKRESET resets the
+ * duration of a stack of the source agent. STACKACTIVE only changes which
+ * queued stack of a boon stacking in duration is ticking down, which does
+ * not change when the boon runs out, so it is not needed.
+ */
+template <typename Layout>
+static void
+track_buffs(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    uint64_t time = event.time();
+    buff_state *state;
+    uint32_t boon, duration;
+
+    switch (event.is_statechange()) {
+    case CBTS_NONE:
+        if (!event.buff() || event.is_activation()) {
+            return;
+        }
+
+        if (event.is_buffremove()) {
+            state = find_boon_state(details, event.src_agent(), event.skillid(), boon);
+            if (state) {
+                remove_boon(details, *state, boon, time, event.is_buffremove(),
+                            max<int32_t>(event.value(), 0), event.stack_id());
+            }
+            return;
+        }
+
+        if (event.buff_dmg() || (int32_t)event.value() <= 0) {
+            return;
+        }
+        /* fall through */
+    case CBTS_BUFFINITIAL:
+        state = find_boon_state(details, event.dst_agent(), event.skillid(), boon);
+        if (state && (int32_t)event.value() > 0) {
+            duration = event.value();
+            if (!boon_stacks_intensity(boon)) {
+                duration -= min(duration, event.overstack_value());
+            }
+            apply_boon(details, *state, boon, time, duration, event.stack_id());
+        }
+        break;
+    case CBTS_STACKRESET:
+        state = find_boon_state(details, event.src_agent(), event.skillid(), boon);
+        if (state && event.stack_id() && (int32_t)event.value() > 0) {
+            reset_boon_stack(details, *state, boon, time, event.value(), event.stack_id());
+        }
+        break;
+    case CBTS_LOGSTART:
+        /* Uptime is measured from the first log start, as is the duration */
+        if (event.src_agent() == arcdps_src_agent && !(details.found & FOUND_LOGSTART)) {
+            restart_buff_window(details, time);
+        }
+        break;
+    case CBTS_REWARD:
+        save_buff_totals(details, time);
+        break;
+    }
+}
+
+/**
+ * track_boss_invulnerability: record when the boss gains or loses Determined
+ * @details: structure holding the boss activity changes
+ * @event: the combat event
+ *
+ * Bosses which do not change their targetability between phases are
+ * instead given the Determined buff. It is applied to the destination
+ * agent like any other buff, and is gone once CBTB_ALL removes the last
+ * stack from the source agent.
+ */
+template <typename Layout>
+static void
+track_boss_invulnerability(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    switch (event.is_statechange()) {
+    case CBTS_NONE:
+        if (!event.buff() || event.is_activation() || event.skillid() != determined_skill_id) {
+            return;
+        }
+
+        if (event.is_buffremove()) {
+            if (event.is_buffremove() == CBTB_ALL &&
+                event.src_agent() == details.boss_src_agent) {
+                details.activity.push_back({event.time(), event.src_agent(),
+                                            BOSS_INVULNERABLE, false});
+            }
+            return;
+        }
+
+        if (event.buff_dmg() || (int32_t)event.value() <= 0) {
+            return;
+        }
+        /* fall through */
+    case CBTS_BUFFINITIAL:
+        if (event.skillid() == determined_skill_id &&
+            event.dst_agent() == details.boss_src_agent) {
+            details.activity.push_back({event.time(), event.dst_agent(),
+                                        BOSS_INVULNERABLE, true});
+        }
+        break;
+    }
+}
+
+/**
+ * track_instid: record that an agent used an instid at some time
+ * @details: structure holding the instid intervals found so far
+ * @addr: the agent address
+ * @instid: the instance id of the agent
+ * @time: local time of the event
+ * @statechange: the statechange of the event
+ *
+ * Extends the interval the agent is currently holding @instid for. A new
+ * interval is started when the agent is first seen, when it spawns, after
+ * it has despawned, or when its instid changes.
+ */
+static void
+track_instid(parsed_details& details, uint64_t addr, uint16_t instid, uint64_t time,
+             uint8_t statechange)
+{
+    uint32_t slot = details.agent_slots->find(addr);
+    bool split = false;
+
+    if (slot == agent_index::no_slot || !instid) {
+        return;
+    }
+
+    uint32_t& open = details.open_instid_intervals[slot];
+
+    if (open != no_instid_interval &&
+        (statechange == CBTS_SPAWN || details.instid_intervals[open].instid != instid)) {
+        open = no_instid_interval;
+        split = true;
+    }
+
+    if (open == no_instid_interval) {
+        open = details.instid_intervals.size();
+        details.instid_intervals.push_back({time, time, slot, instid,
+                                            split || statechange == CBTS_SPAWN, false});
+    }
+
+    instid_interval& interval = details.instid_intervals[open];
+
+    interval.start = min(interval.start, time);
+    interval.end = max(interval.end, time);
+
+    if (statechange == CBTS_DESPAWN) {
+        interval.despawned = true;
+        open = no_instid_interval;
+    }
+}
+
+/**
+ * track_instids: record the instids used by a combat event
+ * @details: structure holding the instid intervals found so far
+ * @event: the combat event
+ *
+ * Every event names its source agent. The destination fields of state
+ * changes hold other data, so only other events name a destination agent.
+ */
+template <typename Layout>
+static void
+track_instids(parsed_details& details, evtc_cbtevent<Layout>& event)
+{
+    uint8_t statechange = event.is_statechange();
+
+    track_instid(details, event.src_agent(), event.src_instid(), event.time(), statechange);
+
+    if (statechange == CBTS_NONE) {
+        track_instid(details, event.dst_agent(), event.dst_instid(), event.time(), CBTS_NONE);
+    }
+}
+
+/**
+ * merge_instid_intervals: merge instid intervals found in a chunk of events
+ * @details: structure holding the intervals found in all earlier events
+ * @chunk: the intervals found in the following chunk of events
+ *
+ * The first interval of an agent in @chunk continues the interval the
+ * agent was holding at the end of the earlier events, unless it was split
+ * from it by a SPAWN event or a change of instid.
+ */
+static void
+merge_instid_intervals(parsed_details& details, const parsed_details& chunk)
+{
+    vector<uint32_t> merged(chunk.instid_intervals.size());
+    vector<bool> seen(chunk.open_instid_intervals.size());
+    size_t i;
+
+    for (i = 0; i < chunk.instid_intervals.size(); i++) {
+        const instid_interval& interval = chunk.instid_intervals[i];
+        uint32_t open = details.open_instid_intervals[interval.slot];
+
+        if (!seen[interval.slot] && open != no_instid_interval && !interval.split &&
+            details.instid_intervals[open].instid == interval.instid) {
+            details.instid_intervals[open].end = max(details.instid_intervals[open].end,
+                                                     interval.end);
+            details.instid_intervals[open].despawned = interval.despawned;
+            merged[i] = open;
+        } else {
+            merged[i] = details.instid_intervals.size();
+            details.instid_intervals.push_back(interval);
+        }
+
+        seen[interval.slot] = true;
+    }
+
+    for (i = 0; i < seen.size(); i++) {
+        uint32_t open = chunk.open_instid_intervals[i];
+
+        if (seen[i]) {
+            details.open_instid_intervals[i] = open == no_instid_interval ? open : merged[open];
+        }
+    }
+}
+
+/**
+ * parse_cbt_event_block: parse a block of consecutive combat events
+ * @details: structure to hold parsed EVTC data
+ * @events: the raw combat events
+ * @count: the number of events in the block
+ *
+ * The events are scanned in order. Unless a parser is registered for events
+ * which are not state changes, or instids are being tracked, only the
+ * events selected by the statechange prefilter are materialized and handed
+ * to the parsers. Tracking instids, buffs or the invulnerability of the
+ * boss also needs every event. When damage is queried, the damage events
+ * of each block are selected by the damage prefilter and summed before the
+ * block is parsed, while the block is still in the cache.
+ *
+ * Returns true if scanning stopped early because one of the facts in
+ * @details.stop_found was found.
+ */
+template <typename Layout>
+static bool
+parse_cbt_event_block(parsed_details& details, const char *events, uint32_t count)
+{
+    const statechange_filter<Layout> filter = get_statechange_filter<Layout>();
+    const damage_filter<Layout> damage = get_damage_filter<Layout>();
+    const eventparser_table<Layout>& table = eventparser_table<Layout>::get();
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    const bool every_event = table.parses_non_statechange() ||
+                             (details.query & (QUERY_INSTIDS | QUERY_BUFFS | QUERY_HEALTH));
+    uint64_t bitmap[statechange_filter_block / 64];
+    uint32_t block, event, words, word;
+
+    for (block = 0; block < count; block += statechange_filter_block) {
+        const char *block_events = events + (uint64_t)block * size;
+        uint32_t block_count = min(count - block, statechange_filter_block);
+
+        if (details.query & QUERY_DAMAGE) {
+            damage(block_events, block_count, bitmap);
+            sum_damage_events<Layout>(details, block_events, block_count, bitmap);
+        }
+
+        if (every_event) {
+            for (event = 0; event < block_count; event++) {
+                evtc_cbtevent<Layout> event_details(block_events + (uint64_t)event * size);
+
+                if (details.query & QUERY_INSTIDS)
+                    track_instids(details, event_details);
+                if (details.query & QUERY_BUFFS)
+                    track_buffs(details, event_details);
+                if (details.query & QUERY_HEALTH)
+                    track_boss_invulnerability(details, event_details);
+
+                table.parse(details, event_details);
+                if (details.found & details.stop_found)
+                    return true;
+            }
+            continue;
+        }
+
+        filter(block_events, block_count, bitmap);
+
+        words = (block_count + 63) / 64;
+        for (word = 0; word < words; word++) {
+            uint64_t bits = bitmap[word];
+
+            while (bits) {
+                event = word * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                evtc_cbtevent<Layout> event_details(block_events + (uint64_t)event * size);
+
+                table.parse(details, event_details);
+                if (details.found & details.stop_found)
+                    return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * parse_cbt_event_range: parse a range of combat events
+ * @details: structure to hold parsed EVTC data
+ * @file: the file to scan
+ * @first: the first event to parse
+ * @last: one past the last event to parse
+ *
+ * The events are scanned in order from @first to @last, stopping early if
+ * one of the facts in @details.stop_found is found.
+ */
+template <typename Layout>
+static void
+parse_cbt_event_range(parsed_details& details, const evtc_file_view& file,
+                      uint32_t first, uint32_t last)
+{
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    const char *events;
+
+    if (first >= last)
+        return;
+
+    events = file.at(details.cbt_event_start + (uint64_t)first * size,
+                     (uint64_t)(last - first) * size);
+
+    parse_cbt_event_block<Layout>(details, events, last - first);
+}
+
+/**
+ * merge_cbt_event_details: merge combat event data parsed from a chunk
+ * @details: structure holding data parsed from all earlier events
+ * @chunk: data parsed from the following chunk of events
+ *
+ * Every fact found in @chunk replaces the value found in earlier events,
+ * exactly as if the events had been parsed in a single pass. The log start
+ * is the exception, as only the first log start event counts.
+ */
+static void
+merge_cbt_event_details(parsed_details& details, const parsed_details& chunk)
+{
+    if (chunk.found & FOUND_REWARD) {
+        details.encounter_success = chunk.encounter_success;
+        details.precise_reward_time = chunk.precise_reward_time;
+    }
+
+    if ((chunk.found & FOUND_LOGSTART) && !(details.found & FOUND_LOGSTART)) {
+        details.server_start = chunk.server_start;
+        details.precise_start = chunk.precise_start;
+    }
+
+    if (chunk.found & FOUND_LOGEND) {
+        details.server_end = chunk.server_end;
+        details.precise_logend_time = chunk.precise_logend_time;
+    }
+
+    if (chunk.found & FOUND_BOSS_MAXHEALTH) {
+        details.boss_maxhealth = chunk.boss_maxhealth;
+    }
+
+    details.found |= chunk.found;
+
+    for (size_t slot = 0; slot < chunk.players.size(); slot++) {
+        if (chunk.players[slot].guid.valid) {
+            details.players[slot].guid = chunk.players[slot].guid;
+        }
+    }
+    if (details.query & QUERY_INSTIDS) {
+        merge_instid_intervals(details, chunk);
+    }
+
+    for (size_t slot = 0; slot < chunk.damage.size(); slot++) {
+        const damage_totals& totals = chunk.damage[slot];
+
+        details.damage[slot].boss_direct += totals.boss_direct;
+        details.damage[slot].boss_condition += totals.boss_condition;
+        details.damage[slot].all_direct += totals.all_direct;
+        details.damage[slot].all_condition += totals.all_condition;
+
+        if (!details.damage_masters[slot].instid) {
+            details.damage_masters[slot] = chunk.damage_masters[slot];
+        }
+    }
+
+    /* The health at the start of a chunk may not have changed since the
+     * end of the earlier events
+     */
+    if (!chunk.health.empty()) {
+        auto first = chunk.health.begin();
+
+        if (!details.health.empty() && details.health.back().health == first->health) {
+            first++;
+        }
+        details.health.insert(details.health.end(), first, chunk.health.end());
+    }
+
+    details.activity.insert(details.activity.end(), chunk.activity.begin(),
+                            chunk.activity.end());
+    for (auto& target : chunk.attack_targets) {
+        add_attack_target(details, target.target, target.parent);
+    }
+}
+
+/* Minimum number of combat events worth scanning on a separate thread */
+static const uint32_t min_events_per_scan_thread = 1 << 16;
+
+/**
+ * parse_all_cbt_events: parse all combat events
+ * @details: structure to hold parsed EVTC data
+ * @file: the file to scan
+ *
+ * Loop through the entire list of combat events, checking each combat
+ * event for information.
+ *
+ * Large logs are split into contiguous chunks which are scanned in parallel
+ * by up to @details.scan_threads threads. Each thread parses its chunk into
+ * a separate partial copy of the details, and the partial results are then
+ * merged in chunk order, so the result is identical to scanning the events
+ * in order from beginning to end. Scans which may stop early, scans
+ * tracking buffs, whose stacks depend on every earlier event, and scans
+ * extracting movement, whose blocks are encoded as soon as they fill, are
+ * always done in order on a single thread.
+ */
+template <typename Layout>
+static void
+parse_all_cbt_events(parsed_details& details, const evtc_file_view& file)
+{
+    uint32_t chunks = details.cbt_event_count / min_events_per_scan_thread;
+    vector<parsed_details> partials;
+    vector<thread> threads;
+    uint32_t chunk;
+
+    chunks = min<uint32_t>(chunks, details.scan_threads);
+
+    if (chunks <= 1 || details.stop_found || (details.query & (QUERY_BUFFS | QUERY_MOVEMENT))) {
+        parse_cbt_event_range<Layout>(details, file, 0, details.cbt_event_count);
+    } else {
+        /* Each chunk starts out knowing only the agent data */
+        parsed_details initial = details;
+
+        /* Partial details are used by other threads, so they must not
+         * allocate from the arena
+         */
+        initial.arena = nullptr;
+        initial.found = 0;
+        for (auto& player : initial.players) {
+            player.guid = {};
+        }
+
+        partials.assign(chunks, initial);
+
+        for (chunk = 0; chunk < chunks; chunk++) {
+            uint32_t first = (uint64_t)details.cbt_event_count * chunk / chunks;
+            uint32_t last = (uint64_t)details.cbt_event_count * (chunk + 1) / chunks;
+
+            threads.emplace_back(parse_cbt_event_range<Layout>, ref(partials[chunk]),
+                                 cref(file), first, last);
+        }
+
+        for (chunk = 0; chunk < chunks; chunk++) {
+            threads[chunk].join();
+            merge_cbt_event_details(details, partials[chunk]);
+        }
+    }
+
+    /* Extract the local time of the last event */
+    evtc_cbtevent<Layout> event_details(file, details.cbt_event_start,
+                                        details.cbt_event_count - 1);
+    details.precise_last_event = event_details.time();
+}
+
+/**
+ * tailparser_registration: a parser for a fact found at the end of a log
+ * @statechange: the cbtstatechange value of events to parse
+ * @found: the fact set in parsed_details.found when the parser matches
+ * @parser: the parser function
+ */
+template <typename Layout>
+struct tailparser_registration {
+    uint8_t statechange;
+    uint32_t found;
+    eventparser<Layout> parser;
+};
+
+/* Parsers for facts which are scanned for backwards from the end of a log */
+template <typename Layout>
+static const tailparser_registration<Layout> tail_parsers[] = {
+    {CBTS_REWARD, FOUND_REWARD, parse_reward_event<Layout>},
+    {CBTS_LOGEND, FOUND_LOGEND, parse_logend_event<Layout>},
+};
+
+/**
+ * parse_tail_cbt_events: parse the facts at the end of a log
+ * @details: structure to hold parsed EVTC data
+ * @file: the file to scan
+ *
+ * The reward and log end events are found at the very end of a log. The
+ * events are scanned backwards from the last one, and the first match for
+ * each fact is the same event that a forward scan would have kept last.
+ * The scan stops as soon as every fact queried by @details.query has been
+ * found, so for most logs only the last few events are read. The end of the
+ * encounter is settled by the last reward, which takes precedence over the
+ * log end, so a query for just the end stops there even if the log has no
+ * log end event. Only logs which are missing a queried fact, such as failed
+ * encounters without a reward, are scanned all the way back to the first
+ * event.
+ */
+template <typename Layout>
+static void
+parse_tail_cbt_events(parsed_details& details, const evtc_file_view& file)
+{
+    const statechange_filter<Layout> filter = get_statechange_filter<Layout>();
+    const uint32_t size = evtc_cbtevent<Layout>::size;
+    uint64_t bitmap[statechange_filter_block / 64];
+    uint32_t wanted = 0, found = 0;
+    uint32_t start, end, word;
+    const char *events;
+
+    if (details.query & (QUERY_REWARD | QUERY_END))
+        wanted |= FOUND_REWARD;
+    if (details.query & QUERY_LOGEND)
+        wanted |= FOUND_LOGEND;
+
+    events = file.at(details.cbt_event_start, (uint64_t)details.cbt_event_count * size);
+
+    /* Extract the local time of the last event */
+    evtc_cbtevent<Layout> last_event(events + (uint64_t)(details.cbt_event_count - 1) * size);
+    details.precise_last_event = last_event.time();
+
+    for (end = details.cbt_event_count; end > 0 && (found & wanted) != wanted; end = start) {
+        start = end - min(end, statechange_filter_block);
+
+        filter(events + (uint64_t)start * size, end - start, bitmap);
+
+        for (word = (end - start + 63) / 64; word-- > 0 && (found & wanted) != wanted;) {
+            uint64_t bits = bitmap[word];
+
+            while (bits && (found & wanted) != wanted) {
+                uint32_t bit = 63 - __builtin_clzll(bits);
+
+                bits &= ~(1ULL << bit);
+
+                evtc_cbtevent<Layout> event(events + (uint64_t)(start + word * 64 + bit) * size);
+
+                for (auto& reg : tail_parsers<Layout>) {
+                    if (event.is_statechange() == reg.statechange && !(found & reg.found) &&
+                        reg.parser(details, event)) {
+                        found |= reg.found;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * parse_streamed_cbt_events: parse all combat events from a stream
+ * @details: structure to hold parsed EVTC data
+ * @stream: the stream, positioned at the first combat event
+ *
+ * Parse combat events one block at a time until the stream is exhausted.
+ * The number of combat events is only known once the stream ends, so it is
+ * counted as the events are parsed. If the scan stops early, the rest of the
+ * stream is never read. Returns -EINVAL if the stream does not contain any
+ * combat events.
+ */
+template <typename Layout>
+static int
+parse_streamed_cbt_events(parsed_details& details, evtc_stream& stream)
+{
+    const uint32_t event_size = evtc_cbtevent<Layout>::size;
+    const char *events;
+    uint32_t count;
+
+    details.cbt_event_count = 0;
+
+    while ((count = stream.next_records(event_size, &events))) {
+        bool stopped = parse_cbt_event_block<Layout>(details, events, count);
+
+        /* Extract the local time of the last event seen so far */
+        evtc_cbtevent<Layout> event_details(events + (uint64_t)(count - 1) * event_size);
+        details.precise_last_event = event_details.time();
+
+        details.cbt_event_count += count;
+
+        if (stopped)
+            break;
+    }
+
+    if (!details.cbt_event_count) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * detect_health_based_cm - Detect CM status based on maximum health
+ * @details: structure to store EVTC data
+ *
+ * Using the maximum health data and boss info already gathered, update
+ * the CM status depending on the maximum health found.
+ */
+static void
+detect_health_based_cm(parsed_details& details)
+{
+    if (details.boss_info.cm == CM_HEALTH_BASED) {
+        if (details.boss_maxhealth < details.boss_info.health_threshold) {
+            details.boss_info.cm = CM_NO;
+        } else {
+            details.boss_info.cm = CM_YES;
+        }
+    }
+}
+
+/* True if the query needs a full forward scan of the combat events */
+static bool
+query_needs_full_scan(const parsed_details& details)
+{
+    return details.query & (QUERY_MAXHEALTH | QUERY_EVENTS | QUERY_INSTIDS | QUERY_BUFFS |
+                            QUERY_HEALTH | QUERY_MOVEMENT);
+}
+
+/* True if the query needs facts from the end of the combat events */
+static bool
+query_needs_tail(const parsed_details& details)
+{
+    return details.query & (QUERY_REWARD | QUERY_LOGEND | QUERY_END);
+}
+
+/**
+ * resolve_query - Work out which parts of the file a query must parse
+ * @details: structure holding the parsed header and the query
+ *
+ * Some facts depend on others. For example, the CM status of encounters
+ * detected by the maximum health of the boss requires scanning the combat
+ * events, while other encounters know their CM status from the header.
+ * Adds these dependencies to @details.query, and sets up
+ * @details.stop_found for scans which can stop early.
+ */
+static void
+resolve_query(parsed_details& details)
+{
+    if ((details.query & QUERY_CM) && details.boss_info.cm == CM_HEALTH_BASED) {
+        details.query |= QUERY_MAXHEALTH;
+    }
+
+    /* Damage is credited to players, and the damage of minions to the
+     * player whose instid is their master at the time
+     */
+    if (details.query & QUERY_DAMAGE) {
+        details.query |= QUERY_PLAYERS | QUERY_INSTIDS;
+    }
+
+    /* Boon uptime is measured from the log start to the encounter end */
+    if (details.query & QUERY_BUFFS) {
+        details.query |= QUERY_PLAYERS | QUERY_LOGSTART | QUERY_REWARD | QUERY_LOGEND;
+    }
+
+    /* Phases of the boss are found between the log start and the
+     * encounter end
+     */
+    if (details.query & QUERY_HEALTH) {
+        details.query |= QUERY_LOGSTART | QUERY_REWARD | QUERY_LOGEND;
+    }
+
+    /* Without a full scan, the forward scan is only needed up to the first
+     * log start event. End of log facts are found by a separate scan
+     * backwards from the last event.
+     */
+    if (!query_needs_full_scan(details) && (details.query & QUERY_LOGSTART)) {
+        details.stop_found = FOUND_LOGSTART;
+    }
+}
+
+/* True if the query needs anything past the header */
+static bool
+query_needs_agents(const parsed_details& details)
+{
+    return details.query & ~(QUERY_HEADER | QUERY_CM);
+}
+
+/* True if the query needs to scan the combat events */
+static bool
+query_needs_events(const parsed_details& details)
+{
+    return query_needs_full_scan(details) || query_needs_tail(details) ||
+           (details.query & QUERY_LOGSTART);
+}
+
+/**
+ * parse_evtc_file - Parse all details from a mapped EVTC file
+ * @details: structure to store EVTC data
+ * @file: the mapped file to parse
+ *
+ * Only the parts of the file needed to answer @details.query are parsed.
+ *
+ * Returns zero on success, or a negative error code if the file is not a
+ * valid EVTC file.
+ */
+static int
+parse_evtc_file(parsed_details& details, const evtc_file_view& file)
+{
+    int err;
+
+    err = parse_header(details, file);
+    if (err) {
+        return err;
+    }
+
+    resolve_query(details);
+    if (!query_needs_agents(details)) {
+        return 0;
+    }
+
+    /* We must parse agent count first */
+    err = parse_agent_count(details, file);
+    if (err) {
+        return err;
+    }
+
+    if (details.query & QUERY_AGENT_HASH) {
+        hash_agent_table(details, file);
+    }
+
+    /* Extract data for each player in the encounter, and find the boss */
+    if (details.query & (QUERY_PLAYERS | QUERY_MAXHEALTH | QUERY_INSTIDS | QUERY_HEALTH |
+                         QUERY_MOVEMENT)) {
+        parse_agents(details, file);
+    }
+
+    if (!query_needs_events(details)) {
+        return 0;
+    }
+
+    /* Followed by the skill count */
+    err = parse_skill_count(details, file);
+    if (err) {
+        return err;
+    }
+
+    /* The number of combat events is not stored but we can calculate it */
+    err = calculate_cbt_event_count(details, file);
+    if (err) {
+        return err;
+    }
+
+    /* Parse the combat events for relevant information, using the event
+     * layout matching the file's revision. A full scan finds every fact,
+     * otherwise the end of log facts are found scanning backwards.
+     */
+    dispatch_cbtevent_layout(details.revision, [&](auto layout) {
+        if (query_needs_full_scan(details) || (details.query & QUERY_LOGSTART)) {
+            parse_all_cbt_events<decltype(layout)>(details, file);
+        }
+
+        if (!query_needs_full_scan(details) && query_needs_tail(details)) {
+            parse_tail_cbt_events<decltype(layout)>(details, file);
+        }
+    });
+
+    return 0;
+}
+
+/**
+ * parse_evtc_stream - Parse all details from an EVTC stream
+ * @details: structure to store EVTC data
+ * @stream: the stream to parse
+ *
+ * The header and agent table are small, so they are read into memory and
+ * parsed exactly as for a mapped file. The skill table is not needed, and
+ * is skipped. Combat events are then parsed one block at a time, so memory
+ * usage does not grow with the length of the log.
+ *
+ * Only as much of the stream as is needed to answer @details.query is read.
+ *
+ * Returns zero on success, or a negative error code if the stream is not a
+ * valid EVTC file.
+ */
+static int
+parse_evtc_stream(parsed_details& details, evtc_stream& stream)
+{
+    arena_vector<char> prefix(EVTC_HEADER_SIZE, arena_allocator<char>(details.arena));
+    evtc_file_view view;
+    uint64_t prefix_size;
+    uint32_t agent_count;
+    int err;
+
+    if (!stream.read(prefix.data(), prefix.size())) {
+        return -EINVAL;
+    }
+
+    view.attach(prefix.data(), prefix.size());
+
+    err = parse_header(details, view);
+    if (err) {
+        return err;
+    }
+
+    resolve_query(details);
+    if (!query_needs_agents(details)) {
+        return 0;
+    }
+
+    prefix.resize(OFFSET_EVTC_FIRST_AGENT);
+    if (!stream.read(&prefix[EVTC_HEADER_SIZE], prefix.size() - EVTC_HEADER_SIZE)) {
+        return -EINVAL;
+    }
+
+    /* Read the agent table along with the skill count following it. Grow
+     * the buffer a block at a time, so that a corrupt agent count cannot
+     * allocate more memory than the stream actually contains.
+     */
+    memcpy(&agent_count, &prefix[OFFSET_EVTC_AGENT_COUNT], sizeof(uint32_t));
+    prefix_size = OFFSET_EVTC_FIRST_SKILL(agent_count);
+
+    while (prefix.size() < prefix_size) {
+        size_t start = prefix.size();
+
+        prefix.resize(min<uint64_t>(prefix_size, start + evtc_stream::block_size));
+        if (!stream.read(&prefix[start], prefix.size() - start)) {
+            return -EINVAL;
+        }
+    }
+
+    view.attach(prefix.data(), prefix.size());
+
+    err = parse_agent_count(details, view);
+    if (err) {
+        return err;
+    }
+
+    if (details.query & QUERY_AGENT_HASH) {
+        hash_agent_table(details, view);
+    }
+
+    /* Extract data for each player in the encounter, and find the boss */
+    if (details.query & (QUERY_PLAYERS | QUERY_MAXHEALTH | QUERY_INSTIDS | QUERY_HEALTH |
+                         QUERY_MOVEMENT)) {
+        parse_agents(details, view);
+    }
+
+    if (!query_needs_events(details)) {
+        return 0;
+    }
+
+    err = parse_skill_count(details, view);
+    if (err) {
+        return err;
+    }
+
+    /* Skip over the skills to the start of the combat events */
+    details.cbt_event_start = OFFSET_EVTC_FIRST_CBTEVENT(details.agent_count,
+                                                         details.skill_count);
+    if (!stream.skip((uint64_t)sizeof(evtc_skill) * details.skill_count)) {
+        return -EINVAL;
+    }
+
+    /* A stream cannot be read backwards, so facts at the end of the log
+     * need every event to be scanned
+     */
+    if (query_needs_tail(details)) {
+        details.stop_found = 0;
+    }
+
+    /* Parse all of the combat events as they arrive */
+    dispatch_cbtevent_layout(details.revision, [&](auto layout) {
+        err = parse_streamed_cbt_events<decltype(layout)>(details, stream);
+    });
+    if (err) {
+        return err;
+    }
+
+    /* The stream may have ended early due to corrupt compressed data */
+    return stream.error();
+}
+
+/* Most masters followed from a minion to the player owning it */
+static const unsigned int max_minion_depth = 4;
+
+/**
+ * credit_minion_damage - Add the damage of every minion to its player
+ * @details: structure holding the damage of each agent slot
+ *
+ * The master of a minion is resolved by its instid at the time of the
+ * minion's first hit. Minions may themselves be summoned by minions, so
+ * masters are followed until reaching a player. Damage of agents which do
+ * not lead back to a player, such as the boss, is not credited to anyone.
+ */
+static void
+credit_minion_damage(parsed_details& details)
+{
+    uint32_t players = details.players.size();
+    uint32_t slot;
+
+    for (slot = players; slot < details.damage.size(); slot++) {
+        uint32_t owner = slot;
+        unsigned int depth;
+
+        for (depth = 0; owner >= players && depth < max_minion_depth; depth++) {
+            const damage_master& master = details.damage_masters[owner];
+
+            if (!master.instid) {
+                break;
+            }
+
+            owner = details.instids->find(master.instid, master.time);
+            if (owner == agent_index::no_slot) {
+                break;
+            }
+        }
+
+        if (owner < players) {
+            const damage_totals& totals = details.damage[slot];
+
+            details.damage[owner].boss_direct += totals.boss_direct;
+            details.damage[owner].boss_condition += totals.boss_condition;
+            details.damage[owner].all_direct += totals.all_direct;
+            details.damage[owner].all_condition += totals.all_condition;
+        }
+    }
+}
+
+/**
+ * boss_health_at - Find the health of the boss at some time
+ * @details: structure holding the health timeline
+ * @time: local time to find the health at
+ *
+ * Returns the health of the last change at or before @time, or full health
+ * if it had not changed yet.
+ */
+static uint32_t
+boss_health_at(const parsed_details& details, uint64_t time)
+{
+    auto next = upper_bound(details.health.begin(), details.health.end(), time,
+                            [](uint64_t time, const health_sample& sample) {
+                                return time < sample.time;
+                            });
+
+    if (next == details.health.begin()) {
+        return 10000;
+    }
+
+    return prev(next)->health;
+}
+
+/**
+ * is_boss_agent - Check if an agent stands for the boss
+ * @details: structure holding the attack targets
+ * @agent: the agent address
+ */
+static bool
+is_boss_agent(const parsed_details& details, uint64_t agent)
+{
+    if (agent == details.boss_src_agent) {
+        return true;
+    }
+
+    for (auto& target : details.attack_targets) {
+        if (target.target == agent && target.parent == details.boss_src_agent) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * find_boss_phases - Split the encounter into phases of the boss
+ * @details: structure holding the boss activity changes
+ *
+ * A phase ends whenever the boss becomes invulnerable or untargetable, and
+ * the next one starts once it is neither. Phases are limited to the time
+ * from the log start to the encounter end, so a boss which never changes
+ * has a single phase covering the whole encounter.
+ */
+static void
+find_boss_phases(parsed_details& details)
+{
+    uint64_t start = details.precise_start;
+    uint64_t end = max(details.precise_end, start);
+    bool invulnerable = false, untargetable = false;
+    uint64_t phase_start = start;
+
+    auto add_phase = [&](uint64_t phase_end) {
+        if (phase_end > phase_start) {
+            details.phases.push_back({phase_start, phase_end,
+                                      boss_health_at(details, phase_start),
+                                      boss_health_at(details, phase_end)});
+        }
+    };
+
+    for (auto& change : details.activity) {
+        bool active = !invulnerable && !untargetable;
+        uint64_t time = min(max(change.time, start), end);
+
+        if (change.kind == BOSS_INVULNERABLE) {
+            invulnerable = change.state;
+        } else if (is_boss_agent(details, change.agent)) {
+            untargetable = !change.state;
+        }
+
+        if (active && (invulnerable || untargetable)) {
+            add_phase(time);
+        } else if (!active && !invulnerable && !untargetable) {
+            phase_start = time;
+        }
+    }
+
+    if (!invulnerable && !untargetable) {
+        add_phase(end);
+    }
+}
+
+/* Sizes of the parts of the movement tracks, see sap_movement_tracks */
+static const size_t movement_header_size = 16;
+static const size_t movement_track_entry_size = 40;
+static const size_t movement_keyframe_size = 12;
+
+/**
+ * put_le - Store a little endian number within encoded movement tracks
+ * @out: the encoded tracks
+ * @pos: the offset to store the number at
+ * @value: the number to store
+ * @bytes: the size of the number in bytes
+ *
+ * Returns the offset just past the stored number.
+ */
+static size_t
+put_le(arena_vector<uint8_t>& out, size_t pos, uint64_t value, unsigned int bytes)
+{
+    unsigned int i;
+
+    for (i = 0; i < bytes; i++) {
+        out[pos + i] = (uint8_t)(value >> (8 * i));
+    }
+
+    return pos + bytes;
+}
+
+/**
+ * write_movement_tracks - Gather the encoded blocks into the movement tracks
+ * @details: structure holding the encoded blocks
+ *
+ * The open blocks are encoded first, and the blocks are then grouped by
+ * track with a counting sort, which keeps the blocks of each track in the
+ * order they were encoded. Each block starts with a keyframe, which is
+ * listed in the index of its track.
+ */
+static void
+write_movement_tracks(parsed_details& details)
+{
+    const uint32_t tracks = details.movement_open.size();
+    const auto& blocks = details.movement_blocks;
+    arena_vector<uint8_t>& out = details.movement_tracks;
+    vector<uint32_t> start(tracks + 1), order(blocks.size() + details.movement_open_blocks.size());
+    uint32_t track, i, used = 0;
+    size_t entry, keyframe, data;
+
+    for (auto& block : details.movement_open_blocks) {
+        encode_movement_block(details, block);
+    }
+
+    for (auto& block : blocks) {
+        start[block.track + 1]++;
+    }
+
+    for (track = 0; track < tracks; track++) {
+        if (start[track + 1]) {
+            used++;
+        }
+        start[track + 1] += start[track];
+    }
+
+    {
+        vector<uint32_t> next(start.begin(), start.end() - 1);
+
+        for (i = 0; i < blocks.size(); i++) {
+            order[next[blocks[i].track]++] = i;
+        }
+    }
+
+    entry = movement_header_size;
+    keyframe = entry + (size_t)used * movement_track_entry_size;
+    data = keyframe + blocks.size() * movement_keyframe_size;
+    out.assign(data + details.movement_data.size(), 0);
+
+    memcpy(out.data(), "SAPM", 4);
+    put_le(out, 4, 1, 2);
+    put_le(out, 6, movement_block_samples, 2);
+    put_le(out, 8, used, 4);
+
+    for (track = 0; track < tracks; track++) {
+        const uint8_t kind = track % movement_kinds;
+        const size_t index = keyframe, first = data;
+        uint32_t samples = 0, scale_bits;
+
+        if (start[track] == start[track + 1]) {
+            continue;
+        }
+
+        for (i = start[track]; i < start[track + 1]; i++) {
+            const movement_block& block = blocks[order[i]];
+
+            put_le(out, put_le(out, keyframe, block.time, 8), data - first, 4);
+            keyframe += movement_keyframe_size;
+
+            memcpy(&out[data], &details.movement_data[block.offset], block.size);
+            data += block.size;
+            samples += block.samples;
+        }
+
+        memcpy(&scale_bits, &movement_scale[kind], sizeof(scale_bits));
+
+        entry = put_le(out, entry, details.movement_agents[track / movement_kinds], 8);
+        entry = put_le(out, entry, kind, 1);
+        entry = put_le(out, entry, movement_components[kind], 1);
+        entry = put_le(out, entry, 0, 2);
+        entry = put_le(out, entry, scale_bits, 4);
+        entry = put_le(out, entry, samples, 4);
+        entry = put_le(out, entry, index, 8);
+        entry = put_le(out, entry, first, 8);
+        entry = put_le(out, entry, data - first, 4);
+    }
+
+    /* Only the tracks are kept */
+    details.movement_data.clear();
+    details.movement_data.shrink_to_fit();
+}
+
+/**
+ * finish_details - Derive the remaining details once parsing is complete
+ * @details: structure holding the parsed EVTC data
+ */
+static void
+finish_details(parsed_details& details)
+{
+    /* Detect CM status based on health */
+    detect_health_based_cm(details);
+
+    /* Index the instid intervals, which are no longer needed once indexed */
+    if (details.query & QUERY_INSTIDS) {
+        details.instids = allocate_shared<instid_index>(arena_allocator<instid_index>(details.arena),
+                                                        move(details.instid_intervals));
+        details.instid_intervals.clear();
+        details.open_instid_intervals.clear();
+    }
+
+    if (details.query & QUERY_DAMAGE) {
+        credit_minion_damage(details);
+    }
+
+    /* Use the most appropriate ending time available */
+    if (details.precise_reward_time) {
+        details.precise_end = details.precise_reward_time;
+    } else if (details.precise_logend_time) {
+        details.precise_end = details.precise_logend_time;
+    } else {
+        details.precise_end = details.precise_last_event;
+    }
+
+    /* Boon totals were saved at the last reward, otherwise close every
+     * buff state at the end of the log
+     */
+    if ((details.query & QUERY_BUFFS) &&
+        (details.buff_totals_at_end.empty() || details.buff_totals_time != details.precise_end)) {
+        save_buff_totals(details, details.precise_end);
+    }
+
+    if (details.query & QUERY_HEALTH) {
+        find_boss_phases(details);
+    }
+
+    if (details.query & QUERY_MOVEMENT) {
+        write_movement_tracks(details);
+    }
+}
+
+/**
+ * parse_evtc - Parse all details from an EVTC file
+ * @details: structure to store EVTC data
+ * @filename: the file to parse, or "-" for standard input
+ *
+ * Only the facts requested by @details.query are guaranteed to be filled
+ * in. Regular files are mapped into memory and parsed in place. Compressed
+ * files (.zevtc and .evtc.zip) are decompressed on the fly, and along with
+ * pipes and standard input, are parsed as a stream.
+ *
+ * Returns zero on success, -ENOENT if the file could not be opened, or
+ * another negative error code if the file is not a valid EVTC file.
+ */
+static int
+parse_evtc(parsed_details& details, const char *filename)
+{
+    evtc_file_view file;
+    evtc_stream stream(details.arena);
+    int err;
+
+    if (!strcmp(filename, "-")) {
+        err = -ESPIPE;
+    } else {
+        err = file.open(filename);
+    }
+
+    if (err == -ESPIPE) {
+        /* Pipes and standard input cannot be mapped, so stream them */
+        err = stream.open(filename);
+        if (err) {
+            return err;
+        }
+
+        err = parse_evtc_stream(details, stream);
+    } else if (err) {
+        return err;
+    } else if (is_zip_archive(file)) {
+        err = stream.open_zip(filename);
+        if (err) {
+            return err;
+        }
+
+        err = parse_evtc_stream(details, stream);
+    } else {
+        err = parse_evtc_file(details, file);
+    }
+
+    if (err) {
+        return err;
+    }
+
+    finish_details(details);
+
+    return 0;
+}
+
+/**
+ * parse_evtc_buffer - Parse all details from an EVTC file in memory
+ * @details: structure to store EVTC data
+ * @data: the contents of the file
+ * @len: the size of @data
+ *
+ * Just like parse_evtc, but @data is viewed in place rather than mapping a
+ * file. Compressed files are decompressed on the fly straight out of @data.
+ */
+static int
+parse_evtc_buffer(parsed_details& details, const char *data, uint64_t len)
+{
+    evtc_file_view file;
+    evtc_stream stream(details.arena);
+    int err;
+
+    file.attach(data, len);
+
+    if (is_zip_archive(file)) {
+        err = stream.open_zip(data, len);
+        if (err) {
+            return err;
+        }
+
+        err = parse_evtc_stream(details, stream);
+    } else {
+        err = parse_evtc_file(details, file);
+    }
+
+    if (err) {
+        return err;
+    }
+
+    finish_details(details);
+
+    return 0;
+}
+
+/* C interface
+ *
+ * A sap_log owns the parsed details of one log, along with the strings
+ * handed out for them, so they stay valid until the log is closed. No C++
+ * exception may escape through the interface.
+ */
+struct sap_log {
+    /* Arena holding the log and everything parsed for it */
+    parse_arena *arena;
+
+    parsed_details details;
+
+    /* Players in order of their agent address, as output by json */
+    arena_vector<const player_details *> players;
+
+    /* Formatted Guild UID of each player, empty if not known */
+    arena_vector<array<char, 37>> guids;
+};
+
+/* Arenas which are not holding an open log, ready for the next log */
+static mutex arena_pool_lock;
+static vector<unique_ptr<parse_arena>> arena_pool;
+
+/**
+ * acquire_parse_arena - Take an arena from the pool, or create a new one
+ */
+static parse_arena *
+acquire_parse_arena()
+{
+    {
+        lock_guard<mutex> guard(arena_pool_lock);
+
+        if (!arena_pool.empty()) {
+            parse_arena *arena = arena_pool.back().release();
+
+            arena_pool.pop_back();
+            return arena;
+        }
+    }
+
+    return new parse_arena();
+}
+
+/**
+ * release_parse_arena - Reset an arena and return it to the pool
+ * @arena: the arena, which no longer holds anything in use
+ */
+static void
+release_parse_arena(parse_arena *arena)
+{
+    unique_ptr<parse_arena> pooled(arena);
+
+    pooled->reset();
+
+    try {
+        lock_guard<mutex> guard(arena_pool_lock);
+
+        arena_pool.push_back(move(pooled));
+    } catch (const bad_alloc&) {
+        /* The arena is freed instead of pooled */
+    }
+}
+
+/**
+ * create_log - Create an empty sap_log within a pooled arena
+ *
+ * Every container of the log allocates from the same arena as the log
+ * itself. Throws bad_alloc if memory runs out.
+ */
+static sap_log *
+create_log()
+{
+    parse_arena *arena = acquire_parse_arena();
+    sap_log *log;
+
+    try {
+        log = new (arena->allocate(sizeof(sap_log), alignof(sap_log))) sap_log();
+    } catch (...) {
+        release_parse_arena(arena);
+        throw;
+    }
+
+    log->arena = arena;
+    log->players = arena_vector<const player_details *>(arena);
+    log->guids = arena_vector<array<char, 37>>(arena);
+
+    log->details.arena = arena;
+    log->details.players = arena_vector<player_details>(arena);
+    log->details.instid_intervals = arena_vector<instid_interval>(arena);
+    log->details.open_instid_intervals = arena_vector<uint32_t>(arena);
+    log->details.damage = arena_vector<damage_totals>(arena);
+    log->details.damage_masters = arena_vector<damage_master>(arena);
+    log->details.buffs = arena_vector<buff_state>(arena);
+    log->details.buff_stacks = arena_vector<buff_stack>(arena);
+    log->details.buff_totals_at_end = arena_vector<buff_totals>(arena);
+    log->details.health = arena_vector<health_sample>(arena);
+    log->details.activity = arena_vector<boss_activity>(arena);
+    log->details.attack_targets = arena_vector<attack_target>(arena);
+    log->details.phases = arena_vector<boss_phase>(arena);
+    log->details.movement_agents = arena_vector<uint64_t>(arena);
+    log->details.movement_open = arena_vector<uint32_t>(arena);
+    log->details.movement_open_blocks = arena_vector<movement_open_block>(arena);
+    log->details.movement_blocks = arena_vector<movement_block>(arena);
+    log->details.movement_tracks = arena_vector<uint8_t>(arena);
+
+    return log;
+}
+
+/**
+ * destroy_log - Free a sap_log, returning its arena to the pool
+ * @log: the log to free
+ */
+static void
+destroy_log(sap_log *log)
+{
+    parse_arena *arena = log->arena;
+
+    log->~sap_log();
+    release_parse_arena(arena);
+}
+
+/**
+ * format_hex - Format a number as fixed width upper case hexadecimal
+ * @dst: the buffer to write the @digits characters to
+ * @value: the number to format
+ * @digits: the number of digits to write
+ *
+ * Returns a pointer just past the written digits.
+ */
+static char *
+format_hex(char *dst, uint32_t value, int digits)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+    int i;
+
+    for (i = digits - 1; i >= 0; i--) {
+        dst[i] = hex_digits[value & 0xf];
+        value >>= 4;
+    }
+
+    return dst + digits;
+}
+
+/**
+ * format_guid - Format a Guild UID the way the GW2 API does
+ * @guid: the Guild UID to format
+ * @text: on return, the 36 character formatted Guild UID
+ */
+static void
+format_guid(const evtc_guid& guid, array<char, 37>& text)
+{
+    char *pos = text.data();
+
+    pos = format_hex(pos, guid.data.p1, 8);
+    *pos++ = '-';
+    pos = format_hex(pos, guid.data.p2, 4);
+    *pos++ = '-';
+    pos = format_hex(pos, guid.data.p3, 4);
+    *pos++ = '-';
+    pos = format_hex(pos, guid.data.p4, 4);
+    *pos++ = '-';
+    pos = format_hex(pos, guid.data.p5, 4);
+    pos = format_hex(pos, guid.data.p6, 8);
+    *pos = '\0';
+}
+
+/**
+ * open_log - Parse a log into a new sap_log
+ * @query: the facts to parse
+ * @threads: maximum threads to scan combat events with, or 0 for one per CPU
+ * @log: on success, the parsed log
+ * @parse: function parsing the log into the details
+ */
+static int
+open_log(uint32_t query, unsigned int threads, sap_log **log,
+         const function<int(parsed_details& details)>& parse)
+{
+    if (!log) {
+        return -EINVAL;
+    }
+
+    try {
+        unique_ptr<sap_log, void (*)(sap_log *)> result(create_log(), destroy_log);
+        parsed_details& details = result->details;
+        int err;
+
+        details.scan_threads = threads ? threads : max(1u, thread::hardware_concurrency());
+        details.query = query & ~QUERY_INTERNAL;
+
+        err = parse(details);
+        if (err) {
+            return err;
+        }
+
+        for (auto& player : details.players) {
+            result->players.push_back(&player);
+        }
+
+        sort(result->players.begin(), result->players.end(),
+             [](const player_details *a, const player_details *b) { return a->addr < b->addr; });
+
+        for (auto player : result->players) {
+            result->guids.emplace_back();
+            result->guids.back()[0] = '\0';
+            if (player->guid.valid) {
+                format_guid(player->guid, result->guids.back());
+            }
+        }
+
+        *log = result.release();
+        return 0;
+    } catch (const bad_alloc&) {
+        return -ENOMEM;
+    } catch (...) {
+        return -EINVAL;
+    }
+}
+
+extern "C" {
+
+const char *
+sap_version(void)
+{
+    return version;
+}
+
+const char *
+sap_strerror(int err)
+{
+    switch (err) {
+    case -ENOENT:
+        return "Failed to open file";
+    case -EINVAL:
+        return "Not a valid EVTC file";
+    default:
+        return strerror(-err);
+    }
+}
+
+int
+sap_encounter_overlay(const char **message, uint64_t *hash)
+{
+    const encounter_overlay& overlay = get_encounter_overlay();
+
+    if (message) {
+        *message = overlay.err ? overlay.message.c_str() : nullptr;
+    }
+
+    if (hash) {
+        *hash = overlay.hash;
+    }
+
+    return overlay.err;
+}
+
+int
+sap_check_kernels(void)
+{
+    uint8_t revision;
+    int checked = 0;
+    int err = 0;
+
+    try {
+        for (revision = 0; revision <= max_cbtevent_revision; revision++) {
+            dispatch_cbtevent_layout(revision, [&](auto layout) {
+                int ret = check_layout_kernels<decltype(layout)>();
+
+                if (ret < 0) {
+                    err = ret;
+                } else {
+                    checked += ret;
+                }
+            });
+        }
+    } catch (const bad_alloc&) {
+        return -ENOMEM;
+    }
+
+    return err ? err : checked;
+}
+
+int
+sap_open_file(const char *path, uint32_t query, unsigned int threads, sap_log **log)
+{
+    if (!path) {
+        return -EINVAL;
+    }
+
+    return open_log(query, threads, log, [path](parsed_details& details) {
+        return parse_evtc(details, path);
+    });
+}
+
+int
+sap_open_buffer(const void *data, size_t len, uint32_t query, unsigned int threads,
+                sap_log **log)
+{
+    if (!data && len) {
+        return -EINVAL;
+    }
+
+    return open_log(query, threads, log, [data, len](parsed_details& details) {
+        return parse_evtc_buffer(details, (const char *)data, len);
+    });
+}
+
+void
+sap_close(sap_log *log)
+{
+    if (log) {
+        destroy_log(log);
+    }
+}
+
+uint64_t
+sap_get_number(const sap_log *log, enum sap_number_field field)
+{
+    const parsed_details& details = log->details;
+
+    switch (field) {
+    case SAP_FIELD_REVISION:
+        return details.revision;
+    case SAP_FIELD_BOSS_ID:
+        return details.boss_id;
+    case SAP_FIELD_BOSS_CM:
+        return details.boss_info.cm;
+    case SAP_FIELD_BOSS_MAXHEALTH:
+        return details.boss_maxhealth;
+    case SAP_FIELD_SUCCESS:
+        return details.encounter_success;
+    case SAP_FIELD_SERVER_START:
+        return details.server_start;
+    case SAP_FIELD_SERVER_END:
+        return details.server_end;
+    case SAP_FIELD_LOCAL_START:
+        return details.precise_start;
+    case SAP_FIELD_LOCAL_END:
+        return details.precise_end;
+    case SAP_FIELD_LOCAL_LAST_EVENT:
+        return details.precise_last_event;
+    case SAP_FIELD_LOCAL_REWARD:
+        return details.precise_reward_time;
+    case SAP_FIELD_LOCAL_LOG_END:
+        return details.precise_logend_time;
+    case SAP_FIELD_AGENT_HASH:
+        return details.agent_hash;
+    }
+
+    return 0;
+}
+
+const char *
+sap_get_string(const sap_log *log, enum sap_string_field field)
+{
+    const parsed_details& details = log->details;
+
+    switch (field) {
+    case SAP_FIELD_ARCDPS_VERSION:
+        return details.arc_header;
+    case SAP_FIELD_BOSS_NAME:
+        return details.boss_info.name;
+    case SAP_FIELD_BOSS_LOCATION:
+        return details.boss_info.location;
+    }
+
+    return nullptr;
+}
+
+uint32_t
+sap_player_count(const sap_log *log)
+{
+    return log->players.size();
+}
+
+const char *
+sap_player_string(const sap_log *log, uint32_t player, enum sap_player_field field)
+{
+    if (player >= log->players.size()) {
+        return nullptr;
+    }
+
+    switch (field) {
+    case SAP_PLAYER_CHARACTER:
+        return log->players[player]->character.data();
+    case SAP_PLAYER_ACCOUNT:
+        return log->players[player]->account.data();
+    case SAP_PLAYER_SUBGROUP:
+        return log->players[player]->subgroup.data();
+    case SAP_PLAYER_GUID:
+        if (!log->guids[player][0]) {
+            return nullptr;
+        }
+        return log->guids[player].data();
+    }
+
+    return nullptr;
+}
+
+uint64_t
+sap_player_damage(const sap_log *log, uint32_t player, enum sap_damage_field field)
+{
+    const parsed_details& details = log->details;
+    size_t slot;
+
+    if (player >= log->players.size()) {
+        return 0;
+    }
+
+    /* Players are the first agent slots, in the order of details.players */
+    slot = log->players[player] - details.players.data();
+    if (slot >= details.damage.size()) {
+        return 0;
+    }
+
+    switch (field) {
+    case SAP_DAMAGE_BOSS_DIRECT:
+        return details.damage[slot].boss_direct;
+    case SAP_DAMAGE_BOSS_CONDITION:
+        return details.damage[slot].boss_condition;
+    case SAP_DAMAGE_ALL_DIRECT:
+        return details.damage[slot].all_direct;
+    case SAP_DAMAGE_ALL_CONDITION:
+        return details.damage[slot].all_condition;
+    }
+
+    return 0;
+}
+
+uint64_t
+sap_player_boon(const sap_log *log, uint32_t player, enum sap_boon boon,
+                enum sap_boon_field field)
+{
+    const parsed_details& details = log->details;
+    size_t state;
+
+    if (player >= log->players.size() || (uint32_t)boon >= boon_count) {
+        return 0;
+    }
+
+    state = (size_t)(log->players[player] - details.players.data()) * boon_count + boon;
+    if (state >= details.buff_totals_at_end.size()) {
+        return 0;
+    }
+
+    switch (field) {
+    case SAP_BOON_FIELD_UPTIME:
+        return details.buff_totals_at_end[state].uptime;
+    case SAP_BOON_FIELD_STACK_TIME:
+        return details.buff_totals_at_end[state].stack_time;
+    }
+
+    return 0;
+}
+
+/* Interval of the health timeline which a sample falls in */
+static uint64_t
+health_interval(const parsed_details& details, uint64_t time, uint32_t resolution)
+{
+    if (time <= details.precise_start) {
+        return 0;
+    }
+
+    return (time - details.precise_start) / resolution;
+}
+
+uint32_t
+sap_boss_health(const sap_log *log, uint32_t resolution, uint64_t *times, uint32_t *health,
+                uint32_t max)
+{
+    const parsed_details& details = log->details;
+    uint32_t count = 0;
+    size_t i;
+
+    for (i = 0; i < details.health.size(); i++) {
+        const health_sample& sample = details.health[i];
+
+        /* Only the last change within each interval is kept */
+        if (resolution && i + 1 < details.health.size() &&
+            health_interval(details, sample.time, resolution) ==
+                health_interval(details, details.health[i + 1].time, resolution)) {
+            continue;
+        }
+
+        if (count < max) {
+            if (times) {
+                times[count] = sample.time;
+            }
+            if (health) {
+                health[count] = sample.health;
+            }
+        }
+        count++;
+    }
+
+    return count;
+}
+
+uint32_t
+sap_phase_count(const sap_log *log)
+{
+    return log->details.phases.size();
+}
+
+uint64_t
+sap_phase(const sap_log *log, uint32_t phase, enum sap_phase_field field)
+{
+    const parsed_details& details = log->details;
+
+    if (phase >= details.phases.size()) {
+        return 0;
+    }
+
+    switch (field) {
+    case SAP_PHASE_START:
+        return details.phases[phase].start;
+    case SAP_PHASE_END:
+        return details.phases[phase].end;
+    case SAP_PHASE_START_HEALTH:
+        return details.phases[phase].start_health;
+    case SAP_PHASE_END_HEALTH:
+        return details.phases[phase].end_health;
+    }
+
+    return 0;
+}
+
+const void *
+sap_movement_tracks(const sap_log *log, size_t *len)
+{
+    const parsed_details& details = log->details;
+
+    *len = details.movement_tracks.size();
+    if (details.movement_tracks.empty()) {
+        return nullptr;
+    }
+
+    return details.movement_tracks.data();
+}
+
+uint64_t
+sap_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+} /* extern "C" */
@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright 2018 Jacob Keller. All rights reserved.
+ *
+ * libsimplearcparse - C interface to the simpleArcParse EVTC parser
+ *
+ * A log is opened from a file or from a buffer in memory, which parses the
+ * facts requested by a query. The parsed fields and players can then be
+ * read until the log is closed.
+ *
+ * Functions returning an int return zero on success, or a negative errno
+ * value on failure, which can be described using sap_strerror.
+ *
+ * The interface only uses opaque handles, plain integers and strings, and
+ * new fields are only ever added with new values, so programs built
+ * against an older version of this header keep working with newer
+ * versions of the library.
+ */
+#ifndef SIMPLEARCPARSE_H
+#define SIMPLEARCPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* When building or using libsimplearcparse as a DLL, define
+ * SIMPLEARCPARSE_SHARED, and also define SIMPLEARCPARSE_BUILD while
+ * building it.
+ */
+#if defined(_WIN32) && defined(SIMPLEARCPARSE_SHARED)
+#ifdef SIMPLEARCPARSE_BUILD
+#define SAP_API __declspec(dllexport)
+#else
+#define SAP_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define SAP_API __attribute__((visibility("default")))
+#else
+#define SAP_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Facts which can be parsed from a log
+ *
+ * Only the parts of the log needed for the queried facts are read, so
+ * asking for less is faster. The header is always parsed.
+ */
+#define SAP_QUERY_HEADER     0x001  /* arcdps version, revision and encounter */
+#define SAP_QUERY_PLAYERS    0x002  /* player agents */
+#define SAP_QUERY_CM         0x004  /* challenge mote status */
+#define SAP_QUERY_MAXHEALTH  0x008  /* maximum health of the boss */
+#define SAP_QUERY_LOGSTART   0x010  /* the first log start event */
+#define SAP_QUERY_EVENTS     0x020  /* everything from a full combat event scan */
+#define SAP_QUERY_REWARD     0x040  /* the last reward event */
+#define SAP_QUERY_LOGEND     0x080  /* the last log end event */
+#define SAP_QUERY_ALL        0x0ff  /* every fact output by simpleArcParse json */
+#define SAP_QUERY_AGENT_HASH 0x100  /* hash of the header and agent table */
+#define SAP_QUERY_DAMAGE     0x200  /* damage dealt by each player, implies SAP_QUERY_PLAYERS */
+#define SAP_QUERY_BUFFS      0x400  /* boon uptime of each player, implies SAP_QUERY_PLAYERS */
+#define SAP_QUERY_HEALTH     0x800  /* health timeline and phases of the boss */
+#define SAP_QUERY_MOVEMENT   0x1000 /* position, velocity and facing tracks of every agent */
+#define SAP_QUERY_END        0x2000 /* just the local time the encounter ended */
+
+/* Numeric fields of a log */
+enum sap_number_field {
+    SAP_FIELD_REVISION = 0,         /* cbtevent revision */
+    SAP_FIELD_BOSS_ID = 1,          /* encounter id */
+    SAP_FIELD_BOSS_CM = 2,          /* challenge mote status, from enum sap_cm */
+    SAP_FIELD_BOSS_MAXHEALTH = 3,   /* maximum health of the boss */
+    SAP_FIELD_SUCCESS = 4,          /* non-zero if the encounter was successful */
+    SAP_FIELD_SERVER_START = 5,     /* server Unix time of the log start */
+    SAP_FIELD_SERVER_END = 6,       /* server Unix time of the log end */
+    SAP_FIELD_LOCAL_START = 7,      /* local time of the log start */
+    SAP_FIELD_LOCAL_END = 8,        /* local time the encounter ended */
+    SAP_FIELD_LOCAL_LAST_EVENT = 9, /* local time of the last event */
+    SAP_FIELD_LOCAL_REWARD = 10,    /* local time of the reward, or zero */
+    SAP_FIELD_LOCAL_LOG_END = 11,   /* local time of the log end, or zero */
+    SAP_FIELD_AGENT_HASH = 12,      /* hash of the header and agent table */
+};
+
+/* String fields of a log */
+enum sap_string_field {
+    SAP_FIELD_ARCDPS_VERSION = 0,   /* "EVTC" followed by the arcdps build date */
+    SAP_FIELD_BOSS_NAME = 1,        /* name of the encounter */
+    SAP_FIELD_BOSS_LOCATION = 2,    /* raid wing, fractal or area of the encounter */
+};
+
+/* String fields of a player */
+enum sap_player_field {
+    SAP_PLAYER_CHARACTER = 0,       /* character name */
+    SAP_PLAYER_ACCOUNT = 1,         /* account name, without the leading ':' */
+    SAP_PLAYER_SUBGROUP = 2,        /* squad subgroup */
+    SAP_PLAYER_GUID = 3,            /* guild id in API form, or NULL if unknown */
+};
+
+/* Damage totals of a player, including the damage of its minions
+ *
+ * Direct damage is from physical hits, and condition damage is from the
+ * ticks of damaging buffs. Only damage to foes is counted.
+ */
+enum sap_damage_field {
+    SAP_DAMAGE_BOSS_DIRECT = 0,     /* direct damage to the boss */
+    SAP_DAMAGE_BOSS_CONDITION = 1,  /* condition damage to the boss */
+    SAP_DAMAGE_ALL_DIRECT = 2,      /* direct damage to every target, including the boss */
+    SAP_DAMAGE_ALL_CONDITION = 3,   /* condition damage to every target, including the boss */
+};
+
+/* Boons whose uptime is tracked for each player */
+enum sap_boon {
+    SAP_BOON_MIGHT = 0,
+    SAP_BOON_FURY = 1,
+    SAP_BOON_QUICKNESS = 2,
+    SAP_BOON_ALACRITY = 3,
+    SAP_BOON_PROTECTION = 4,
+    SAP_BOON_REGENERATION = 5,
+    SAP_BOON_VIGOR = 6,
+    SAP_BOON_AEGIS = 7,
+    SAP_BOON_STABILITY = 8,
+    SAP_BOON_SWIFTNESS = 9,
+    SAP_BOON_RETALIATION = 10,
+    SAP_BOON_RESISTANCE = 11,
+};
+
+/* Boon totals of a player, from the log start to the encounter end
+ *
+ * Dividing by the encounter duration gives the uptime as a fraction, and
+ * the average number of stacks. Stacks of boons which stack in duration
+ * count only once, and might and stability count at most 25 stacks.
+ */
+enum sap_boon_field {
+    SAP_BOON_FIELD_UPTIME = 0,      /* milliseconds with at least one stack */
+    SAP_BOON_FIELD_STACK_TIME = 1,  /* stacks integrated over time, in stack milliseconds */
+};
+
+/* Fields of a phase of the boss
+ *
+ * A phase ends when the boss becomes invulnerable or untargetable, and the
+ * next one starts once it can be damaged again. Health is in hundredths of
+ * a percent, from 0 to 10000.
+ */
+enum sap_phase_field {
+    SAP_PHASE_START = 0,            /* local time the phase started */
+    SAP_PHASE_END = 1,              /* local time the phase ended */
+    SAP_PHASE_START_HEALTH = 2,     /* health of the boss at the start */
+    SAP_PHASE_END_HEALTH = 3,       /* health of the boss at the end */
+};
+
+/* Challenge mote status of an encounter */
+enum sap_cm {
+    SAP_CM_UNKNOWN = 0,             /* not known for this encounter */
+    SAP_CM_HEALTH_BASED = 1,        /* depends on the maximum health, which was not queried */
+    SAP_CM_NO = 2,
+    SAP_CM_YES = 3,
+};
+
+/* A parsed log */
+typedef struct sap_log sap_log;
+
+/**
+ * sap_version - Return the simpleArcParse version, such as "v2.5.0"
+ */
+SAP_API const char *sap_version(void);
+
+/**
+ * sap_strerror - Describe an error returned by the library
+ * @err: the negative error code
+ */
+SAP_API const char *sap_strerror(int err);
+
+/**
+ * sap_encounter_overlay - Load the encounter overlay file
+ * @message: if not NULL, set to a description of why the overlay was
+ *           ignored, or to NULL if it was not
+ * @hash: if not NULL, set to the sap_hash of the overlay file contents as
+ *        loaded, or to zero if no overlay was loaded
+ *
+ * The file named by the SIMPLEARCPARSE_ENCOUNTERS environment variable is
+ * loaded the first time it is needed, and kept for the life of the process.
+ * A file which cannot be read, or holds any invalid entry, is ignored
+ * entirely and the built-in encounters are used instead. Returns zero if
+ * the overlay was loaded or none is set, -ENOENT if it could not be opened,
+ * or -EINVAL if it is invalid. The file is only read once, so @hash
+ * identifies the encounters in use even if the file changes afterwards.
+ */
+SAP_API int sap_encounter_overlay(const char **message, uint64_t *hash);
+
+/**
+ * sap_check_kernels - Check the vector kernels against the scalar kernels
+ *
+ * Runs every vectorized statechange and damage prefilter the CPU supports,
+ * for every log revision, over the same generated events as the scalar one,
+ * including blocks with a partial tail, and compares the results. Returns
+ * the number of kernels checked, or -EIO if any of them disagrees.
+ */
+SAP_API int sap_check_kernels(void);
+
+/**
+ * sap_open_file - Parse a log file
+ * @path: the .evtc, .zevtc or .evtc.zip file, or "-" for standard input
+ * @query: the SAP_QUERY_* facts to parse
+ * @threads: maximum threads to scan combat events with, or 0 for one per CPU
+ * @log: on success, the parsed log, which must be closed with sap_close
+ *
+ * Returns -ENOENT if the file could not be opened, or -EINVAL if it is not
+ * a valid EVTC file.
+ */
+SAP_API int sap_open_file(const char *path, uint32_t query, unsigned int threads, sap_log **log);
+
+/**
+ * sap_open_buffer - Parse a log held in memory
+ * @data: the contents of an .evtc file, or of a compressed .zevtc file
+ * @len: the size of @data
+ * @query: the SAP_QUERY_* facts to parse
+ * @threads: maximum threads to scan combat events with, or 0 for one per CPU
+ * @log: on success, the parsed log, which must be closed with sap_close
+ *
+ * The log is parsed in place without copying it, and @data only needs to
+ * remain valid until this function returns.
+ */
+SAP_API int sap_open_buffer(const void *data, size_t len, uint32_t query, unsigned int threads,
+                            sap_log **log);
+
+/**
+ * sap_close - Free a parsed log
+ * @log: the log to free, may be NULL
+ */
+SAP_API void sap_close(sap_log *log);
+
+/**
+ * sap_get_number - Read a numeric field of a log
+ * @log: the parsed log
+ * @field: the field to read
+ *
+ * Fields which were not queried, or are unknown, read as zero.
+ */
+SAP_API uint64_t sap_get_number(const sap_log *log, enum sap_number_field field);
+
+/**
+ * sap_get_string - Read a string field of a log
+ * @log: the parsed log
+ * @field: the field to read
+ *
+ * The string is valid until the log is closed. Returns NULL for unknown
+ * fields.
+ */
+SAP_API const char *sap_get_string(const sap_log *log, enum sap_string_field field);
+
+/**
+ * sap_player_count - Return the number of players in a log
+ * @log: the parsed log
+ *
+ * Players are only parsed if SAP_QUERY_PLAYERS was queried.
+ */
+SAP_API uint32_t sap_player_count(const sap_log *log);
+
+/**
+ * sap_player_string - Read a string field of a player
+ * @log: the parsed log
+ * @player: the player, from zero to sap_player_count - 1
+ * @field: the field to read
+ *
+ * The string is valid until the log is closed. Returns NULL if @player is
+ * out of range, or the field is not known.
+ */
+SAP_API const char *sap_player_string(const sap_log *log, uint32_t player,
+                                      enum sap_player_field field);
+
+/**
+ * sap_player_damage - Read a damage total of a player
+ * @log: the parsed log
+ * @player: the player, from zero to sap_player_count - 1
+ * @field: the total to read
+ *
+ * Damage is only summed if SAP_QUERY_DAMAGE was queried. Returns zero if
+ * @player is out of range, or the field is not known.
+ */
+SAP_API uint64_t sap_player_damage(const sap_log *log, uint32_t player,
+                                   enum sap_damage_field field);
+
+/**
+ * sap_player_boon - Read a boon total of a player
+ * @log: the parsed log
+ * @player: the player, from zero to sap_player_count - 1
+ * @boon: the boon to read
+ * @field: the total to read
+ *
+ * Boons are only tracked if SAP_QUERY_BUFFS was queried. Returns zero if
+ * @player is out of range, or the boon or field is not known.
+ */
+SAP_API uint64_t sap_player_boon(const sap_log *log, uint32_t player, enum sap_boon boon,
+                                 enum sap_boon_field field);
+
+/**
+ * sap_boss_health - Read the health timeline of the boss
+ * @log: the parsed log
+ * @resolution: milliseconds covered by each sample, or 0 for every change
+ * @times: the local time of each sample, may be NULL
+ * @health: the health at each sample, in hundredths of a percent, may be NULL
+ * @max: the number of samples @times and @health have room for
+ *
+ * The time from the log start is split into intervals of @resolution, and
+ * the last change of health within each interval is kept, so long fights
+ * can be read with as few samples as wanted. Returns the number of samples
+ * at this resolution, of which at most @max are written. Health is only
+ * recorded if SAP_QUERY_HEALTH was queried.
+ */
+SAP_API uint32_t sap_boss_health(const sap_log *log, uint32_t resolution, uint64_t *times,
+                                 uint32_t *health, uint32_t max);
+
+/**
+ * sap_phase_count - Return the number of phases of the boss
+ * @log: the parsed log
+ *
+ * Phases are only found if SAP_QUERY_HEALTH was queried.
+ */
+SAP_API uint32_t sap_phase_count(const sap_log *log);
+
+/**
+ * sap_phase - Read a field of a phase of the boss
+ * @log: the parsed log
+ * @phase: the phase, from zero to sap_phase_count - 1
+ * @field: the field to read
+ *
+ * Returns zero if @phase is out of range, or the field is not known.
+ */
+SAP_API uint64_t sap_phase(const sap_log *log, uint32_t phase, enum sap_phase_field field);
+
+/**
+ * sap_movement_tracks - Read the movement tracks of every agent
+ * @log: the parsed log
+ * @len: on return, the size of the tracks in bytes
+ *
+ * Returns the encoded tracks, which remain valid until the log is closed,
+ * or NULL if SAP_QUERY_MOVEMENT was not queried. Every number is little
+ * endian, and offsets are from the start of the tracks.
+ *
+ * The tracks start with a 16 byte header: "SAPM", the format version (1)
+ * as a uint16, the samples per keyframe as a uint16, the number of tracks
+ * as a uint32, and 4 reserved bytes. A 40 byte entry follows for each
+ * track, holding:
+ *
+ *   uint64  address of the agent
+ *   uint8   kind, 0 for position, 1 for velocity and 2 for facing
+ *   uint8   coordinates per sample, 3 for positions and velocities or 2
+ *           for facings
+ *   uint16  reserved
+ *   float   steps per game unit the coordinates are quantized to
+ *   uint32  number of samples
+ *   uint64  offset of the keyframe index
+ *   uint64  offset of the sample data
+ *   uint32  size of the sample data
+ *
+ * Every track has one keyframe per group of samples. The keyframe index
+ * holds 12 bytes for each: the uint64 local time of its sample, and the
+ * uint32 offset of the sample within the sample data. A keyframe sample is
+ * each quantized coordinate, while the other samples hold the change in
+ * time followed by the change in each coordinate from the sample before.
+ * Every number in the sample data is a signed zigzag varint. To decode a
+ * window of time, start from the last keyframe at or before it.
+ */
+SAP_API const void *sap_movement_tracks(const sap_log *log, size_t *len);
+
+/* Initial value for sap_hash */
+#define SAP_HASH_INIT 0xcbf29ce484222325ULL
+
+/**
+ * sap_hash - 64-bit FNV-1a hash, as used for SAP_FIELD_AGENT_HASH
+ * @hash: SAP_HASH_INIT, or the hash of the preceding data
+ * @data: the data to hash
+ * @len: the size of @data
+ */
+SAP_API uint64_t sap_hash(uint64_t hash, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIMPLEARCPARSE_H */
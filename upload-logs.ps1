@@ -96,7 +96,6 @@ if (-not (Check-SimpleArcParse-Version $simple_arc_version)) {
 }
 
 Add-Type -Path $config.restsharp_path
-Add-Type -AssemblyName "System.IO.Compression.FileSystem"
 
 # Determine the most recent release of ArcDPS
 $arcdps_headers = (Invoke-WebRequest -UseBasicParsing -Uri https://www.deltaconnected.com/arcdps/x64/d3d9.dll.md5sum).Headers
@@ -129,6 +128,21 @@ if ($total -gt 0 ) {
 
 $failed_uploads = [System.Collections.ArrayList]@()
 
+# Parse all of the new logs up front using a single simpleArcParse process,
+# rather than starting a new process for every log. Each line of output is
+# the JSON data for one log, keyed here by its full path.
+$batch_json = @{}
+if ($total -gt 0) {
+    # simpleArcParse compares whole seconds, so round down to avoid missing
+    # any files. Extra files are simply ignored.
+    $since = ([DateTimeOffset]$last_upload_time).ToUnixTimeSeconds() - 1
+
+    & $simple_arc_parse batch --since $since $arcdps_logs | ForEach-Object {
+        $record = $_ | ConvertFrom-Json
+        $batch_json[[io.path]::GetFullPath($record.path)] = $_
+    }
+}
+
 # Main loop to generate and upload logs to dps.report
 ForEach($f in $files) {
     $done++
@@ -160,29 +174,9 @@ ForEach($f in $files) {
         exit
     }
 
-    if (ExtensionIs-CompressedEVTC $f) {
-        # simpleArcParse cannot deal with compressed data, so we must uncompress
-        # it first, before passing the file to the simpleArcParse program
-        [io.compression.zipfile]::ExtractToDirectory($f, $dir) | Out-Null
-        $evtc = Join-Path -Path $dir -ChildPath $name
-
-        # Sometimes the zip file stores the uncompressed file suffixed with .tmp
-        if (-not (X-Test-Path $evtc)) {
-            $evtc = Join-Path -Path $dir -ChildPath "${name}.tmp"
-        }
-
-        # Sometimes the zip file stores the uncompressed file without the .evtc
-        if (-not (X-Test-Path $evtc)) {
-            $evtc = Join-Path -Path $dir -ChildPath ([io.fileinfo]$name).basename
-        }
-
-        if (-not (X-Test-Path $evtc)) {
-            throw "${evtc} is compressed, but does not appear to contain the correct contents"
-        }
-    } else {
-        # if the file was not compressed originally, we don't need to copy it
-        $evtc = $f
-    }
+    # simpleArcParse reads compressed logs directly, so there is no need to
+    # extract them first
+    $evtc = $f
 
     # Track encounter success
     $success = $false
@@ -191,14 +185,21 @@ ForEach($f in $files) {
         # Save the path to the original evtc file
         $f | ConvertTo-Json | Out-File -FilePath (Join-Path $dir -ChildPath "evtc.json")
 
-        $evtc_json = (& ${simple_arc_parse} json "${evtc}")
-        $evtc_info = $evtc_json | ConvertFrom-Json
-
+        # Fall back to parsing the log on its own if the batch missed it
+        $evtc_json = $batch_json[$f]
         if ([string]::IsNullOrEmpty($evtc_json)) {
+            $evtc_info = Invoke-SimpleArcParse $simple_arc_parse json "${evtc}"
+        } else {
+            $evtc_info = $evtc_json | ConvertFrom-Json
+        }
+
+        if (-not $evtc_info) {
             throw "${evtc} is not recognized as a valid .evtc file by simpleArcParse."
         }
 
-        $evtc_info = $evtc_json | ConvertFrom-Json
+        if ($evtc_info.error) {
+            throw "${evtc} is not recognized as a valid .evtc file by simpleArcParse: $($evtc_info.error.message)"
+        }
 
         # Determine the ArcDPS release date of this encounter
         try {
@@ -257,11 +258,6 @@ ForEach($f in $files) {
         # so that the user can verify what is wrong, and intervene.
         Read-Host -Prompt "Unable to process ${f}... Press enter to exit..."
         exit
-    } finally {
-        # If the file was originally compressed, there's no need to keep around the uncompressed copy
-        if ($f -ne $evtc -and (Test-Path $evtc)) {
-            Remove-Item -Path $evtc
-        }
     }
 
     # upload to dps.report
@@ -277,6 +273,9 @@ ForEach($f in $files) {
     }
 }
 
+# Any logs parsed on their own are done
+Stop-SimpleArcParse-Server
+
 # Save the current time as
 $next_upload_time | Select-Object -Property DateTime| ConvertTo-Json | Out-File -Force $last_upload_file
 